@@ -18,6 +18,8 @@ run_writers() {
 ./utils/v4l2loopback-ctl set-caps "$device" 'UYVY:640x480@25/1' || exit 1
 v4l2-ctl -d "$device" -c sustain_framerate=0 || exit 1
 v4l2-ctl -d "$device" -c timeout=2000 || exit 1
+# hand the buffers (and the stream) over to the next writer
+v4l2-ctl -d "$device" -c writer_handover=1 || exit 1
 gst-launch-1.0 videotestsrc num-buffers=1 ! v4l2sink device=$device || exit 1
 {
     run_writers
@@ -0,0 +1,187 @@
+/* -*- c-file-style: "linux" -*- */
+/*
+ * test_ctl_scale.c  --  create, query and remove many loopback devices
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "../v4l2loopback.h"
+
+#define CONTROLDEVICE "/dev/v4l2loopback"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *what, int count, double elapsed)
+{
+	printf("%-8s %5d devices in %8.3f ms (%8.2f us/device)\n", what, count,
+	       elapsed * 1e3, count ? elapsed * 1e6 / count : 0.);
+}
+
+/* the same, using the batch ioctls */
+static int test_batch(int fd, int count)
+{
+	struct v4l2_loopback_config_list list;
+	struct v4l2_loopback_config *configs, *all = 0;
+	int i, ret = 0;
+	double t0;
+
+	configs = calloc(count, sizeof(*configs));
+	if (!configs)
+		return 1;
+	for (i = 0; i < count; i++) {
+		configs[i].output_nr = -1;
+#ifdef SPLIT_DEVICES
+		configs[i].capture_nr = -1;
+#endif
+		configs[i].announce_all_caps = -1;
+	}
+	memset(&list, 0, sizeof(list));
+	list.count = count;
+	list.configs = (__u64)(unsigned long)configs;
+
+	t0 = now();
+	if (ioctl(fd, V4L2LOOPBACK_CTL_ADD_MANY, &list) < 0) {
+		printf("ADD_MANY failed: %s\n", strerror(errno));
+		/* remove the devices that were created nonetheless */
+		if (list.count)
+			ioctl(fd, V4L2LOOPBACK_CTL_REMOVE_MANY, &list);
+		free(configs);
+		return 1;
+	}
+	report("add*", count, now() - t0);
+
+	/* query the number of devices first, then fetch them all */
+	t0 = now();
+	memset(&list, 0, sizeof(list));
+	if (ioctl(fd, V4L2LOOPBACK_CTL_LIST, &list) < 0) {
+		printf("LIST failed: %s\n", strerror(errno));
+		ret = 1;
+	} else {
+		__u32 total = list.count;
+		all = calloc(total, sizeof(*all));
+		list.configs = (__u64)(unsigned long)all;
+		if (!all || ioctl(fd, V4L2LOOPBACK_CTL_LIST, &list) < 0 ||
+		    list.count < (__u32)count) {
+			printf("LIST returned %u devices, expected at least %d\n",
+			       list.count, count);
+			ret = 1;
+		}
+	}
+	report("list*", list.count, now() - t0);
+
+	/* ADD_MANY has filled in the actual device numbers */
+	list.count = count;
+	list.configs = (__u64)(unsigned long)configs;
+	t0 = now();
+	if (ioctl(fd, V4L2LOOPBACK_CTL_REMOVE_MANY, &list) < 0) {
+		printf("REMOVE_MANY failed: %s\n", strerror(errno));
+		ret = 1;
+	}
+	report("remove*", count, now() - t0);
+
+	free(all);
+	free(configs);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *ctldev = CONTROLDEVICE;
+	int count = 200; /* (there are at most 256 video devices) */
+	int *nrs;
+	int created = 0, queried = 0, removed = 0;
+	int fd, i, ret = 0;
+	double t0;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+	if (argc > 2)
+		ctldev = argv[2];
+	if (count <= 0) {
+		printf("usage: %s [<count> [<controldevice>]]\n", argv[0]);
+		return 1;
+	}
+
+	nrs = calloc(count, sizeof(*nrs));
+	if (!nrs)
+		return 1;
+
+	fd = open(ctldev, 0);
+	if (fd < 0) {
+		printf("open(%s) failed: %s\n", ctldev, strerror(errno));
+		return 1;
+	}
+
+	t0 = now();
+	for (i = 0; i < count; i++) {
+		struct v4l2_loopback_config cfg;
+		int ret;
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.output_nr = -1;
+#ifdef SPLIT_DEVICES
+		cfg.capture_nr = -1;
+#endif
+		ret = ioctl(fd, V4L2LOOPBACK_CTL_ADD, &cfg);
+		if (ret < 0) {
+			/* most likely we ran out of video device numbers */
+			printf("ADD #%d failed: %s\n", i, strerror(errno));
+			break;
+		}
+		nrs[created++] = ret;
+	}
+	report("add", created, now() - t0);
+
+	t0 = now();
+	for (i = 0; i < created; i++) {
+		struct v4l2_loopback_config cfg;
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.output_nr = nrs[i];
+		if (ioctl(fd, V4L2LOOPBACK_CTL_QUERY, &cfg) < 0) {
+			printf("QUERY %d failed: %s\n", nrs[i],
+			       strerror(errno));
+			continue;
+		}
+		queried++;
+	}
+	report("query", queried, now() - t0);
+
+	t0 = now();
+	for (i = 0; i < created; i++) {
+		if (ioctl(fd, V4L2LOOPBACK_CTL_REMOVE, nrs[i]) < 0) {
+			printf("REMOVE %d failed: %s\n", nrs[i],
+			       strerror(errno));
+			continue;
+		}
+		removed++;
+	}
+	report("remove", removed, now() - t0);
+
+	if (queried != created || removed != created)
+		ret = 1;
+	else if (created)
+		ret = test_batch(fd, created);
+
+	close(fd);
+	free(nrs);
+
+	return ret;
+}
@@ -0,0 +1,240 @@
+/* -*- c-file-style: "linux" -*- */
+/*
+ * test_progress.c  --  compare the latency of a consumer waiting for the
+ *                      first slice of a frame with one waiting for the
+ *                      whole frame
+ *
+ * the producer fills each frame in <slices> steps (taking a frame time),
+ * publishing its progress after each of them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "../v4l2loopback.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define NBUFFERS 4
+
+static int frames = 100;
+static int fps = 30;
+static int slices = 8;
+static volatile int producer_done;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* writes frames (slice by slice) that start with their creation time */
+static void *producer(void *arg)
+{
+	int fd = *(int *)arg;
+	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	char *maps[NBUFFERS];
+	unsigned int i;
+
+	memset(&req, 0, sizeof(req));
+	req.count = NBUFFERS;
+	req.type = type;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0 || req.count > NBUFFERS) {
+		perror("VIDIOC_REQBUFS");
+		goto done;
+	}
+	for (i = 0; i < req.count; i++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			perror("VIDIOC_QUERYBUF");
+			goto done;
+		}
+		maps[i] = mmap(0, buf.length, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, fd, buf.m.offset);
+		if (maps[i] == MAP_FAILED) {
+			perror("mmap");
+			goto done;
+		}
+	}
+	if (ioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("VIDIOC_STREAMON");
+		goto done;
+	}
+
+	/* a few more frames than the consumer is going to read */
+	for (i = 0; i < (unsigned int)frames + NBUFFERS; i++) {
+		size_t size = WIDTH * HEIGHT * 2, slice = size / slices;
+		struct v4l2_loopback_progress progress;
+		uint64_t t = now_ns();
+		int s;
+
+		memset(&buf, 0, sizeof(buf));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (i < req.count)
+			buf.index = i;
+		else if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("VIDIOC_DQBUF");
+			break;
+		}
+
+		for (s = 1; s <= slices; s++) {
+			memset(maps[buf.index] + (s - 1) * slice, s, slice);
+			if (s == 1)
+				memcpy(maps[buf.index], &t, sizeof(t));
+			memset(&progress, 0, sizeof(progress));
+			progress.index = buf.index;
+			progress.bytesused = s * slice;
+			if (ioctl(fd, VIDIOC_V4L2LOOPBACK_S_PROGRESS,
+				  &progress) < 0)
+				perror("VIDIOC_V4L2LOOPBACK_S_PROGRESS");
+			usleep(1000000 / fps / slices);
+		}
+
+		buf.bytesused = size;
+		if (ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("VIDIOC_QBUF");
+			break;
+		}
+	}
+	ioctl(fd, VIDIOC_STREAMOFF, &type);
+done:
+	producer_done = 1;
+	return 0;
+}
+
+static int consume(int fd, uint32_t want)
+{
+	void *maps[64] = { 0 };
+	uint64_t sum = 0, max = 0, seq = 0;
+	int count = 0;
+
+	while (count < frames && !producer_done) {
+		struct v4l2_loopback_progress progress;
+		uint64_t t, lat;
+
+		memset(&progress, 0, sizeof(progress));
+		progress.sequence = seq;
+		progress.bytesused = want;
+		progress.timeout_ms = 1000;
+		if (ioctl(fd, VIDIOC_V4L2LOOPBACK_WAIT_PROGRESS, &progress) <
+		    0) {
+			if (errno == EPIPE) {
+				/* we fell behind */
+				seq++;
+				continue;
+			}
+			if (errno == EAGAIN)
+				continue;
+			perror("VIDIOC_V4L2LOOPBACK_WAIT_PROGRESS");
+			return 1;
+		}
+		t = now_ns();
+
+		if (progress.index >= 64)
+			return 1;
+		if (!maps[progress.index]) {
+			maps[progress.index] = mmap(0, WIDTH * HEIGHT * 2,
+						    PROT_READ, MAP_SHARED, fd,
+						    progress.offset);
+			if (maps[progress.index] == MAP_FAILED) {
+				perror("mmap");
+				return 1;
+			}
+		}
+		memcpy(&lat, maps[progress.index], sizeof(lat));
+		lat = t - lat;
+		sum += lat;
+		if (lat > max)
+			max = lat;
+		count++;
+		seq++;
+	}
+
+	if (!count) {
+		printf("no frames received\n");
+		return 1;
+	}
+	printf("waiting for %8u bytes: %5d frames, latency avg %8.1f us, "
+	       "max %8.1f us\n",
+	       want, count, sum / 1e3 / count, max / 1e3);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct v4l2_format fmt;
+	pthread_t thread;
+	const char *devname;
+	uint32_t want;
+	int outfd, infd, ret;
+
+	if (argc < 2) {
+		printf("usage: %s <device> [slice|frame [<frames> [<fps> "
+		       "[<slices>]]]]\n",
+		       argv[0]);
+		return 1;
+	}
+	devname = argv[1];
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (argc > 4)
+		fps = atoi(argv[4]);
+	if (argc > 5)
+		slices = atoi(argv[5]);
+	if (frames <= 0 || fps <= 0 || slices <= 0)
+		return 1;
+	want = WIDTH * HEIGHT * 2;
+	if (argc > 2 && !strcmp(argv[2], "slice"))
+		want /= slices;
+
+	outfd = open(devname, O_RDWR);
+	infd = open(devname, O_RDWR);
+	if (outfd < 0 || infd < 0) {
+		printf("open(%s) failed: %s\n", devname, strerror(errno));
+		return 1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = WIDTH;
+	fmt.fmt.pix.height = HEIGHT;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (ioctl(outfd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("VIDIOC_S_FMT");
+		return 1;
+	}
+
+	pthread_create(&thread, 0, producer, &outfd);
+	ret = consume(infd, want);
+
+	pthread_join(thread, 0);
+	close(infd);
+	close(outfd);
+	return ret;
+}
@@ -0,0 +1,267 @@
+/* -*- c-file-style: "linux" -*- */
+/*
+ * test_status_page.c  --  compare frame latency and CPU usage of a consumer
+ *                         using poll()+DQBUF+QBUF with one busy-polling the
+ *                         status page
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "../v4l2loopback.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NBUFFERS 4
+
+static const char *devname;
+static int frames = 300;
+static int fps = 100;
+static volatile int producer_done;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* writes frames that start with their (CLOCK_MONOTONIC) creation time */
+static void *producer(void *arg)
+{
+	int fd = *(int *)arg;
+	size_t size = WIDTH * HEIGHT * 2;
+	char *frame = calloc(1, size);
+	int i;
+
+	/* a few more frames than the consumer is going to read */
+	for (i = 0; frame && i < frames + NBUFFERS; i++) {
+		uint64_t t = now_ns();
+		memcpy(frame, &t, sizeof(t));
+		if (write(fd, frame, size) < 0) {
+			perror("write");
+			break;
+		}
+		usleep(1000000 / fps);
+	}
+	producer_done = 1;
+	free(frame);
+	return 0;
+}
+
+static void report(const char *what, int count, uint64_t latency_sum,
+		   uint64_t latency_max, uint64_t cpu)
+{
+	if (!count) {
+		printf("%-6s no frames received\n", what);
+		return;
+	}
+	printf("%-6s %5d frames: latency avg %8.1f us, max %8.1f us; "
+	       "cpu %8.1f us/frame\n",
+	       what, count, latency_sum / 1e3 / count, latency_max / 1e3,
+	       cpu / 1e3 / count);
+}
+
+static int consume_ioctl(int fd)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	void *maps[NBUFFERS];
+	uint64_t sum = 0, max = 0, cpu;
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+	int count = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.count = NBUFFERS;
+	req.type = type;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0 || req.count > NBUFFERS) {
+		perror("VIDIOC_REQBUFS");
+		return 1;
+	}
+	for (i = 0; i < req.count; i++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			perror("VIDIOC_QUERYBUF");
+			return 1;
+		}
+		maps[i] = mmap(0, buf.length, PROT_READ, MAP_SHARED, fd,
+			       buf.m.offset);
+		if (maps[i] == MAP_FAILED || ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("mmap/VIDIOC_QBUF");
+			return 1;
+		}
+	}
+	if (ioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("VIDIOC_STREAMON");
+		return 1;
+	}
+
+	cpu = cpu_ns();
+	while (count < frames && !producer_done) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		uint64_t t, lat;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("VIDIOC_DQBUF");
+			break;
+		}
+		memcpy(&t, maps[buf.index], sizeof(t));
+		lat = now_ns() - t;
+		sum += lat;
+		if (lat > max)
+			max = lat;
+		count++;
+		ioctl(fd, VIDIOC_QBUF, &buf);
+	}
+	cpu = cpu_ns() - cpu;
+	ioctl(fd, VIDIOC_STREAMOFF, &type);
+	report("ioctl", count, sum, max, cpu);
+	return 0;
+}
+
+static int consume_page(int fd)
+{
+	const volatile struct v4l2_loopback_status *status;
+	void *maps[V4L2LOOPBACK_STATUS_SLOTS] = { 0 };
+	uint64_t sum = 0, max = 0, cpu, last = 0;
+	int count = 0;
+
+	status = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd,
+		      V4L2LOOPBACK_STATUS_PAGE_OFFSET);
+	if (status == MAP_FAILED) {
+		perror("mmap(status page)");
+		return 1;
+	}
+	last = status->write_position;
+
+	cpu = cpu_ns();
+	while (count < frames && !producer_done) {
+		struct v4l2_loopback_status_slot slot;
+		uint64_t pos, t, lat;
+		uint32_t seq, buffer_size;
+
+		/* busy-wait for the next frame */
+		seq = __atomic_load_n(&status->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1 || status->write_position == last)
+			continue;
+		pos = status->write_position;
+		buffer_size = status->buffer_size;
+		slot = *(const struct v4l2_loopback_status_slot *)&status
+				->slots[(pos - 1) % status->used_buffer_count];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (status->seq != seq)
+			continue;
+
+		if (slot.index >= V4L2LOOPBACK_STATUS_SLOTS)
+			break;
+		if (!maps[slot.index]) {
+			maps[slot.index] = mmap(0, buffer_size, PROT_READ,
+						MAP_SHARED, fd, slot.offset);
+			if (maps[slot.index] == MAP_FAILED) {
+				perror("mmap(buffer)");
+				break;
+			}
+		}
+		memcpy(&t, maps[slot.index], sizeof(t));
+		lat = now_ns() - t;
+		sum += lat;
+		if (lat > max)
+			max = lat;
+		count++;
+		last = pos;
+	}
+	cpu = cpu_ns() - cpu;
+	report("page", count, sum, max, cpu);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct v4l2_format fmt;
+	pthread_t thread;
+	const char *mode = "ioctl";
+	int outfd, infd, ret;
+
+	if (argc < 2) {
+		printf("usage: %s <device> [ioctl|page [<frames> [<fps>]]]\n",
+		       argv[0]);
+		return 1;
+	}
+	devname = argv[1];
+	if (argc > 2)
+		mode = argv[2];
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (argc > 4)
+		fps = atoi(argv[4]);
+	if (frames <= 0 || fps <= 0)
+		return 1;
+
+	outfd = open(devname, O_RDWR);
+	infd = open(devname, O_RDWR);
+	if (outfd < 0 || infd < 0) {
+		printf("open(%s) failed: %s\n", devname, strerror(errno));
+		return 1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = WIDTH;
+	fmt.fmt.pix.height = HEIGHT;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (ioctl(outfd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("VIDIOC_S_FMT");
+		return 1;
+	}
+
+	pthread_create(&thread, 0, producer, &outfd);
+	/* let the producer allocate the buffers */
+	usleep(200000);
+
+	if (!strcmp(mode, "page"))
+		ret = consume_page(infd);
+	else
+		ret = consume_ioctl(infd);
+
+	pthread_join(thread, 0);
+	close(infd);
+	close(outfd);
+	return ret;
+}
@@ -0,0 +1,149 @@
+/* -*- c-file-style: "linux" -*- */
+/*
+ * test_synthetic.c  --  measure the latency and the dropped frames of a
+ *                       consumer read()ing the frames of the synthetic
+ *                       source (no producer needed)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "../v4l2loopback.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define FRAMESIZE (WIDTH * HEIGHT * 2)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int set_control(int fd, const char *name, int value)
+{
+	struct v4l2_queryctrl qc;
+	struct v4l2_control ctrl;
+
+	memset(&qc, 0, sizeof(qc));
+	qc.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (!ioctl(fd, VIDIOC_QUERYCTRL, &qc)) {
+		if (!strcmp((char *)qc.name, name)) {
+			ctrl.id = qc.id;
+			ctrl.value = value;
+			return ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+		}
+		qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	static char frame[FRAMESIZE];
+	struct v4l2_loopback_stamp stamp;
+	struct v4l2_streamparm parm;
+	struct v4l2_format fmt;
+	uint64_t sum = 0, max = 0, last = 0, dropped = 0;
+	int frames = 300, fps = 30, mode = 3, count = 0, setupfd, fd;
+
+	if (argc < 2) {
+		printf("usage: %s <device> [bars|counter|stamp [<frames> "
+		       "[<fps>]]]\n",
+		       argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		mode = !strcmp(argv[2], "bars")	   ? 1 :
+		       !strcmp(argv[2], "counter") ? 2 :
+						     3;
+	if (argc > 3)
+		frames = atoi(argv[3]);
+	if (argc > 4)
+		fps = atoi(argv[4]);
+	if (frames <= 0 || fps <= 0)
+		return 1;
+
+	setupfd = open(argv[1], O_RDWR);
+	fd = open(argv[1], O_RDWR);
+	if (setupfd < 0 || fd < 0) {
+		printf("open(%s) failed: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	/* the source writes in the format (and at the rate) of the device,
+	 * which is kept once the opener that set it is gone */
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = WIDTH;
+	fmt.fmt.pix.height = HEIGHT;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (ioctl(setupfd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("VIDIOC_S_FMT");
+		return 1;
+	}
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	parm.parm.output.timeperframe.numerator = 1;
+	parm.parm.output.timeperframe.denominator = fps;
+	if (ioctl(setupfd, VIDIOC_S_PARM, &parm) < 0)
+		perror("VIDIOC_S_PARM");
+	if (set_control(setupfd, "keep_format", 1) < 0) {
+		perror("keep_format");
+		return 1;
+	}
+	close(setupfd);
+	if (set_control(fd, "synthetic_source", mode) < 0) {
+		perror("synthetic_source");
+		return 1;
+	}
+
+	while (count < frames) {
+		uint64_t lat;
+
+		if (read(fd, frame, sizeof(frame)) < (ssize_t)sizeof(stamp)) {
+			perror("read");
+			break;
+		}
+		lat = now_ns();
+		memcpy(&stamp, frame, sizeof(stamp));
+		lat -= stamp.timestamp_ns;
+		if (count && stamp.sequence > last + 1)
+			dropped += stamp.sequence - last - 1;
+		last = stamp.sequence;
+		sum += lat;
+		if (lat > max)
+			max = lat;
+		count++;
+	}
+
+	set_control(fd, "synthetic_source", 0);
+	close(fd);
+	if (!count) {
+		printf("no frames received\n");
+		return 1;
+	}
+	printf("%d frames @ %d fps: latency avg %8.1f us, max %8.1f us; "
+	       "%llu dropped\n",
+	       count, fps, sum / 1e3 / count, max / 1e3,
+	       (unsigned long long)dropped);
+	return 0;
+}
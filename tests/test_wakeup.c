@@ -0,0 +1,196 @@
+/* -*- c-file-style: "linux" -*- */
+/*
+ * test_wakeup.c  --  measure context switches and CPU usage of consumers
+ *                    reading high frame-rate streams, depending on their
+ *                    'wakeup_frames' setting
+ *
+ * for each device given, a producer writes frames at the requested rate,
+ * and a consumer read()s them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#define WIDTH 320
+#define HEIGHT 240
+#define FRAMESIZE (WIDTH * HEIGHT * 2)
+
+static int fps = 1000;
+static int duration = 5;
+static int wakeup_frames = 1;
+
+struct result {
+	long frames;
+	long nvcsw; /* voluntary context switches */
+	long nivcsw; /* involuntary context switches */
+	double cpu; /* seconds */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int set_control(int fd, const char *name, int value)
+{
+	struct v4l2_queryctrl qc;
+	struct v4l2_control ctrl;
+
+	memset(&qc, 0, sizeof(qc));
+	qc.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (!ioctl(fd, VIDIOC_QUERYCTRL, &qc)) {
+		if (!strcmp((char *)qc.name, name)) {
+			ctrl.id = qc.id;
+			ctrl.value = value;
+			return ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+		}
+		qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+static void producer(const char *devname)
+{
+	struct v4l2_format fmt;
+	struct timespec next;
+	static char frame[FRAMESIZE];
+	int fd = open(devname, O_RDWR);
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = WIDTH;
+	fmt.fmt.pix.height = HEIGHT;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (fd < 0 || ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+		printf("producer(%s) failed: %s\n", devname, strerror(errno));
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		if (write(fd, frame, sizeof(frame)) < 0) {
+			perror("write");
+			exit(1);
+		}
+		next.tv_nsec += 1000000000L / fps;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0);
+	}
+}
+
+static void consumer(const char *devname, int resultfd)
+{
+	static char frame[FRAMESIZE];
+	struct result res;
+	struct rusage ru;
+	double stop;
+	int fd = open(devname, O_RDWR);
+
+	if (fd < 0) {
+		printf("consumer(%s) failed: %s\n", devname, strerror(errno));
+		exit(1);
+	}
+	if (set_control(fd, "wakeup_frames", wakeup_frames) < 0)
+		printf("cannot set wakeup_frames on %s: %s\n", devname,
+		       strerror(errno));
+
+	memset(&res, 0, sizeof(res));
+	stop = now() + duration;
+	while (now() < stop) {
+		if (read(fd, frame, sizeof(frame)) < 0) {
+			perror("read");
+			break;
+		}
+		res.frames++;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	res.nvcsw = ru.ru_nvcsw;
+	res.nivcsw = ru.ru_nivcsw;
+	res.cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		  (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+	if (write(resultfd, &res, sizeof(res)) != sizeof(res))
+		perror("write(result)");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	struct result total;
+	pid_t *producers;
+	int ndevices, i, pipefd[2];
+
+	if (argc < 5) {
+		printf("usage: %s <fps> <seconds> <wakeup_frames> <device>...\n",
+		       argv[0]);
+		return 1;
+	}
+	fps = atoi(argv[1]);
+	duration = atoi(argv[2]);
+	wakeup_frames = atoi(argv[3]);
+	ndevices = argc - 4;
+	if (fps <= 0 || duration <= 0 || wakeup_frames <= 0)
+		return 1;
+	if (pipe(pipefd) < 0)
+		return 1;
+
+	producers = calloc(ndevices, sizeof(*producers));
+	for (i = 0; i < ndevices; i++) {
+		producers[i] = fork();
+		if (!producers[i])
+			producer(argv[4 + i]);
+	}
+	/* let the producers set up their devices */
+	usleep(200000);
+	for (i = 0; i < ndevices; i++) {
+		if (!fork())
+			consumer(argv[4 + i], pipefd[1]);
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < ndevices; i++) {
+		struct result res;
+		if (read(pipefd[0], &res, sizeof(res)) != sizeof(res))
+			break;
+		total.frames += res.frames;
+		total.nvcsw += res.nvcsw;
+		total.nivcsw += res.nivcsw;
+		total.cpu += res.cpu;
+	}
+	for (i = 0; i < ndevices; i++)
+		kill(producers[i], SIGTERM);
+	while (wait(0) > 0)
+		;
+
+	printf("%d consumers @ %d fps, wakeup_frames=%d: %.0f frames/s, "
+	       "%.0f context switches/s (%.0f involuntary), cpu %.1f%%\n",
+	       ndevices, fps, wakeup_frames, (double)total.frames / duration,
+	       (double)total.nvcsw / duration,
+	       (double)total.nivcsw / duration, 100. * total.cpu / duration);
+	free(producers);
+	return 0;
+}
@@ -286,6 +286,8 @@ typedef enum {
 	SET_CAPS,
 	GET_CAPS,
 	SET_TIMEOUTIMAGE,
+	LINK,
+	UNLINK,
 	MOO,
 	_UNKNOWN
 } t_command;
@@ -326,6 +328,7 @@ static void help_add(const char *program, int detail)
 	      "[OPTIONS] [<outputdevice> [<capturedevice>]]",
 	      "create/add a new loopback-device",
 	      "\n\t-b <num>, --buffers <num>     buffers to queue"
+	      "\n\t-c <num>, --count <num>       create <num> devices at once (with the same settings)"
 	      "\n\t-h <h>, --max-height <h>      maximum allowed frame height"
 	      "\n\t-n <name>, --name <name>      pretty name for the device"
 	      "\n\t-o <num>, --max-openers <num> maximum allowed concurrent openers"
@@ -411,7 +414,24 @@ static void help_settimeoutimage(const char *program, int detail)
 	      "\n\t-v, --verbose                      raise verbosity (print what is being done)"
 	      "\n"
 	      "\n  <device>\teither specify a device name (e.g. '/dev/video1') or a device number ('1')."
-	      "\n   <image>\timage file");
+	      "\n   <image>\timage file, or one of the built-in patterns:"
+	      "\n\t\t'#RRGGBB' (a solid colour, e.g. '#000000' for black), 'bars' (colour bars)"
+	      "\n\t\tor 'zero' (all bytes zero)");
+}
+static void help_link(const char *program, int detail)
+{
+	_help(detail, "Linking Devices", program, "link",
+	      "<sourcedevice> <sinkdevice>",
+	      "let the readers of a loopback device get the frames written to another one",
+	      "\n  <sourcedevice>\tthe device being written to."
+	      "\n  <sinkdevice>\tan unused device that mirrors the <sourcedevice> (and cannot be written to itself)."
+	      "\n          \teither specify a device name (e.g. '/dev/video1') or a device number ('1').");
+}
+static void help_unlink(const char *program, int detail)
+{
+	_help(detail, "Unlinking Devices", program, "unlink", "<sinkdevice>",
+	      "undo 'link' for an unused loopback device",
+	      "\n  <sinkdevice>\teither specify a device name (e.g. '/dev/video1') or a device number ('1').");
 }
 static void help_none(const char *program, int detail)
 {
@@ -440,6 +460,10 @@ static t_help get_help(t_command cmd)
 		return help_getcaps;
 	case SET_TIMEOUTIMAGE:
 		return help_settimeoutimage;
+	case LINK:
+		return help_link;
+	case UNLINK:
+		return help_unlink;
 	}
 	return help_none;
 }
@@ -616,6 +640,62 @@ static int add_device(int fd, struct v4l2_loopback_config *cfg, int verbose)
 	return err;
 }
 
+static int add_devices(int fd, struct v4l2_loopback_config *cfg, int count,
+		       int verbose)
+{
+	struct v4l2_loopback_config_list list;
+	struct v4l2_loopback_config *configs = 0;
+	int err = 0;
+	int i;
+
+	memset(&list, 0, sizeof(list));
+	/* always pass an array, so we get the resulting devices back */
+	configs = calloc(count, sizeof(*configs));
+	if (!configs) {
+		perror("failed to create devices");
+		return ENOMEM;
+	}
+	for (i = 0; i < count; i++) {
+		if (cfg) {
+			configs[i] = *cfg;
+		} else {
+			configs[i].output_nr = -1;
+#ifdef SPLIT_DEVICES
+			configs[i].capture_nr = -1;
+#endif
+			configs[i].announce_all_caps = -1;
+		}
+	}
+	list.count = count;
+	list.configs = (__u64)(unsigned long)configs;
+
+	MARK();
+	if (ioctl(fd, V4L2LOOPBACK_CTL_ADD_MANY, &list) < 0) {
+		err = errno;
+		if (ENOSYS == err || ENOTTY == err) {
+			free(configs);
+			/* older module: add the devices one by one */
+			for (i = 0; i < count; i++) {
+				err = add_device(fd, cfg, verbose);
+				if (err)
+					break;
+			}
+			return err;
+		}
+		perror("failed to create devices");
+		/* the devices that were created nonetheless */
+		count = list.count;
+	}
+	MARK();
+	for (i = 0; i < count; i++) {
+		printf("/dev/video%d\n", configs[i].output_nr);
+		if (verbose > 0)
+			print_conf(configs + i, 0);
+	}
+	free(configs);
+	return err;
+}
+
 static int delete_device(int fd, const char *devicename)
 {
 	int err = 0;
@@ -632,6 +712,73 @@ static int delete_device(int fd, const char *devicename)
 	return err;
 }
 
+/* delete all devices with a single V4L2LOOPBACK_CTL_REMOVE_MANY call
+ * (if one of them cannot be deleted, none is)
+ * returns -1 if the module does not support it (so the caller can fall back
+ * to deleting (and reporting) the devices one by one) */
+static int delete_devices(int fd, int argc, char **argv)
+{
+	struct v4l2_loopback_config_list list;
+	struct v4l2_loopback_config *configs;
+	int i, ret;
+
+	configs = calloc(argc, sizeof(*configs));
+	if (!configs)
+		return -1;
+	for (i = 0; i < argc; i++) {
+		configs[i].output_nr = parse_device(argv[i]);
+		if (configs[i].output_nr < 0) {
+			free(configs);
+			return -1;
+		}
+	}
+	memset(&list, 0, sizeof(list));
+	list.count = argc;
+	list.configs = (__u64)(unsigned long)configs;
+	ret = ioctl(fd, V4L2LOOPBACK_CTL_REMOVE_MANY, &list);
+	free(configs);
+	if (ret < 0) {
+		ret = errno;
+		if (ENOSYS == ret || ENOTTY == ret)
+			return -1;
+		perror("failed to delete devices (none was deleted)");
+	}
+	return ret;
+}
+
+static int link_devices(int fd, const char *source, const char *sink)
+{
+	struct v4l2_loopback_link link;
+
+	memset(&link, 0, sizeof(link));
+	link.source_nr = parse_device(source);
+	link.sink_nr = parse_device(sink);
+	if (link.source_nr < 0 || link.sink_nr < 0) {
+		dprintf(2, "illegal devicename '%s'\n",
+			(link.source_nr < 0) ? source : sink);
+		return 1;
+	}
+	if (ioctl(fd, V4L2LOOPBACK_CTL_LINK, &link) < 0) {
+		perror(sink);
+		return 1;
+	}
+	return 0;
+}
+
+static int unlink_device(int fd, const char *sink)
+{
+	int dev = parse_device(sink);
+	if (dev < 0) {
+		dprintf(2, "illegal devicename '%s'\n", sink);
+		return 1;
+	}
+	if (ioctl(fd, V4L2LOOPBACK_CTL_UNLINK, dev) < 0) {
+		perror(sink);
+		return 1;
+	}
+	return 0;
+}
+
 static int query_device(int fd, const char *devicename, int escape)
 {
 	int err;
@@ -657,6 +804,56 @@ static int query_device(int fd, const char *devicename, int escape)
 	}
 	return err;
 }
+/* list devices with a single V4L2LOOPBACK_CTL_LIST call
+ * returns -1 if the module does not support it */
+static int list_devices_fast(int fd, int escape)
+{
+	struct v4l2_loopback_config_list list;
+	struct v4l2_loopback_config *configs = 0;
+	__u32 i;
+
+	/* get the number of devices first; retry if devices have been added
+	 * in the meantime */
+	memset(&list, 0, sizeof(list));
+	if (ioctl(fd, V4L2LOOPBACK_CTL_LIST, &list) < 0)
+		return -1;
+	while (list.count) {
+		__u32 count = list.count;
+		struct v4l2_loopback_config *c =
+			realloc(configs, count * sizeof(*configs));
+		if (!c) {
+			free(configs);
+			return -1;
+		}
+		configs = c;
+		list.configs = (__u64)(unsigned long)configs;
+		if (ioctl(fd, V4L2LOOPBACK_CTL_LIST, &list) < 0) {
+			free(configs);
+			return -1;
+		}
+		if (list.count <= count)
+			break;
+	}
+
+	if (list.count) {
+		dprintf(2, "OUTPUT       \tCAPTURE      \tNAME\n");
+	} else {
+		dprintf(2, "no loopback devices found\n");
+	}
+	for (i = 0; i < list.count; i++) {
+		int output_nr, capture_nr;
+		output_nr = capture_nr = configs[i].output_nr;
+#ifdef SPLIT_DEVICES
+		capture_nr = configs[i].capture_nr;
+#endif
+		printf("/dev/video%-3d\t/dev/video%-3d\t", output_nr,
+		       capture_nr);
+		printf_raw(configs[i].card_label, escape);
+		printf("\n");
+	}
+	free(configs);
+	return 0;
+}
 static int list_devices(int fd, int escape)
 {
 	struct devnode_ {
@@ -666,6 +863,9 @@ static int list_devices(int fd, int escape)
 	size_t numdevices = 0, i;
 	glob_t globbuf = { 0 };
 	int output_nr, capture_nr;
+	if (!list_devices_fast(fd, escape))
+		return 0;
+	/* fallback for older modules: scan sysfs for loopback devices */
 	glob("/sys/devices/virtual/video4linux/video*", GLOB_ONLYDIR, 0,
 	     &globbuf);
 	if (globbuf.gl_pathc) {
@@ -1054,10 +1254,88 @@ static int get_caps(const char *devicename)
 	}
 	return 0;
 }
+/* sets the timeout (if >=0) and complains if it is disabled */
+static int check_timeout(const char *devicename, int timeout)
+{
+	int fd = open_videodevice(devicename, O_RDWR);
+	if (fd < 0)
+		return errno;
+	if (timeout < 0) {
+		timeout = get_control_i(fd, "timeout");
+	} else {
+		dprintf(2, "v4l2-ctl -d %s -c timeout=%d\n", devicename,
+			timeout);
+		timeout = set_control_i(fd, "timeout", timeout);
+	}
+	if (timeout <= 0) {
+		dprintf(2,
+			"Timeout is currently disabled; you can set it to some positive value, e.g.:\n");
+		dprintf(2, "    $  v4l2-ctl -d %s -c timeout=3000\n",
+			devicename);
+	}
+	close(fd);
+	return 0;
+}
+
+/* use one of the timeout patterns generated by the driver */
+static int set_timeoutpattern(const char *devicename, const char *pattern,
+			      int timeout, int verbose)
+{
+	struct v4l2_control ctrl;
+	int colour = -1, value;
+	int fd, err = 0;
+
+	if (!strncmp(pattern, "zero", 5)) {
+		value = 0;
+	} else if (!strncmp(pattern, "bars", 5)) {
+		value = 2;
+	} else {
+		char *endptr = 0;
+		value = 1;
+		colour = strtol(pattern + 1, &endptr, 16);
+		if (strlen(pattern) != 7 || *endptr || colour < 0) {
+			dprintf(2, "invalid colour '%s' (use '#RRGGBB')\n",
+				pattern);
+			return 1;
+		}
+	}
+	if (verbose)
+		printf("set-timeout-image '%s' for '%s' with %dms timeout\n",
+		       pattern, devicename, timeout);
+
+	fd = open_videodevice(devicename, O_RDWR);
+	if (fd < 0)
+		return errno;
+	memset(&ctrl, 0, sizeof(ctrl));
+	if (colour >= 0) {
+		dprintf(2, "v4l2-ctl -d %s -c timeout_colour=0x%06x\n",
+			devicename, colour);
+		ctrl.id = _get_control_id(fd, "timeout_colour");
+		ctrl.value = colour;
+		if (!ctrl.id || ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+			err = ctrl.id ? errno : ENOTTY;
+	}
+	if (!err) {
+		dprintf(2, "v4l2-ctl -d %s -c timeout_pattern=%d\n",
+			devicename, value);
+		ctrl.id = _get_control_id(fd, "timeout_pattern");
+		ctrl.value = value;
+		if (!ctrl.id || ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+			err = ctrl.id ? errno : ENOTTY;
+	}
+	close(fd);
+	if (err) {
+		dprintf(2, "ERROR: setting time-out pattern failed: %s\n",
+			strerror(err));
+		return err;
+	}
+	return check_timeout(devicename, timeout);
+}
+
 static int set_timeoutimage(const char *devicename, const char *imagefile,
 			    int timeout, int verbose)
 {
-	int err = 0;
+	int err = 0, result;
 	int fd = -1;
 	char imagearg[4096], imagefile2[4096], devicearg[4096];
 	char *args[] = { "gst-launch-1.0",
@@ -1078,6 +1356,10 @@ static int set_timeoutimage(const char *devicename, const char *imagefile,
 			 "show-preroll-frame=false",
 			 0,
 			 0 };
+	if ('#' == imagefile[0] || !strncmp(imagefile, "bars", 5) ||
+	    !strncmp(imagefile, "zero", 5))
+		return set_timeoutpattern(devicename, imagefile, timeout,
+					  verbose);
 	if (verbose)
 		printf("set-timeout-image '%s' for '%s' with %dms timeout\n",
 		       imagefile, devicename, timeout);
@@ -1119,28 +1401,9 @@ static int set_timeoutimage(const char *devicename, const char *imagefile,
 	dprintf(2,
 		"^======================================================================^\n");
 
-	fd = open_videodevice(devicename, O_RDWR);
-	if (fd >= 0) {
-		/* finally check the timeout */
-		if (timeout < 0) {
-			timeout = get_control_i(fd, "timeout");
-		} else {
-			dprintf(2, "v4l2-ctl -d %s -c timeout=%d\n", devicename,
-				timeout);
-			timeout = set_control_i(fd, "timeout", timeout);
-		}
-		if (timeout <= 0) {
-			dprintf(2,
-				"Timeout is currently disabled; you can set it to some positive value, e.g.:\n");
-			dprintf(2, "    $  v4l2-ctl -d %s -c timeout=3000\n",
-				devicename);
-		}
-
-		close(fd);
-	} else {
-		err = errno;
-	}
-	return err;
+	/* finally check the timeout */
+	result = check_timeout(devicename, timeout);
+	return result ? result : err;
 }
 
 static t_command get_command(const char *command)
@@ -1173,6 +1436,10 @@ static t_command get_command(const char *command)
 		return GET_CAPS;
 	if (!strncmp(command, "set-timeout-image", 18))
 		return SET_TIMEOUTIMAGE;
+	if (!strncmp(command, "link", 5))
+		return LINK;
+	if (!strncmp(command, "unlink", 7))
+		return UNLINK;
 	if (!strncmp(command, "moo", 10))
 		return MOO;
 	return _UNKNOWN;
@@ -1252,11 +1519,12 @@ int main(int argc, char **argv)
 	int exclusive_caps = -1;
 	int buffers = -1;
 	int openers = -1;
+	int count = 1;
 	int escape_strings = 0;
 
 	int ret = 0;
 
-	static const char add_options_short[] = "?vn:w:h:x:b:o:";
+	static const char add_options_short[] = "?vn:w:h:x:b:o:c:";
 	static const struct option add_options_long[] = {
 		{ "help", no_argument, NULL, '?' },
 		{ "verbose", no_argument, NULL, 'v' },
@@ -1268,6 +1536,7 @@ int main(int argc, char **argv)
 		{ "exclusive-caps", required_argument, NULL, 'x' },
 		{ "buffers", required_argument, NULL, 'b' },
 		{ "max-openers", required_argument, NULL, 'o' },
+		{ "count", required_argument, NULL, 'c' },
 		{ 0, 0, 0, 0 }
 	};
 	static const char list_options_short[] = "?he";
@@ -1365,6 +1634,9 @@ int main(int argc, char **argv)
 			case 'o':
 				openers = my_atoi("openers", optarg);
 				break;
+			case 'c':
+				count = my_atoi("count", optarg);
+				break;
 			default:
 				usage_topic(progname, cmd, argc - 1, argv + 1);
 				return 1;
@@ -1385,8 +1657,18 @@ int main(int argc, char **argv)
 				min_height, max_height);
 			return 1;
 		}
+		if (count < 1) {
+			dprintf(2, "count (%d) must be at least 1\n", count);
+			return 1;
+		}
+		if (count > 1 && argc) {
+			dprintf(2,
+				"cannot create %d devices with the same device number\n",
+				count);
+			return 1;
+		}
 		do {
-			struct v4l2_loopback_config cfg;
+			struct v4l2_loopback_config cfg, *confptr;
 			int capture_nr = -1, output_nr = -1;
 			switch (argc) {
 			case 0:
@@ -1411,13 +1693,14 @@ int main(int argc, char **argv)
 				usage_topic(progname, cmd, argc, argv);
 				return 1;
 			}
-			ret = add_device(fd,
-					 make_conf(&cfg, label, min_width,
-						   max_width, min_height,
-						   max_height, exclusive_caps,
-						   buffers, openers, capture_nr,
-						   output_nr),
-					 verbose);
+			confptr = make_conf(&cfg, label, min_width, max_width,
+					    min_height, max_height,
+					    exclusive_caps, buffers, openers,
+					    capture_nr, output_nr);
+			if (count > 1)
+				ret = add_devices(fd, confptr, count, verbose);
+			else
+				ret = add_device(fd, confptr, verbose);
 		} while (0);
 		break;
 	case DELETE:
@@ -1428,6 +1711,13 @@ int main(int argc, char **argv)
 		if (!argc)
 			usage_topic(progname, cmd, argc, argv);
 		fd = open_controldevice();
+		if (argc > 1) {
+			int err = delete_devices(fd, argc, argv);
+			if (err >= 0) {
+				ret = err;
+				break;
+			}
+		}
 		for (i = 0; i < argc; i++) {
 			int err = delete_device(fd, argv[i]);
 			if (err)
@@ -1537,6 +1827,24 @@ int main(int argc, char **argv)
 					       verbose);
 		}
 		break;
+	case LINK:
+		optind = do_defaultargs(progname, cmd, argc, argv);
+		argc -= optind;
+		argv += optind;
+		if (argc != 2)
+			usage_topic(progname, cmd, argc, argv);
+		fd = open_controldevice();
+		ret = link_devices(fd, argv[0], argv[1]);
+		break;
+	case UNLINK:
+		optind = do_defaultargs(progname, cmd, argc, argv);
+		argc -= optind;
+		argv += optind;
+		if (argc != 1)
+			usage_topic(progname, cmd, argc, argv);
+		fd = open_controldevice();
+		ret = unlink_device(fd, argv[0]);
+		break;
 	case VERSION:
 #ifdef SNAPSHOT_VERSION
 		printf("%s v%s\n", progname, SNAPSHOT_VERSION);
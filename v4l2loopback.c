@@ -24,6 +24,12 @@
 #include <linux/fs.h>
 #include <linux/capability.h>
 #include <linux/eventpoll.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/kref.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-device.h>
@@ -33,6 +39,9 @@
 #include <linux/miscdevice.h>
 #include "v4l2loopback.h"
 
+#define CREATE_TRACE_POINTS
+#include "v4l2loopback_trace.h"
+
 #define V4L2LOOPBACK_CTL_ADD_legacy 0x4C80
 #define V4L2LOOPBACK_CTL_REMOVE_legacy 0x4C81
 #define V4L2LOOPBACK_CTL_QUERY_legacy 0x4C82
@@ -43,6 +52,11 @@
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
 #define strscpy strlcpy
+#define DEFINE_STATIC_KEY_FALSE(name) \
+	struct static_key name = STATIC_KEY_INIT_FALSE
+#define static_branch_unlikely(key) static_key_false(key)
+#define static_branch_inc(key) static_key_slow_inc(key)
+#define static_branch_dec(key) static_key_slow_dec(key)
 #endif
 
 #if defined(timer_setup) && defined(from_timer)
@@ -57,6 +71,40 @@
 #define timer_delete_sync del_timer_sync
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 7, 0)
+#define down_write_killable(sem) (down_write(sem), 0)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+#define down_read_killable(sem) (down_read(sem), 0)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define vm_flags_clear(vma, flags) ((vma)->vm_flags &= ~(flags))
+#define vm_flags_set(vma, flags) ((vma)->vm_flags |= (flags))
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+typedef int vm_fault_t;
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+static inline void *memset32(uint32_t *s, uint32_t v, size_t count)
+{
+	uint32_t *xs = s;
+	while (count--)
+		*xs++ = v;
+	return s;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+#define v4l2l_ctrl_add_handler(hdl, add) v4l2_ctrl_add_handler(hdl, add, NULL)
+#else
+#define v4l2l_ctrl_add_handler(hdl, add) \
+	v4l2_ctrl_add_handler(hdl, add, NULL, false)
+#endif
+
 #define V4L2LOOPBACK_VERSION_CODE                                              \
 	KERNEL_VERSION(V4L2LOOPBACK_VERSION_MAJOR, V4L2LOOPBACK_VERSION_MINOR, \
 		       V4L2LOOPBACK_VERSION_BUGFIX)
@@ -78,26 +126,46 @@ MODULE_LICENSE("GPL");
 /*
  * helpers
  */
+/* all debug output is behind a static key that is only enabled while the
+ * module-wide 'debug' parameter or the 'debug' level of any device is set,
+ * so (the arguments of) disabled debug messages cost nothing at all */
+static DEFINE_STATIC_KEY_FALSE(v4l2loopback_debug_key);
+#define v4l2l_debug_enabled() static_branch_unlikely(&v4l2loopback_debug_key)
+
 #define dprintk(fmt, args...)                                          \
 	do {                                                           \
-		if (debug > 0) {                                       \
+		if (v4l2l_debug_enabled() && debug > 0) {              \
 			printk(KERN_INFO "v4l2-loopback[" __stringify( \
 				       __LINE__) "], pid(%d):  " fmt,  \
 			       task_pid_nr(current), ##args);          \
 		}                                                      \
 	} while (0)
 
+/* function tracing (module-wide only, it is not about a particular device) */
 #define MARK()                                                             \
 	do {                                                               \
-		if (debug > 1) {                                           \
+		if (v4l2l_debug_enabled() && debug > 1) {                  \
 			printk(KERN_INFO "%s:%d[%s], pid(%d)\n", __FILE__, \
 			       __LINE__, __func__, task_pid_nr(current));  \
 		}                                                          \
 	} while (0)
 
-#define dprintkrw(fmt, args...)                                        \
+/* messages about a device, enabled by the module-wide or its own level */
+#define dprintkdev(dev, fmt, args...)                                  \
+	do {                                                           \
+		if (v4l2l_debug_enabled() &&                           \
+		    max(debug, (dev)->debug) > 0) {                    \
+			printk(KERN_INFO "v4l2-loopback[" __stringify( \
+				       __LINE__) "], pid(%d):  " fmt,  \
+			       task_pid_nr(current), ##args);          \
+		}                                                      \
+	} while (0)
+
+/* per-frame messages, enabled by the module-wide or the per-device level */
+#define dprintkrw(dev, fmt, args...)                                   \
 	do {                                                           \
-		if (debug > 2) {                                       \
+		if (v4l2l_debug_enabled() &&                           \
+		    max(debug, (dev)->debug) > 2) {                    \
 			printk(KERN_INFO "v4l2-loopback[" __stringify( \
 				       __LINE__) "], pid(%d): " fmt,   \
 			       task_pid_nr(current), ##args);          \
@@ -143,7 +211,10 @@ typedef unsigned __poll_t;
  *	make KCPPFLAGS="-DMAX_DEVICES=100"
  */
 
-/* maximum number of v4l2loopback devices that can be created */
+/* maximum number of v4l2loopback devices that can be configured individually
+ * at module load time (via the 'video_nr', 'card_label' and 'exclusive_caps'
+ * parameters); any further 'devices' are created with default settings.
+ * devices added at runtime via /dev/v4l2loopback are not limited by this */
 #ifndef MAX_DEVICES
 #define MAX_DEVICES 8
 #endif
@@ -163,6 +234,12 @@ typedef unsigned __poll_t;
 #ifndef MAX_BUFFERS
 #define MAX_BUFFERS 32
 #endif
+#if MAX_BUFFERS > V4L2LOOPBACK_STATUS_SLOTS
+#error MAX_BUFFERS exceeds the number of slots on the status page
+#endif
+
+/* v4l2_loopback_meta.sequence of a slot that does not hold a frame (yet) */
+#define V4L2L_META_INVALID (~0ULL)
 
 /* module parameters */
 #define V4L2LOOPBACK_DEFAULT_ALLOWED_GID UINT_MAX
@@ -171,7 +248,13 @@ module_param(allowed_gid, uint, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(allowed_gid, "only allow access to this GID");
 
 static int debug = 0;
-module_param(debug, int, S_IRUGO | S_IWUSR);
+static int v4l2loopback_set_debug(const char *val,
+				  const struct kernel_param *kp);
+static const struct kernel_param_ops v4l2loopback_debug_ops = {
+	.set = v4l2loopback_set_debug,
+	.get = param_get_int,
+};
+module_param_cb(debug, &v4l2loopback_debug_ops, &debug, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(debug, "debugging level (higher values == more verbose)");
 
 #define V4L2LOOPBACK_DEFAULT_MAX_BUFFERS 2
@@ -240,8 +323,12 @@ MODULE_PARM_DESC(max_height,
 		 "maximum allowed frame height [DEFAULT: " __stringify(
 			 V4L2LOOPBACK_SIZE_DEFAULT_MAX_HEIGHT) "]");
 
+/* devices by their (internal) index, and by their video device number
+ * (e.g. '3' for /dev/video3) */
 static DEFINE_IDR(v4l2loopback_index_idr);
-static DEFINE_MUTEX(v4l2loopback_ctl_mutex);
+static DEFINE_IDR(v4l2loopback_nr_idr);
+/* serializes adding/removing devices; queries only need to exclude those */
+static DECLARE_RWSEM(v4l2loopback_ctl_rwsem);
 
 /* frame intervals */
 #define V4L2LOOPBACK_FRAME_INTERVAL_MAX __UINT32_MAX__
@@ -254,11 +341,26 @@ static DEFINE_MUTEX(v4l2loopback_ctl_mutex);
 #define CID_SUSTAIN_FRAMERATE (V4L2LOOPBACK_CID_BASE + 1)
 #define CID_TIMEOUT (V4L2LOOPBACK_CID_BASE + 2)
 #define CID_TIMEOUT_IMAGE_IO (V4L2LOOPBACK_CID_BASE + 3)
+#define CID_TIMEOUT_PATTERN (V4L2LOOPBACK_CID_BASE + 8)
+#define CID_TIMEOUT_COLOUR (V4L2LOOPBACK_CID_BASE + 9)
+#define CID_WRITER_HANDOVER (V4L2LOOPBACK_CID_BASE + 10)
+#define CID_COMPRESSED_SIZE (V4L2LOOPBACK_CID_BASE + 11)
+#define CID_TILED_OUTPUT (V4L2LOOPBACK_CID_BASE + 12)
+#define CID_SYNTHETIC_SOURCE (V4L2LOOPBACK_CID_BASE + 13)
+/* per-opener controls */
+#define CID_MAX_BACKLOG (V4L2LOOPBACK_CID_BASE + 4)
+#define CID_MAX_FRAME_AGE (V4L2LOOPBACK_CID_BASE + 5)
+#define CID_WAKEUP_FRAMES (V4L2LOOPBACK_CID_BASE + 6)
+#define CID_WAKEUP_TIMEOUT (V4L2LOOPBACK_CID_BASE + 7)
 
 static int v4l2loopback_s_ctrl(struct v4l2_ctrl *ctrl);
 static const struct v4l2_ctrl_ops v4l2loopback_ctrl_ops = {
 	.s_ctrl = v4l2loopback_s_ctrl,
 };
+static int v4l2loopback_opener_s_ctrl(struct v4l2_ctrl *ctrl);
+static const struct v4l2_ctrl_ops v4l2loopback_opener_ctrl_ops = {
+	.s_ctrl = v4l2loopback_opener_s_ctrl,
+};
 static const struct v4l2_ctrl_config v4l2loopback_ctrl_keepformat = {
 	// clang-format off
 	.ops	= &v4l2loopback_ctrl_ops,
@@ -307,6 +409,171 @@ static const struct v4l2_ctrl_config v4l2loopback_ctrl_timeoutimageio = {
 	.def	= 0,
 	// clang-format on
 };
+/* what the timeout image looks like (unless set via timeout_image_io) */
+enum v4l2l_timeout_pattern {
+	V4L2L_TIMEOUT_PATTERN_ZERO = 0, /* all bytes zero */
+	V4L2L_TIMEOUT_PATTERN_COLOUR = 1, /* solid 'timeout_colour' */
+	V4L2L_TIMEOUT_PATTERN_BARS = 2, /* colour bars */
+	/* (not a control value) */
+	V4L2L_TIMEOUT_PATTERN_USER = 3, /* set via timeout_image_io */
+};
+static const char *const v4l2loopback_timeout_patterns[] = {
+	"zero",
+	"colour",
+	"bars",
+	NULL,
+};
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_timeoutpattern = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_TIMEOUT_PATTERN,
+	.name	= "timeout_pattern",
+	.type	= V4L2_CTRL_TYPE_MENU,
+	.min	= 0,
+	.max	= V4L2L_TIMEOUT_PATTERN_BARS,
+	.def	= V4L2L_TIMEOUT_PATTERN_ZERO,
+	.qmenu	= v4l2loopback_timeout_patterns,
+	// clang-format on
+};
+/* 0xRRGGBB */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_timeoutcolour = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_TIMEOUT_COLOUR,
+	.name	= "timeout_colour",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= 0xffffff,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+/* keep the ring (and the stream) for the next writer when a writer stops */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_writerhandover = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_WRITER_HANDOVER,
+	.name	= "writer_handover",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.min	= 0,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+/* size of the buffers for compressed formats (0: that of a raw frame), unless
+ * the producer asks for a size with S_FMT;
+ * write() can only grow them while nobody else uses them, and fails with
+ * ENOSPC for a frame that does not fit: set it large enough up front */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_compressedsize = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_COMPRESSED_SIZE,
+	.name	= "compressed_size",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= S32_MAX,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+/* let several writers compose the frames, each writing a tile of them */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_tiledoutput = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_TILED_OUTPUT,
+	.name	= "tiled_output",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.min	= 0,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+enum v4l2l_synthetic_source {
+	V4L2L_SYNTH_OFF = 0,
+	V4L2L_SYNTH_BARS = 1, /* colour bars, moving right */
+	V4L2L_SYNTH_COUNTER = 2, /* solid grey, the level counting frames */
+	V4L2L_SYNTH_STAMP = 3, /* only the stamp changes */
+};
+static const char *const v4l2loopback_synthetic_sources[] = {
+	"off",
+	"bars",
+	"counter",
+	"stamp",
+	NULL,
+};
+/* generate the frames in the driver (at the frame rate of the device), with
+ * a struct v4l2_loopback_stamp at their start; the format has to be set
+ * before, e.g. by a writer with keep_format */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_syntheticsource = {
+	// clang-format off
+	.ops	= &v4l2loopback_ctrl_ops,
+	.id	= CID_SYNTHETIC_SOURCE,
+	.name	= "synthetic_source",
+	.type	= V4L2_CTRL_TYPE_MENU,
+	.min	= 0,
+	.max	= V4L2L_SYNTH_STAMP,
+	.def	= V4L2L_SYNTH_OFF,
+	.qmenu	= v4l2loopback_synthetic_sources,
+	// clang-format on
+};
+/* the following controls only affect the file handle they are set on */
+/* max number of frames a reader may lag behind the writer
+ * (0: unlimited, 1: always deliver the newest frame) */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_maxbacklog = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_MAX_BACKLOG,
+	.name	= "max_backlog",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= MAX_BUFFERS,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+/* skip frames that have been written more than that many msecs ago
+ * (0: never) */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_maxframeage = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_MAX_FRAME_AGE,
+	.name	= "max_frame_age",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= MAX_TIMEOUT,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
+/* only wake up a waiting reader once that many frames are pending... */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_wakeupframes = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_WAKEUP_FRAMES,
+	.name	= "wakeup_frames",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 1,
+	.max	= MAX_BUFFERS,
+	.step	= 1,
+	.def	= 1,
+	// clang-format on
+};
+/* ...or once the oldest pending frame has been waiting for that many msecs
+ * (0: wait for 'wakeup_frames' frames) */
+static const struct v4l2_ctrl_config v4l2loopback_ctrl_wakeuptimeout = {
+	// clang-format off
+	.ops	= &v4l2loopback_opener_ctrl_ops,
+	.id	= CID_WAKEUP_TIMEOUT,
+	.name	= "wakeup_timeout",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= 0,
+	.max	= MAX_TIMEOUT,
+	.step	= 1,
+	.def	= 0,
+	// clang-format on
+};
 
 /* module structures */
 struct v4l2loopback_private {
@@ -317,11 +584,76 @@ struct v4l2loopback_private {
  * it is needed */
 /* struct keeping state and settings of loopback device */
 
+/* the regions of a frame that differ from the previous frame
+ * (see VIDIOC_V4L2LOOPBACK_S_DAMAGE) */
+struct v4l2l_damage {
+	u32 flags;
+	u32 count; /* 0: all of it (unless V4L2LOOPBACK_DAMAGE_UNCHANGED) */
+	struct v4l2_rect rects[V4L2LOOPBACK_DAMAGE_RECTS];
+};
+
 struct v4l2l_buffer {
 	struct v4l2_buffer buffer;
 	struct list_head list_head;
 	atomic_t use_count;
+	u64 written_ns; /* (monotonic) time the buffer was last written */
+	u32 generation; /* incremented whenever the contents change */
+	struct v4l2l_damage damage; /* protected by dev->lock */
+};
+
+/* a timeout image;
+ * generated images are shared between all devices with the same format
+ * (and pattern), images that are written to are private to their device
+ * until they have been queued (and are shared with the devices that got the
+ * same one) */
+struct v4l2l_timeout_image {
+	struct kref ref;
+	struct list_head list; /* in v4l2l_timeout_images (if shared) */
+	u32 pattern;
+	u32 colour;
+	struct v4l2_pix_format format;
+	u32 size;
+	u8 *data;
 };
+static LIST_HEAD(v4l2l_timeout_images);
+static DEFINE_MUTEX(v4l2l_timeout_images_lock);
+
+/* log2 histogram of frame latencies;
+ * bucket #i counts latencies in [2^i, 2^(i+1)) microseconds */
+#define V4L2L_LATENCY_BUCKETS 32
+struct v4l2l_latency {
+	u64 buckets[V4L2L_LATENCY_BUCKETS];
+	u64 count;
+	u64 max_us;
+};
+
+/* performance counters (per CPU, so they can be updated without locking);
+ * see v4l2loopback_stats_show() */
+struct v4l2l_stats {
+	u64 frames_queued; /* OUTPUT buffers written (QBUF or write()) */
+	u64 frames_captured; /* CAPTURE buffers handed out (DQBUF or read()) */
+	u64 frames_skipped; /* frames readers missed when catching up */
+	u64 frames_decimated; /* frames readers did not want (see S_PARM,
+			       * max_backlog and max_frame_age) */
+	u64 frames_converted; /* frames converted for the readers of sinks */
+	u64 sustain_rereads; /* frames repeated to sustain the framerate */
+	u64 timeouts; /* timeouts fired */
+	u64 bytes_read; /* bytes copied by read() */
+	u64 bytes_written; /* bytes copied by write() */
+	u64 wait_ns; /* time readers spent blocked waiting for a frame */
+	/* (the histograms are updated with dev->lock held, so they can be
+	 * reset consistently) */
+	struct v4l2l_latency latency; /* from QBUF/write() to DQBUF/read() */
+	struct v4l2l_latency reread_latency; /* age of sustained frames */
+};
+#define v4l2l_stat_add(dev, counter, n) this_cpu_add((dev)->stats->counter, n)
+#define v4l2l_stat_inc(dev, counter) this_cpu_inc((dev)->stats->counter)
+
+/* the deadlines serviced by the timer engine (see timer_queue_insert) */
+#define V4L2L_TIMER_SUSTAIN 0x01
+#define V4L2L_TIMER_TIMEOUT 0x02
+#define V4L2L_TIMER_TILES 0x04
+#define V4L2L_TIMER_SYNTH 0x08
 
 struct v4l2_loopback_device {
 	struct v4l2_device v4l2_dev;
@@ -334,6 +666,8 @@ struct v4l2_loopback_device {
 				 * when true; else announce OUTPUT when no
 				 * writer is streaming, otherwise CAPTURE. */
 	int max_openers; /* how many times can this device be opened */
+	int debug; /* debugging level of this device (in addition to the
+		    * module-wide 'debug' level) */
 	int min_width, max_width;
 	int min_height, max_height;
 
@@ -342,6 +676,7 @@ struct v4l2_loopback_device {
 	bool pix_format_has_valid_sizeimage;
 	struct v4l2_captureparm capture_param;
 	unsigned long frame_jiffies;
+	u64 frame_interval_ns;
 
 	/* ctrls */
 	int keep_format; /* CID_KEEP_FORMAT; lock the format, do not free
@@ -353,6 +688,16 @@ struct v4l2_loopback_device {
 	unsigned long timeout_jiffies; /* CID_TIMEOUT; 0 means disabled */
 	int timeout_image_io; /* CID_TIMEOUT_IMAGE_IO; next opener will
 			       * queue/dequeue the timeout image buffer */
+	int writer_handover; /* CID_WRITER_HANDOVER; when the writer stops
+			      * streaming, its tokens are parked (and the
+			      * buffers, format and write_position kept) until
+			      * the next writer adopts them */
+	u32 compressed_size; /* CID_COMPRESSED_SIZE; 0 means that of a raw
+			      * frame */
+	int tiled_output; /* CID_TILED_OUTPUT; OUTPUT openers may write tiles
+			   * of the frames (see set_tile) */
+	int synthetic_source; /* CID_SYNTHETIC_SOURCE; V4L2L_SYNTH_*, changed
+			       * with image_mutex held */
 
 	/* buffers for OUTPUT and CAPTURE */
 	u8 *image; /* pointer to actual buffers data */
@@ -371,24 +716,95 @@ struct v4l2_loopback_device {
 	atomic_t open_count;
 	struct mutex image_mutex; /* mutex for allocating image(s) and
 				   * exchanging format tokens */
-	spinlock_t lock; /* lock for the timeout and framerate timers */
+	spinlock_t lock; /* lock for the timeout and framerate deadlines */
 	spinlock_t list_lock; /* lock for the OUTPUT buffer queue */
-	wait_queue_head_t read_event;
 	u32 format_tokens; /* tokens to 'set format' for OUTPUT, CAPTURE, or
 			    * timeout buffers */
 	u32 stream_tokens; /* tokens to 'start' OUTPUT, CAPTURE, or timeout
 			    * stream */
+	u32 parked_format_token; /* tokens of a writer that has gone, held */
+	u32 parked_stream_token; /* for the next one (see CID_WRITER_HANDOVER) */
+
+	/* deadlines serviced by the (module-wide) timer engine;
+	 * protected by v4l2l_timer_lock */
+	struct rb_node timer_node; /* in v4l2l_timer_queue, if armed */
+	unsigned long timer_expires; /* earliest of the armed deadlines */
+	unsigned long sustain_expires;
+	unsigned long timeout_expires;
+	unsigned long tiles_expires;
+	unsigned long synth_expires;
+	u32 timers_armed; /* V4L2L_TIMER_* */
 
 	/* sustain framerate */
-	struct timer_list sustain_timer;
 	unsigned int reread_count;
 
 	/* timeout */
-	u8 *timeout_image; /* copied to outgoing buffers when timeout passes */
+	struct v4l2l_timeout_image *timeout; /* possibly shared */
+	u8 *timeout_image; /* timeout->data */
+	/* the readers that mapped their buffer for the timeout image (see
+	 * timeout_slot_fault); protected by image_mutex */
+	struct list_head timeout_slot_openers;
 	struct v4l2l_buffer timeout_buffer;
 	u32 timeout_buffer_size; /* number bytes alloc'd for timeout buffer */
-	struct timer_list timeout_timer;
 	int timeout_happened;
+	u32 timeout_pattern; /* CID_TIMEOUT_PATTERN */
+	u32 timeout_colour; /* CID_TIMEOUT_COLOUR */
+
+	/* statistics */
+	struct v4l2l_stats __percpu *stats;
+	struct dentry *debugfs_dir; /* <debugfs>/v4l2loopback/video<N>/ */
+
+	/* read-only page shared with userspace (updated with dev->lock held) */
+	struct v4l2_loopback_status *status;
+	/* per-buffer metadata slots shared with userspace (MAX_BUFFERS of
+	 * them); allocated on the first mmap() */
+	struct v4l2_loopback_meta *meta;
+
+	/* tee (see V4L2LOOPBACK_CTL_LINK); changed with the sink's tee_mutex
+	 * and the source's lock held (and only while the sink is not open) */
+	struct mutex tee_mutex; /* serialises (un)linking against open/close */
+	struct v4l2_loopback_device *tee_source; /* if this is a sink */
+	struct list_head tee_sinks; /* if this is a source */
+	struct list_head tee_node; /* in the source's tee_sinks */
+	/* the format the sink's readers asked for, if it is not the source's
+	 * (see tee_conv_fourcc); protected by image_mutex */
+	u32 conv_fourcc;
+	/* the formats the sinks' readers get (struct v4l2l_conversion);
+	 * protected by image_mutex */
+	struct list_head conversions;
+
+	/* sub-frame progress of the frame being written (see
+	 * VIDIOC_V4L2LOOPBACK_S_PROGRESS); protected by dev->lock */
+	s64 progress_position; /* write position of that frame, -1 if none */
+	u32 progress_index;
+	u32 progress_bytes;
+	wait_queue_head_t progress_event;
+
+	/* the latest format request of a consumer (see
+	 * V4L2_EVENT_PRI_FORMAT_REQUEST); protected by dev->lock */
+	struct v4l2_event_format_request format_request;
+
+	/* damage of the next frame to be written; protected by dev->lock */
+	struct v4l2l_damage pending_damage;
+	bool damage_pending;
+
+	/* the frame being assembled by tile writers (see CID_TILED_OUTPUT),
+	 * which hold the OUTPUT tokens as a group while there are tiles;
+	 * protected by image_mutex */
+	struct list_head tiles; /* the openers with a tile */
+	u32 tile_count;
+	u32 tiles_format_token;
+	u32 tiles_stream_token;
+	u32 tiles_committed; /* the tiles written for that frame */
+	unsigned long tiles_deadline; /* when it is published regardless */
+	struct work_struct tiles_work; /* publishes it at the deadline */
+
+	/* the synthetic source (see CID_SYNTHETIC_SOURCE), which holds the
+	 * OUTPUT tokens while it is running; protected by image_mutex */
+	u32 synth_format_token;
+	u32 synth_stream_token;
+	u64 synth_next_ns; /* when the next frame is due */
+	struct work_struct synth_work; /* generates the frames that are due */
 };
 
 enum v4l2l_io_method {
@@ -408,12 +824,65 @@ struct v4l2_loopback_opener {
 	s64 read_position; /* sequence number of the next 'captured' frame */
 	unsigned int reread_count;
 	enum v4l2l_io_method io_method;
-
+	bool timeout_slot; /* CAPTURE: the last buffer is the timeout image */
+	bool timed_out; /* showing the timeout image until the next frame */
+	/* where that buffer is mapped (see timeout_slot_unmap) */
+	struct list_head timeout_slot_node; /* in timeout_slot_openers */
+	struct address_space *timeout_slot_mapping;
+	unsigned long timeout_slot_offset;
+	unsigned long timeout_slot_size;
+	u64 frames_captured; /* statistics for this opener */
+	u64 frames_skipped;
+	struct v4l2l_latency latency;
+	struct v4l2l_latency reread_latency;
+	bool frame_lag_subscribed; /* V4L2_EVENT_PRI_FRAME_LAG */
+	bool frame_lag_warned; /* already sent a warning for the current lag */
+	bool frame_gap; /* mark the next dequeued buffer with an error */
+	/* latency policy (see CID_MAX_BACKLOG, CID_MAX_FRAME_AGE) */
+	u32 max_backlog;
+	u64 max_frame_age_ns;
+	/* wakeup moderation (see CID_WAKEUP_FRAMES, CID_WAKEUP_TIMEOUT) */
+	u32 wakeup_frames;
+	u64 wakeup_timeout_ns;
+	bool draining; /* woken up, but has not caught up with the writer yet */
+	struct timer_list wakeup_timer;
+	wait_queue_head_t read_event; /* a reader waiting for frames */
+	/* frame-rate decimation (see vidioc_s_parm) */
+	struct v4l2_fract timeperframe; /* 0/0 if not set */
+	u64 frame_interval_ns;
+	u64 next_due_ns; /* when the next frame should have been written */
+	u64 frames_decimated;
+	/* damage of the dequeued buffers as seen by this opener (one of
+	 * V4L2L_DAMAGE_*, see vidioc_g_damage) */
+	u8 damage[MAX_BUFFERS + 1];
+	bool damage_reset; /* the last frame was a timeout image */
+	/* the frames converted to the format asked for (readers of a linked
+	 * device only) */
+	struct v4l2l_conversion *conv;
+	/* the source of the linked device that open() pinned (see put_opener) */
+	struct v4l2_loopback_device *tee_source;
+	/* CAPTURE: the part of the frames read() returns (see
+	 * vidioc_s_selection); all of them if empty */
+	struct v4l2_rect crop;
+	/* OUTPUT: the part of the frames write() writes (see set_tile);
+	 * protected by image_mutex */
+	struct v4l2_rect tile;
+	struct list_head tile_node; /* in the device's tiles, if any */
+	bool tile_committed; /* written for the frame being assembled */
+
+	struct v4l2_ctrl_handler ctrl_handler; /* per-opener controls */
 	struct v4l2_fh fh;
 };
 
 #define fh_to_opener(ptr) container_of((ptr), struct v4l2_loopback_opener, fh)
 
+/* how a dequeued frame differs from the one the opener got before */
+enum {
+	V4L2L_DAMAGE_WRITTEN = 0, /* as set by the writer */
+	V4L2L_DAMAGE_UNCHANGED, /* a reread */
+	V4L2L_DAMAGE_FULL, /* there were other frames in between */
+};
+
 /* this is heavily inspired by the bttv driver found in the linux kernel */
 struct v4l2l_format {
 	char *name;
@@ -460,12 +929,76 @@ struct v4l2l_format {
 	} while (0)
 #define has_output_token(token) (token & V4L2L_TOKEN_OUTPUT)
 #define has_capture_token(token) (token & V4L2L_TOKEN_CAPTURE)
-#define has_no_owners(dev) ((~((dev)->format_tokens) & V4L2L_TOKEN_MASK) == 0)
-#define has_other_owners(opener, dev) \
-	(~((dev)->format_tokens ^ (opener)->format_token) & V4L2L_TOKEN_MASK)
+#define has_no_owners(dev)                                          \
+	((~((dev)->format_tokens) & V4L2L_TOKEN_MASK) == 0 && \
+	 !has_tee_readers(dev) && !(dev)->tile_count)
+#define has_other_owners(opener, dev)                                      \
+	((~((dev)->format_tokens ^ (opener)->format_token) &                \
+	  V4L2L_TOKEN_MASK) ||                                              \
+	 has_tee_readers(dev) || (dev)->tile_count)
 #define need_timeout_buffer(dev, token) \
 	((dev)->timeout_jiffies > 0 || (token) & V4L2L_TOKEN_TIMEOUT)
 
+/* writer handover (see CID_WRITER_HANDOVER): a writer that stops streaming
+ * leaves its tokens to the next writer, which picks them up in S_FMT,
+ * REQBUFS or STREAMON (or write()) */
+#define park_token(dev, opener, label)                                   \
+	do {                                                             \
+		(dev)->parked_##label##_token |= (opener)->label##_token; \
+		(opener)->label##_token = 0;                              \
+	} while (0)
+#define adopt_parked_token(dev, label, token)                   \
+	do {                                                    \
+		if ((dev)->parked_##label##_token & (token)) {  \
+			(dev)->label##_tokens |= (token);       \
+			(dev)->parked_##label##_token &= ~(token); \
+		}                                               \
+	} while (0)
+#define unpark_writer(dev)                                         \
+	do {                                                       \
+		adopt_parked_token(dev, format, V4L2L_TOKEN_OUTPUT); \
+		adopt_parked_token(dev, stream, V4L2L_TOKEN_OUTPUT); \
+	} while (0)
+
+/* the device whose buffers a device's readers use */
+#define ring_dev(dev) ((dev)->tee_source ? (dev)->tee_source : (dev))
+/* whether a writer is streaming to the device's readers */
+#define has_writer(dev) (!has_output_token(ring_dev(dev)->stream_tokens))
+
+/* whether readers of linked devices are using the device's buffers */
+static bool has_tee_readers(struct v4l2_loopback_device *dev)
+{
+	struct v4l2_loopback_device *sink;
+	bool ret = false;
+
+	if (list_empty(&dev->tee_sinks))
+		return false;
+	spin_lock_bh(&dev->lock);
+	list_for_each_entry(sink, &dev->tee_sinks, tee_node) {
+		if (!has_capture_token(sink->format_tokens)) {
+			ret = true;
+			break;
+		}
+	}
+	spin_unlock_bh(&dev->lock);
+	return ret;
+}
+
+/* whether any reader (of the device or of its sinks) is streaming;
+ * must be called with dev->lock held */
+static bool has_streaming_readers(struct v4l2_loopback_device *dev)
+{
+	struct v4l2_loopback_device *sink;
+
+	if (!has_capture_token(dev->stream_tokens))
+		return true;
+	list_for_each_entry(sink, &dev->tee_sinks, tee_node) {
+		if (!has_capture_token(sink->stream_tokens))
+			return true;
+	}
+	return false;
+}
+
 static const unsigned int FORMATS = ARRAY_SIZE(formats);
 
 static char *fourcc2str(unsigned int fourcc, char buf[5])
@@ -586,9 +1119,16 @@ static int v4l2l_fill_format(struct v4l2_format *fmt, const u32 minwidth,
 /* Checks if v4l2l_fill_format() has set a valid, fixed sizeimage val. */
 static bool v4l2l_pix_format_has_valid_sizeimage(struct v4l2_format *fmt)
 {
+	const struct v4l2l_format *format =
+		format_by_fourcc(fmt->fmt.pix.pixelformat);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
 	const struct v4l2_format_info *info;
+#endif
 
+	/* compressed frames have a size of their own */
+	if (format && format->flags & FORMAT_FLAGS_COMPRESSED)
+		return false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
 	info = v4l2_format_info(fmt->fmt.pix.pixelformat);
 	if (info && info->mem_planes == 1)
 		return true;
@@ -626,8 +1166,7 @@ static int pix_format_eq(const struct v4l2_pix_format *ref,
 	return result;
 }
 
-static void set_timeperframe(struct v4l2_loopback_device *dev,
-			     struct v4l2_fract *tpf)
+static void clamp_timeperframe(struct v4l2_fract *tpf)
 {
 	if (!tpf->denominator && !tpf->numerator) {
 		tpf->numerator = 1;
@@ -642,11 +1181,73 @@ static void set_timeperframe(struct v4l2_loopback_device *dev,
 		tpf->numerator = 1;
 		tpf->denominator = V4L2LOOPBACK_FPS_MAX;
 	}
+}
+
+static u64 timeperframe_to_ns(const struct v4l2_fract *tpf)
+{
+	return div_u64((u64)NSEC_PER_SEC * tpf->numerator, tpf->denominator);
+}
 
+static void set_timeperframe(struct v4l2_loopback_device *dev,
+			     struct v4l2_fract *tpf)
+{
+	clamp_timeperframe(tpf);
 	dev->capture_param.timeperframe = *tpf;
 	dev->frame_jiffies =
 		max(1UL, (msecs_to_jiffies(1000) * tpf->numerator) /
 				 tpf->denominator);
+	dev->frame_interval_ns = timeperframe_to_ns(tpf);
+}
+
+/* debugging */
+/* keep track of the levels that enable the debug key */
+static void v4l2l_debug_key_update(int old_level, int new_level)
+{
+	if (old_level <= 0 && new_level > 0)
+		static_branch_inc(&v4l2loopback_debug_key);
+	else if (old_level > 0 && new_level <= 0)
+		static_branch_dec(&v4l2loopback_debug_key);
+}
+
+/* let the v4l2 core dump ioctls (and more) for verbose debugging levels */
+static void v4l2l_update_dev_debug(struct v4l2_loopback_device *dev)
+{
+	const int level = max(debug, dev->debug);
+	int dev_debug = 0;
+
+	if (level > 1)
+		dev_debug |= V4L2_DEV_DEBUG_IOCTL | V4L2_DEV_DEBUG_IOCTL_ARG;
+	if (level > 2) {
+		dev_debug |= V4L2_DEV_DEBUG_FOP | V4L2_DEV_DEBUG_STREAMING |
+			     V4L2_DEV_DEBUG_POLL;
+#ifdef V4L2_DEV_DEBUG_CTRL
+		dev_debug |= V4L2_DEV_DEBUG_CTRL;
+#endif
+	}
+	dev->vdev->dev_debug = dev_debug;
+}
+
+/* setter for the 'debug' module parameter */
+static int v4l2loopback_set_debug(const char *val,
+				  const struct kernel_param *kp)
+{
+	struct v4l2_loopback_device *dev;
+	int old_level = debug;
+	int ret, id;
+
+	ret = param_set_int(val, kp);
+	if (ret < 0)
+		return ret;
+	v4l2l_debug_key_update(old_level, debug);
+
+	/* the module-wide level applies to all devices */
+	down_read(&v4l2loopback_ctl_rwsem);
+	idr_for_each_entry(&v4l2loopback_index_idr, dev, id) {
+		if (dev->vdev)
+			v4l2l_update_dev_debug(dev);
+	}
+	up_read(&v4l2loopback_ctl_rwsem);
+	return 0;
 }
 
 static struct v4l2_loopback_device *v4l2loopback_cd2dev(struct device *cd);
@@ -761,7 +1362,7 @@ static ssize_t attr_show_state(struct device *cd, struct device_attribute *attr,
 	if (!dev)
 		return -ENODEV;
 
-	if (!has_output_token(dev->stream_tokens) || dev->keep_format) {
+	if (has_writer(dev) || dev->keep_format || dev->tee_source) {
 		return sprintf(buf, "capture\n");
 	} else
 		return sprintf(buf, "output\n");
@@ -771,6 +1372,43 @@ static ssize_t attr_show_state(struct device *cd, struct device_attribute *attr,
 
 static DEVICE_ATTR(state, S_IRUGO, attr_show_state, NULL);
 
+/* the debug level of the device: >0 enables the messages about the device
+ * (dprintkdev), >2 the per-frame messages (dprintkrw) as well */
+static ssize_t attr_show_debug(struct device *cd, struct device_attribute *attr,
+			       char *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_cd2dev(cd);
+
+	if (!dev)
+		return -ENODEV;
+
+	return sprintf(buf, "%d\n", dev->debug);
+}
+
+static ssize_t attr_store_debug(struct device *cd,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	struct v4l2_loopback_device *dev = NULL;
+	int level, old_level;
+
+	if (kstrtoint(buf, 0, &level) || level < 0)
+		return -EINVAL;
+
+	dev = v4l2loopback_cd2dev(cd);
+	if (!dev)
+		return -ENODEV;
+
+	old_level = xchg(&dev->debug, level);
+	v4l2l_debug_key_update(old_level, level);
+	v4l2l_update_dev_debug(dev);
+
+	return len;
+}
+
+static DEVICE_ATTR(debug, S_IRUGO | S_IWUSR, attr_show_debug,
+		   attr_store_debug);
+
 static void v4l2loopback_remove_sysfs(struct video_device *vdev)
 {
 #define V4L2_SYSFS_DESTROY(x) device_remove_file(&vdev->dev, &dev_attr_##x)
@@ -780,6 +1418,7 @@ static void v4l2loopback_remove_sysfs(struct video_device *vdev)
 		V4L2_SYSFS_DESTROY(buffers);
 		V4L2_SYSFS_DESTROY(max_openers);
 		V4L2_SYSFS_DESTROY(state);
+		V4L2_SYSFS_DESTROY(debug);
 		/* ... */
 	}
 }
@@ -799,6 +1438,7 @@ static void v4l2loopback_create_sysfs(struct video_device *vdev)
 		V4L2_SYSFS_CREATE(buffers);
 		V4L2_SYSFS_CREATE(max_openers);
 		V4L2_SYSFS_CREATE(state);
+		V4L2_SYSFS_CREATE(debug);
 		/* ... */
 	} while (0);
 
@@ -807,85 +1447,1152 @@ static void v4l2loopback_create_sysfs(struct video_device *vdev)
 	dev_err(&vdev->dev, "%s error: %d\n", __func__, res);
 }
 
-/* Event APIs */
+/* debugfs */
+static struct dentry *v4l2loopback_debugfs_root; /* <debugfs>/v4l2loopback/ */
 
-#define V4L2LOOPBACK_EVENT_BASE (V4L2_EVENT_PRIVATE_START)
-#define V4L2LOOPBACK_EVENT_OFFSET 0x08E00000
-#define V4L2_EVENT_PRI_CLIENT_USAGE \
-	(V4L2LOOPBACK_EVENT_BASE + V4L2LOOPBACK_EVENT_OFFSET + 1)
+static int v4l2loopback_stats_show(struct seq_file *s, void *unused)
+{
+	struct v4l2_loopback_device *dev = s->private;
+	struct v4l2l_stats sum;
+	struct v4l2_fh *fh;
+	unsigned long flags;
+	int cpu, n = 0;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		const struct v4l2l_stats *stats = per_cpu_ptr(dev->stats, cpu);
+		sum.frames_queued += stats->frames_queued;
+		sum.frames_captured += stats->frames_captured;
+		sum.frames_skipped += stats->frames_skipped;
+		sum.frames_decimated += stats->frames_decimated;
+		sum.frames_converted += stats->frames_converted;
+		sum.sustain_rereads += stats->sustain_rereads;
+		sum.timeouts += stats->timeouts;
+		sum.bytes_read += stats->bytes_read;
+		sum.bytes_written += stats->bytes_written;
+		sum.wait_ns += stats->wait_ns;
+	}
+	seq_printf(s, "frames_queued: %llu\n", sum.frames_queued);
+	seq_printf(s, "frames_captured: %llu\n", sum.frames_captured);
+	seq_printf(s, "frames_skipped: %llu\n", sum.frames_skipped);
+	seq_printf(s, "frames_decimated: %llu\n", sum.frames_decimated);
+	seq_printf(s, "frames_converted: %llu\n", sum.frames_converted);
+	seq_printf(s, "sustain_rereads: %llu\n", sum.sustain_rereads);
+	seq_printf(s, "timeouts: %llu\n", sum.timeouts);
+	seq_printf(s, "bytes_read: %llu\n", sum.bytes_read);
+	seq_printf(s, "bytes_written: %llu\n", sum.bytes_written);
+	seq_printf(s, "wait_ns: %llu\n", sum.wait_ns);
+
+	/* per opener counters */
+	spin_lock_irqsave(&dev->vdev->fh_lock, flags);
+	list_for_each_entry(fh, &dev->vdev->fh_list, list) {
+		struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+		seq_printf(s, "opener%d: frames_captured: %llu\n", n,
+			   opener->frames_captured);
+		seq_printf(s, "opener%d: frames_skipped: %llu\n", n,
+			   opener->frames_skipped);
+		seq_printf(s, "opener%d: frames_decimated: %llu\n", n,
+			   opener->frames_decimated);
+		n++;
+	}
+	spin_unlock_irqrestore(&dev->vdev->fh_lock, flags);
+	return 0;
+}
 
-struct v4l2_event_client_usage {
-	__u32 count;
-};
+static int v4l2loopback_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, v4l2loopback_stats_show, inode->i_private);
+}
 
-/* global module data */
-/* find a device based on it's device-number (e.g. '3' for /dev/video3) */
-struct v4l2loopback_lookup_cb_data {
-	int device_nr;
-	struct v4l2_loopback_device *device;
+static const struct file_operations v4l2loopback_stats_fops = {
+	// clang-format off
+	.owner		= THIS_MODULE,
+	.open		= v4l2loopback_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	// clang-format on
 };
-static int v4l2loopback_lookup_cb(int id, void *ptr, void *data)
-{
-	struct v4l2_loopback_device *device = ptr;
-	struct v4l2loopback_lookup_cb_data *cbdata = data;
-	if (cbdata && device && device->vdev) {
-		if (device->vdev->num == cbdata->device_nr) {
-			cbdata->device = device;
-			cbdata->device_nr = id;
-			return 1;
-		}
-	}
-	return 0;
+
+static void v4l2l_latency_add(struct v4l2l_latency *lat, u64 ns)
+{
+	const u64 us = div_u64(ns, NSEC_PER_USEC);
+	unsigned int bucket = us ? fls64(us) - 1 : 0;
+
+	if (bucket >= V4L2L_LATENCY_BUCKETS)
+		bucket = V4L2L_LATENCY_BUCKETS - 1;
+	lat->buckets[bucket]++;
+	lat->count++;
+	if (us > lat->max_us)
+		lat->max_us = us;
 }
-static int v4l2loopback_lookup(int device_nr,
-			       struct v4l2_loopback_device **device)
+
+static void v4l2l_latency_merge(struct v4l2l_latency *sum,
+				const struct v4l2l_latency *lat)
 {
-	struct v4l2loopback_lookup_cb_data data = {
-		.device_nr = device_nr,
-		.device = NULL,
-	};
-	int err = idr_for_each(&v4l2loopback_index_idr, &v4l2loopback_lookup_cb,
-			       &data);
-	if (1 == err) {
-		if (device)
-			*device = data.device;
-		return data.device_nr;
+	int i;
+
+	for (i = 0; i < V4L2L_LATENCY_BUCKETS; i++)
+		sum->buckets[i] += lat->buckets[i];
+	sum->count += lat->count;
+	if (lat->max_us > sum->max_us)
+		sum->max_us = lat->max_us;
+}
+
+/* upper bound (in microseconds) of the given percentile */
+static u64 v4l2l_latency_percentile(const struct v4l2l_latency *lat,
+				    unsigned int percent)
+{
+	const u64 target = div_u64(lat->count * percent + 99, 100);
+	u64 seen = 0;
+	int i;
+
+	for (i = 0; i < V4L2L_LATENCY_BUCKETS; i++) {
+		seen += lat->buckets[i];
+		if (seen && seen >= target)
+			return min(1ULL << (i + 1), lat->max_us);
 	}
-	return -ENODEV;
+	return lat->max_us;
 }
-#define v4l2loopback_get_vdev_nr(vdev) \
-	((struct v4l2loopback_private *)video_get_drvdata(vdev))->device_nr
-static struct v4l2_loopback_device *v4l2loopback_cd2dev(struct device *cd)
+
+static void v4l2l_latency_show(struct seq_file *s, const char *name,
+			       const struct v4l2l_latency *lat, bool buckets)
 {
-	struct video_device *loopdev = to_video_device(cd);
-	int device_nr = v4l2loopback_get_vdev_nr(loopdev);
+	int i;
 
-	return idr_find(&v4l2loopback_index_idr, device_nr);
+	seq_printf(s, "%s: count=%llu p50=%lluus p99=%lluus max=%lluus\n",
+		   name, lat->count, v4l2l_latency_percentile(lat, 50),
+		   v4l2l_latency_percentile(lat, 99), lat->max_us);
+	if (!buckets || !lat->count)
+		return;
+	for (i = 0; i < V4L2L_LATENCY_BUCKETS; i++) {
+		if (lat->buckets[i])
+			seq_printf(s, "%s: <%lluus: %llu\n", name, 1ULL << (i + 1),
+				   lat->buckets[i]);
+	}
 }
 
-static struct v4l2_loopback_device *v4l2loopback_getdevice(struct file *f)
+/* record the age of a frame handed out to a reader;
+ * must be called with dev->lock held (the histograms may be reset at any
+ * time) */
+static void v4l2l_latency_record(struct v4l2_loopback_device *dev,
+				 struct v4l2_loopback_opener *opener,
+				 const struct v4l2l_buffer *buf, bool reread)
 {
-	struct v4l2loopback_private *ptr = video_drvdata(f);
-	int nr = ptr->device_nr;
+	struct v4l2l_stats *stats = this_cpu_ptr(dev->stats);
+	u64 age;
 
-	return idr_find(&v4l2loopback_index_idr, nr);
+	if (!buf->written_ns)
+		return;
+	age = ktime_get_ns() - buf->written_ns;
+	v4l2l_latency_add(reread ? &stats->reread_latency : &stats->latency,
+			  age);
+	v4l2l_latency_add(reread ? &opener->reread_latency : &opener->latency,
+			  age);
 }
 
-/* forward declarations */
-static void client_usage_queue_event(struct video_device *vdev);
-static bool any_buffers_mapped(struct v4l2_loopback_device *dev);
-static int allocate_buffers(struct v4l2_loopback_device *dev,
-			    struct v4l2_pix_format *pix_format);
-static void init_buffers(struct v4l2_loopback_device *dev, u32 bytes_used,
-			 u32 buffer_size);
-static void free_buffers(struct v4l2_loopback_device *dev);
-static int allocate_timeout_buffer(struct v4l2_loopback_device *dev);
-static void free_timeout_buffer(struct v4l2_loopback_device *dev);
-static void check_timers(struct v4l2_loopback_device *dev);
-static const struct v4l2_file_operations v4l2_loopback_fops;
-static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops;
+static int v4l2loopback_latency_show(struct seq_file *s, void *unused)
+{
+	struct v4l2_loopback_device *dev = s->private;
+	struct v4l2l_latency latency, reread_latency;
+	struct v4l2_fh *fh;
+	unsigned long flags;
+	int cpu, n = 0;
+
+	memset(&latency, 0, sizeof(latency));
+	memset(&reread_latency, 0, sizeof(reread_latency));
+	for_each_possible_cpu(cpu) {
+		const struct v4l2l_stats *stats = per_cpu_ptr(dev->stats, cpu);
+		v4l2l_latency_merge(&latency, &stats->latency);
+		v4l2l_latency_merge(&reread_latency, &stats->reread_latency);
+	}
+	v4l2l_latency_show(s, "latency", &latency, true);
+	v4l2l_latency_show(s, "reread_age", &reread_latency, true);
+
+	spin_lock_irqsave(&dev->vdev->fh_lock, flags);
+	list_for_each_entry(fh, &dev->vdev->fh_list, list) {
+		struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+		char name[32];
+		if (!opener->latency.count && !opener->reread_latency.count)
+			continue;
+		snprintf(name, sizeof(name), "opener%d: latency", n);
+		v4l2l_latency_show(s, name, &opener->latency, false);
+		snprintf(name, sizeof(name), "opener%d: reread_age", n);
+		v4l2l_latency_show(s, name, &opener->reread_latency, false);
+		n++;
+	}
+	spin_unlock_irqrestore(&dev->vdev->fh_lock, flags);
+	return 0;
+}
 
-/* V4L2 ioctl caps and params calls */
+static int v4l2loopback_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, v4l2loopback_latency_show, inode->i_private);
+}
+
+/* writing anything resets the histograms */
+static ssize_t v4l2loopback_latency_write(struct file *file,
+					  const char __user *buf, size_t count,
+					  loff_t *ppos)
+{
+	struct v4l2_loopback_device *dev =
+		((struct seq_file *)file->private_data)->private;
+	struct v4l2_fh *fh;
+	unsigned long flags;
+	int cpu;
+
+	/* the histograms are recorded with dev->lock held */
+	spin_lock_bh(&dev->lock);
+	for_each_possible_cpu(cpu) {
+		struct v4l2l_stats *stats = per_cpu_ptr(dev->stats, cpu);
+		memset(&stats->latency, 0, sizeof(stats->latency));
+		memset(&stats->reread_latency, 0,
+		       sizeof(stats->reread_latency));
+	}
+	spin_lock_irqsave(&dev->vdev->fh_lock, flags);
+	list_for_each_entry(fh, &dev->vdev->fh_list, list) {
+		struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+		memset(&opener->latency, 0, sizeof(opener->latency));
+		memset(&opener->reread_latency, 0,
+		       sizeof(opener->reread_latency));
+	}
+	spin_unlock_irqrestore(&dev->vdev->fh_lock, flags);
+	spin_unlock_bh(&dev->lock);
+	return count;
+}
+
+static const struct file_operations v4l2loopback_latency_fops = {
+	// clang-format off
+	.owner		= THIS_MODULE,
+	.open		= v4l2loopback_latency_open,
+	.read		= seq_read,
+	.write		= v4l2loopback_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	// clang-format on
+};
+
+static void v4l2loopback_create_debugfs(struct v4l2_loopback_device *dev)
+{
+	char name[32];
+
+	if (IS_ERR_OR_NULL(v4l2loopback_debugfs_root))
+		return;
+	snprintf(name, sizeof(name), "video%d", dev->vdev->num);
+	dev->debugfs_dir = debugfs_create_dir(name, v4l2loopback_debugfs_root);
+	if (IS_ERR_OR_NULL(dev->debugfs_dir))
+		return;
+	debugfs_create_file("stats", S_IRUGO, dev->debugfs_dir, dev,
+			    &v4l2loopback_stats_fops);
+	debugfs_create_file("latency", S_IRUGO | S_IWUSR, dev->debugfs_dir, dev,
+			    &v4l2loopback_latency_fops);
+}
+
+/* Event APIs */
+
+#define V4L2_EVENT_PRI_CLIENT_USAGE \
+	(V4L2LOOPBACK_EVENT_BASE + V4L2LOOPBACK_EVENT_OFFSET + 1)
+
+struct v4l2_event_client_usage {
+	__u32 count;
+};
+
+/* global module data */
+#define v4l2loopback_get_vdev_nr(vdev) \
+	((struct v4l2loopback_private *)video_get_drvdata(vdev))->device_nr
+/* find a device based on it's device-number (e.g. '3' for /dev/video3)
+ * returns the (internal) index of the device */
+static int v4l2loopback_lookup(int device_nr,
+			       struct v4l2_loopback_device **device)
+{
+	struct v4l2_loopback_device *dev;
+
+	if (device_nr < 0)
+		return -ENODEV;
+	dev = idr_find(&v4l2loopback_nr_idr, device_nr);
+	if (!dev || !dev->vdev)
+		return -ENODEV;
+	if (device)
+		*device = dev;
+	return v4l2loopback_get_vdev_nr(dev->vdev);
+}
+static struct v4l2_loopback_device *v4l2loopback_cd2dev(struct device *cd)
+{
+	struct video_device *loopdev = to_video_device(cd);
+	int device_nr = v4l2loopback_get_vdev_nr(loopdev);
+
+	return idr_find(&v4l2loopback_index_idr, device_nr);
+}
+
+static struct v4l2_loopback_device *v4l2loopback_getdevice(struct file *f)
+{
+	struct v4l2loopback_private *ptr = video_drvdata(f);
+	int nr = ptr->device_nr;
+
+	return idr_find(&v4l2loopback_index_idr, nr);
+}
+
+/* fill @size bytes at @dst with copies of the @len bytes at @pattern
+ * (which may be the start of @dst itself) */
+static void v4l2l_fill(u8 *dst, size_t size, const u8 *pattern, size_t len)
+{
+	size_t done;
+
+	if (!size || !len)
+		return;
+	if (len == 1) {
+		memset(dst, *pattern, size);
+		return;
+	}
+	if (len == 4 && IS_ALIGNED((unsigned long)dst, 4)) {
+		u32 value;
+		memcpy(&value, pattern, 4);
+		memset32((u32 *)dst, value, size / 4);
+		memcpy(dst + (size & ~3), pattern, size & 3);
+		return;
+	}
+	done = min(len, size);
+	if (dst != pattern)
+		memcpy(dst, pattern, done);
+	/* double the filled area until we are done */
+	while (done < size) {
+		size_t n = min(done, size - done);
+		memcpy(dst + done, dst, n);
+		done += n;
+	}
+}
+
+/* how frames of a given format are filled with colours:
+ * each plane consists of 'units', which are made of the given components
+ * ('Y', 'U', 'V', 'R', 'G', 'B' or 'A'; one byte each) and cover 'ppu'
+ * pixels of a line; all but the first plane are subsampled by 'sub' in
+ * both directions */
+struct v4l2l_fill_format {
+	u32 fourcc;
+	u32 ppu;
+	u32 sub;
+	const char *planes[3];
+};
+static const struct v4l2l_fill_format v4l2l_fill_formats[] = {
+	// clang-format off
+	{ V4L2_PIX_FMT_YUYV,	2, 1, { "YUYV" } },
+	{ V4L2_PIX_FMT_YVYU,	2, 1, { "YVYU" } },
+	{ V4L2_PIX_FMT_UYVY,	2, 1, { "UYVY" } },
+	{ V4L2_PIX_FMT_VYUY,	2, 1, { "VYUY" } },
+	{ V4L2_PIX_FMT_RGB24,	1, 1, { "RGB" } },
+	{ V4L2_PIX_FMT_BGR24,	1, 1, { "BGR" } },
+	{ V4L2_PIX_FMT_BGR32,	1, 1, { "BGRA" } },
+	{ V4L2_PIX_FMT_ABGR32,	1, 1, { "BGRA" } },
+	{ V4L2_PIX_FMT_RGBA32,	1, 1, { "RGBA" } },
+	{ V4L2_PIX_FMT_GREY,	1, 1, { "Y" } },
+	{ V4L2_PIX_FMT_YUV420,	1, 2, { "Y", "U", "V" } },
+	{ V4L2_PIX_FMT_YVU420,	1, 2, { "Y", "V", "U" } },
+	{ V4L2_PIX_FMT_NV12,	1, 2, { "Y", "UV" } },
+	// clang-format on
+};
+
+/* 100% colour bars */
+static const u32 v4l2l_bars[] = {
+	0xffffff, 0xffff00, 0x00ffff, 0x00ff00,
+	0xff00ff, 0xff0000, 0x0000ff, 0x000000,
+};
+
+/* BT.601 limited range */
+#define v4l2l_rgb_to_y(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define v4l2l_rgb_to_u(r, g, b) \
+	(((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define v4l2l_rgb_to_v(r, g, b) \
+	(((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+/* a single unit (see struct v4l2l_fill_format) of the given 0xRRGGBB colour
+ * (using BT.601 limited range for YUV); returns its size */
+static size_t v4l2l_fill_unit(u8 *unit, const char *components, u32 rgb)
+{
+	const int r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+	size_t i;
+
+	for (i = 0; components[i]; i++) {
+		switch (components[i]) {
+		case 'Y':
+			unit[i] = v4l2l_rgb_to_y(r, g, b);
+			break;
+		case 'U':
+			unit[i] = v4l2l_rgb_to_u(r, g, b);
+			break;
+		case 'V':
+			unit[i] = v4l2l_rgb_to_v(r, g, b);
+			break;
+		case 'R':
+			unit[i] = r;
+			break;
+		case 'G':
+			unit[i] = g;
+			break;
+		case 'B':
+			unit[i] = b;
+			break;
+		default:
+			unit[i] = 0xff;
+		}
+	}
+	return i;
+}
+
+/* fill a frame with a timeout pattern, whose bars are moved right by 'shift'
+ * pixels (wrapping around); formats we do not know how to fill are zeroed */
+static void v4l2l_fill_frame(u8 *data, u32 size,
+			     const struct v4l2_pix_format *pix, u32 pattern,
+			     u32 colour, u32 shift)
+{
+	const struct v4l2l_fill_format *ff = NULL;
+	const u32 nbars = (pattern == V4L2L_TIMEOUT_PATTERN_BARS) ?
+				  ARRAY_SIZE(v4l2l_bars) :
+				  1;
+	u8 *plane = data;
+	int i, p;
+
+	if (pattern != V4L2L_TIMEOUT_PATTERN_ZERO) {
+		for (i = 0; i < ARRAY_SIZE(v4l2l_fill_formats); i++) {
+			if (v4l2l_fill_formats[i].fourcc == pix->pixelformat)
+				ff = &v4l2l_fill_formats[i];
+		}
+	}
+	if (!ff) {
+		memset(data, 0, size);
+		return;
+	}
+
+	for (p = 0; p < ARRAY_SIZE(ff->planes) && ff->planes[p]; p++) {
+		const char *components = ff->planes[p];
+		const u32 sub = p ? ff->sub : 1;
+		const u32 units = pix->width / sub / ff->ppu;
+		const u32 rows = pix->height / sub;
+		const u32 unitsize = strlen(components);
+		const u32 s = units ? shift / sub / ff->ppu % units : 0;
+		u32 bpl = p ? units * unitsize : pix->bytesperline;
+
+		if (!bpl)
+			bpl = units * unitsize;
+		if (units * unitsize > bpl ||
+		    (unsigned long)bpl * rows > size - (plane - data)) {
+			memset(data, 0, size);
+			return;
+		}
+		/* the first line... */
+		for (i = 0; i < nbars; i++) {
+			const u32 len = units * (i + 1) / nbars - units * i / nbars;
+			u32 start = units * i / nbars + s, head;
+			u8 unit[4];
+
+			if (start >= units)
+				start -= units;
+			head = min(len, units - start);
+			v4l2l_fill_unit(unit, components,
+					nbars > 1 ? v4l2l_bars[i] : colour);
+			v4l2l_fill(plane + start * unitsize, head * unitsize, unit,
+				   unitsize);
+			/* (the part that is moved past the end of the line) */
+			v4l2l_fill(plane, (len - head) * unitsize, unit,
+				   unitsize);
+		}
+		memset(plane + units * unitsize, 0, bpl - units * unitsize);
+		/* ...is repeated for all other lines */
+		v4l2l_fill(plane, bpl * rows, plane, bpl);
+		plane += bpl * rows;
+	}
+	memset(plane, 0, size - (plane - data));
+}
+
+static struct v4l2l_timeout_image *timeout_image_alloc(u32 size)
+{
+	struct v4l2l_timeout_image *img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (!img)
+		return NULL;
+	img->data = vmalloc(size);
+	if (!img->data) {
+		kfree(img);
+		return NULL;
+	}
+	img->size = size;
+	kref_init(&img->ref);
+	INIT_LIST_HEAD(&img->list);
+	return img;
+}
+
+/* called with v4l2l_timeout_images_lock held, which it releases */
+static void timeout_image_release(struct kref *ref)
+{
+	struct v4l2l_timeout_image *img =
+		container_of(ref, struct v4l2l_timeout_image, ref);
+	list_del(&img->list);
+	mutex_unlock(&v4l2l_timeout_images_lock);
+	vfree(img->data);
+	kfree(img);
+}
+
+static void timeout_image_put(struct v4l2l_timeout_image *img)
+{
+	if (img)
+		kref_put_mutex(&img->ref, timeout_image_release,
+			       &v4l2l_timeout_images_lock);
+}
+
+#define timeout_image_is_shared(img) (!list_empty(&(img)->list))
+
+static struct v4l2l_timeout_image *
+timeout_image_find(const struct v4l2_pix_format *pix, u32 size, u32 pattern,
+		   u32 colour)
+{
+	struct v4l2l_timeout_image *img;
+	list_for_each_entry(img, &v4l2l_timeout_images, list) {
+		if (img->size == size && img->pattern == pattern &&
+		    img->colour == colour &&
+		    pix_format_eq(&img->format, pix, 1)) {
+			kref_get(&img->ref);
+			return img;
+		}
+	}
+	return NULL;
+}
+
+/* get a (shared) timeout image with the given pattern,
+ * generating it if it does not exist yet */
+static struct v4l2l_timeout_image *
+timeout_image_get(const struct v4l2_pix_format *pix, u32 size, u32 pattern,
+		  u32 colour)
+{
+	struct v4l2l_timeout_image *img, *found;
+
+	if (pattern != V4L2L_TIMEOUT_PATTERN_COLOUR)
+		colour = 0;
+	mutex_lock(&v4l2l_timeout_images_lock);
+	found = timeout_image_find(pix, size, pattern, colour);
+	mutex_unlock(&v4l2l_timeout_images_lock);
+	if (found)
+		return found;
+
+	img = timeout_image_alloc(size);
+	if (!img)
+		return NULL;
+	img->pattern = pattern;
+	img->colour = colour;
+	img->format = *pix;
+	v4l2l_fill_frame(img->data, size, pix, pattern, colour, 0);
+
+	/* somebody else might have been faster */
+	mutex_lock(&v4l2l_timeout_images_lock);
+	found = timeout_image_find(pix, size, pattern, colour);
+	if (!found)
+		list_add(&img->list, &v4l2l_timeout_images);
+	mutex_unlock(&v4l2l_timeout_images_lock);
+	if (found) {
+		timeout_image_put(img);
+		return found;
+	}
+	return img;
+}
+
+/* a reference to the timeout image of the device (NULL if it has none), for
+ * reading it without image_mutex: the device's reference might be dropped
+ * (see set_timeout_image) in the meantime */
+static struct v4l2l_timeout_image *
+timeout_image_ref(struct v4l2_loopback_device *dev)
+{
+	struct v4l2l_timeout_image *img;
+
+	mutex_lock(&dev->image_mutex);
+	img = dev->timeout;
+	if (img)
+		kref_get(&img->ref);
+	mutex_unlock(&dev->image_mutex);
+	return img;
+}
+
+/* drop the readers' mappings of the timeout image, which is being replaced:
+ * they fault in the pages of the new one (see timeout_slot_fault)
+ * must be called with image_mutex held */
+static void timeout_slot_unmap(struct v4l2_loopback_device *dev)
+{
+	struct v4l2_loopback_opener *opener;
+
+	list_for_each_entry(opener, &dev->timeout_slot_openers,
+			    timeout_slot_node) {
+		/* (the buffers have moved since, so this is not the timeout
+		 * buffer anymore) */
+		if (opener->timeout_slot_offset !=
+		    dev->timeout_buffer.buffer.m.offset)
+			continue;
+		unmap_mapping_range(opener->timeout_slot_mapping,
+				    opener->timeout_slot_offset,
+				    opener->timeout_slot_size, 1);
+	}
+}
+
+/* must be called with image_mutex held */
+static void set_timeout_image(struct v4l2_loopback_device *dev,
+			      struct v4l2l_timeout_image *img)
+{
+	timeout_slot_unmap(dev);
+	timeout_image_put(dev->timeout);
+	dev->timeout = img;
+	dev->timeout_image = img ? img->data : NULL;
+	dev->timeout_buffer_size = img ? img->size : 0;
+}
+
+/* share the timeout image that has been written to with the devices that got
+ * the same one (it is not written to anymore unless it is mapped again, see
+ * timeout_image_make_private); must be called with image_mutex held */
+static void timeout_image_share(struct v4l2_loopback_device *dev)
+{
+	struct v4l2l_timeout_image *img = dev->timeout, *other, *found = NULL;
+
+	if (!img || timeout_image_is_shared(img) ||
+	    dev->timeout_buffer.buffer.flags & V4L2_BUF_FLAG_MAPPED)
+		return;
+	img->pattern = V4L2L_TIMEOUT_PATTERN_USER;
+	img->colour = 0;
+	img->format = dev->pix_format;
+
+	mutex_lock(&v4l2l_timeout_images_lock);
+	list_for_each_entry(other, &v4l2l_timeout_images, list) {
+		if (other->pattern == V4L2L_TIMEOUT_PATTERN_USER &&
+		    other->size == img->size &&
+		    pix_format_eq(&other->format, &img->format, 1) &&
+		    !memcmp(other->data, img->data, img->size)) {
+			kref_get(&other->ref);
+			found = other;
+			break;
+		}
+	}
+	if (!found)
+		list_add(&img->list, &v4l2l_timeout_images);
+	mutex_unlock(&v4l2l_timeout_images_lock);
+	if (found)
+		set_timeout_image(dev, found);
+}
+
+/* give the device its own copy of the timeout image, so it can be written
+ * to; must be called with image_mutex held */
+static int timeout_image_make_private(struct v4l2_loopback_device *dev)
+{
+	struct v4l2l_timeout_image *img;
+
+	if (!dev->timeout || !timeout_image_is_shared(dev->timeout))
+		return 0;
+	if (dev->timeout_buffer.buffer.flags & V4L2_BUF_FLAG_MAPPED)
+		return -EBUSY;
+	img = timeout_image_alloc(dev->timeout->size);
+	if (!img)
+		return -ENOMEM;
+	memcpy(img->data, dev->timeout->data, img->size);
+	set_timeout_image(dev, img);
+	return 0;
+}
+
+/* re-generate the timeout image after its pattern has changed;
+ * must be called with image_mutex held */
+static int update_timeout_image(struct v4l2_loopback_device *dev)
+{
+	struct v4l2l_timeout_image *img;
+
+	if (!dev->timeout)
+		return 0;
+	if (dev->timeout_buffer.buffer.flags & V4L2_BUF_FLAG_MAPPED)
+		return -EBUSY;
+	img = timeout_image_get(&dev->pix_format, dev->timeout_buffer_size,
+				dev->timeout_pattern, dev->timeout_colour);
+	if (!img)
+		return -ENOMEM;
+	set_timeout_image(dev, img);
+	return 0;
+}
+
+/* ------------- FORMAT CONVERSION ------------------- */
+
+/* the readers of a linked device may ask for another format (of the same
+ * size) than the source's: the frames are converted on the first dequeue,
+ * and the result is shared by the readers of all the sinks that asked for
+ * the same format, so the work grows with the number of formats rather than
+ * the number of readers.
+ * conversions go through 4:2:2 YUV (one line of luma, and half a line of each
+ * chroma component per line), except between RGB formats */
+
+enum v4l2l_conv_kind {
+	V4L2L_CONV_NONE = 0,
+	V4L2L_CONV_GREY,
+	V4L2L_CONV_PACKED_YUV, /* 4:2:2, two pixels per unit */
+	V4L2L_CONV_PACKED_RGB, /* one pixel per unit */
+	V4L2L_CONV_PLANAR_YUV, /* 4:2:0, (semi-)planar */
+};
+
+/* where the components of a format are (derived from its fill format) */
+struct v4l2l_conv_layout {
+	enum v4l2l_conv_kind kind;
+	u32 unitsize; /* bytes per unit of the first plane */
+	int y0, y1, u, v; /* packed YUV: offsets in a unit */
+	int r, g, b, a; /* packed RGB: offsets in a unit (a: -1 if none) */
+	int uplane, vplane; /* planar: the planes holding U and V... */
+	int uoff, voff, cstep; /* ...offsets and bytes per chroma sample */
+};
+
+/* a format the readers of linked devices asked for; owned by the source */
+struct v4l2l_conversion {
+	struct list_head list; /* in the source's conversions */
+	unsigned int users; /* protected by the source's image_mutex */
+	struct mutex lock; /* serialises the conversion of frames */
+	struct v4l2_pix_format src_pix; /* the source's format */
+	struct v4l2_pix_format pix; /* the converted format */
+	struct v4l2l_conv_layout from, to;
+	u8 *image; /* a converted frame per source buffer */
+	u32 buffer_size; /* number of bytes alloc'd per frame */
+	u32 buffer_count;
+	u8 *lines; /* two lines of 4:2:2 */
+	/* generation of the source buffer each frame was converted from */
+	u32 converted[MAX_BUFFERS];
+};
+
+/* an offset (way beyond the buffers of any sensible ring, but within the
+ * 32 bits of v4l2_buffer.m.offset) for mmap()ing converted frames; the
+ * readers learn about it through VIDIOC_QUERYBUF */
+#define V4L2L_CONV_OFFSET (1UL << 31)
+
+static int v4l2l_index_of(const char *components, char c, int n)
+{
+	int i;
+	for (i = 0; components[i]; i++) {
+		if (components[i] == c && !n--)
+			return i;
+	}
+	return -1;
+}
+
+static int v4l2l_conv_layout(u32 fourcc, struct v4l2l_conv_layout *l)
+{
+	const struct v4l2l_fill_format *ff = NULL;
+	const char *c;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(v4l2l_fill_formats); i++) {
+		if (v4l2l_fill_formats[i].fourcc == fourcc)
+			ff = &v4l2l_fill_formats[i];
+	}
+	memset(l, 0, sizeof(*l));
+	if (!ff)
+		return -EINVAL;
+	c = ff->planes[0];
+	l->unitsize = strlen(c);
+	if (ff->sub == 2) {
+		l->kind = V4L2L_CONV_PLANAR_YUV;
+		for (i = 1; i < ARRAY_SIZE(ff->planes) && ff->planes[i]; i++) {
+			if (v4l2l_index_of(ff->planes[i], 'U', 0) >= 0) {
+				l->uplane = i;
+				l->uoff = v4l2l_index_of(ff->planes[i], 'U', 0);
+			}
+			if (v4l2l_index_of(ff->planes[i], 'V', 0) >= 0) {
+				l->vplane = i;
+				l->voff = v4l2l_index_of(ff->planes[i], 'V', 0);
+			}
+			l->cstep = strlen(ff->planes[i]);
+		}
+	} else if (v4l2l_index_of(c, 'R', 0) >= 0) {
+		l->kind = V4L2L_CONV_PACKED_RGB;
+		l->r = v4l2l_index_of(c, 'R', 0);
+		l->g = v4l2l_index_of(c, 'G', 0);
+		l->b = v4l2l_index_of(c, 'B', 0);
+		l->a = v4l2l_index_of(c, 'A', 0);
+	} else if (ff->ppu == 2) {
+		l->kind = V4L2L_CONV_PACKED_YUV;
+		l->y0 = v4l2l_index_of(c, 'Y', 0);
+		l->y1 = v4l2l_index_of(c, 'Y', 1);
+		l->u = v4l2l_index_of(c, 'U', 0);
+		l->v = v4l2l_index_of(c, 'V', 0);
+	} else {
+		l->kind = V4L2L_CONV_GREY;
+	}
+	return 0;
+}
+
+/* the planes of a 4:2:0 frame */
+static u8 *v4l2l_conv_plane(const struct v4l2l_conv_layout *l, u8 *frame,
+			    const struct v4l2_pix_format *pix, int plane)
+{
+	const u32 ysize = pix->width * pix->height;
+	if (plane <= 1)
+		return frame + (plane ? ysize : 0);
+	return frame + ysize + ysize / 4;
+}
+
+static void v4l2l_yuv_to_rgb(u8 *dst, const struct v4l2l_conv_layout *l,
+			     int y, int u, int v)
+{
+	const int c = 298 * (y - 16) + 128, d = u - 128, e = v - 128;
+
+	dst[l->r] = clamp((c + 409 * e) >> 8, 0, 255);
+	dst[l->g] = clamp((c - 100 * d - 208 * e) >> 8, 0, 255);
+	dst[l->b] = clamp((c + 516 * d) >> 8, 0, 255);
+	if (l->a >= 0)
+		dst[l->a] = 0xff;
+}
+
+/* read lines @row and @row+1 of a frame into 4:2:2 */
+static void v4l2l_conv_load(const struct v4l2l_conv_layout *l, const u8 *frame,
+			    const struct v4l2_pix_format *pix, u32 row,
+			    u8 *y[2], u8 *u[2], u8 *v[2])
+{
+	const u32 w = pix->width;
+	const u8 *up = v4l2l_conv_plane(l, (u8 *)frame, pix, l->uplane) +
+		       row / 2 * (w / 2) * l->cstep + l->uoff;
+	const u8 *vp = v4l2l_conv_plane(l, (u8 *)frame, pix, l->vplane) +
+		       row / 2 * (w / 2) * l->cstep + l->voff;
+	u32 i, x;
+
+	for (i = 0; i < 2; i++) {
+		const u8 *line = frame + (row + i) * pix->bytesperline;
+
+		switch (l->kind) {
+		case V4L2L_CONV_GREY:
+			memcpy(y[i], line, w);
+			memset(u[i], 128, w / 2);
+			memset(v[i], 128, w / 2);
+			break;
+		case V4L2L_CONV_PACKED_YUV:
+			for (x = 0; x < w / 2; x++, line += l->unitsize) {
+				y[i][2 * x] = line[l->y0];
+				y[i][2 * x + 1] = line[l->y1];
+				u[i][x] = line[l->u];
+				v[i][x] = line[l->v];
+			}
+			break;
+		case V4L2L_CONV_PACKED_RGB:
+			for (x = 0; x < w / 2; x++, line += 2 * l->unitsize) {
+				const u8 *p = line + l->unitsize;
+				const int r = (line[l->r] + p[l->r] + 1) / 2;
+				const int g = (line[l->g] + p[l->g] + 1) / 2;
+				const int b = (line[l->b] + p[l->b] + 1) / 2;
+
+				y[i][2 * x] = v4l2l_rgb_to_y(line[l->r],
+							     line[l->g],
+							     line[l->b]);
+				y[i][2 * x + 1] =
+					v4l2l_rgb_to_y(p[l->r], p[l->g], p[l->b]);
+				u[i][x] = v4l2l_rgb_to_u(r, g, b);
+				v[i][x] = v4l2l_rgb_to_v(r, g, b);
+			}
+			break;
+		case V4L2L_CONV_PLANAR_YUV:
+			memcpy(y[i], frame + (row + i) * w, w);
+			for (x = 0; x < w / 2; x++) {
+				u[i][x] = up[x * l->cstep];
+				v[i][x] = vp[x * l->cstep];
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* write lines @row and @row+1 of a frame from 4:2:2 */
+static void v4l2l_conv_store(const struct v4l2l_conv_layout *l, u8 *frame,
+			     const struct v4l2_pix_format *pix, u32 row,
+			     u8 *y[2], u8 *u[2], u8 *v[2])
+{
+	const u32 w = pix->width;
+	u8 *up = v4l2l_conv_plane(l, frame, pix, l->uplane) +
+		 row / 2 * (w / 2) * l->cstep + l->uoff;
+	u8 *vp = v4l2l_conv_plane(l, frame, pix, l->vplane) +
+		 row / 2 * (w / 2) * l->cstep + l->voff;
+	u32 i, x;
+
+	for (i = 0; i < 2; i++) {
+		u8 *line = frame + (row + i) * pix->bytesperline;
+
+		switch (l->kind) {
+		case V4L2L_CONV_GREY:
+			memcpy(line, y[i], w);
+			break;
+		case V4L2L_CONV_PACKED_YUV:
+			for (x = 0; x < w / 2; x++, line += l->unitsize) {
+				line[l->y0] = y[i][2 * x];
+				line[l->y1] = y[i][2 * x + 1];
+				line[l->u] = u[i][x];
+				line[l->v] = v[i][x];
+			}
+			break;
+		case V4L2L_CONV_PACKED_RGB:
+			for (x = 0; x < w; x++, line += l->unitsize)
+				v4l2l_yuv_to_rgb(line, l, y[i][x], u[i][x / 2],
+						 v[i][x / 2]);
+			break;
+		case V4L2L_CONV_PLANAR_YUV:
+			memcpy(frame + (row + i) * w, y[i], w);
+			break;
+		default:
+			break;
+		}
+	}
+	if (l->kind == V4L2L_CONV_PLANAR_YUV) {
+		for (x = 0; x < w / 2; x++) {
+			up[x * l->cstep] = (u[0][x] + u[1][x] + 1) / 2;
+			vp[x * l->cstep] = (v[0][x] + v[1][x] + 1) / 2;
+		}
+	}
+}
+
+static void v4l2l_convert_frame(struct v4l2l_conversion *conv, const u8 *src,
+				u8 *dst)
+{
+	const struct v4l2l_conv_layout *from = &conv->from, *to = &conv->to;
+	const u32 w = conv->pix.width, h = conv->pix.height;
+	u8 *y[2] = { conv->lines, conv->lines + w };
+	u8 *u[2] = { conv->lines + 2 * w, conv->lines + 2 * w + w / 2 };
+	u8 *v[2] = { conv->lines + 3 * w, conv->lines + 3 * w + w / 2 };
+	u32 row, x;
+
+	if (from->kind == V4L2L_CONV_PACKED_RGB &&
+	    to->kind == V4L2L_CONV_PACKED_RGB) {
+		/* just shuffle the components */
+		for (row = 0; row < h; row++) {
+			const u8 *s = src + row * conv->src_pix.bytesperline;
+			u8 *d = dst + row * conv->pix.bytesperline;
+			for (x = 0; x < w; x++) {
+				d[to->r] = s[from->r];
+				d[to->g] = s[from->g];
+				d[to->b] = s[from->b];
+				if (to->a >= 0)
+					d[to->a] = from->a >= 0 ? s[from->a] :
+								  0xff;
+				s += from->unitsize;
+				d += to->unitsize;
+			}
+		}
+		return;
+	}
+	for (row = 0; row < h; row += 2) {
+		v4l2l_conv_load(from, src, &conv->src_pix, row, y, u, v);
+		v4l2l_conv_store(to, dst, &conv->pix, row, y, u, v);
+	}
+}
+
+/* whether frames of format @src can be converted to @fourcc; fills in the
+ * converted format */
+static bool v4l2l_conv_format(const struct v4l2_pix_format *src, u32 fourcc,
+			      struct v4l2_pix_format *pix)
+{
+	const struct v4l2l_format *fmt = format_by_fourcc(fourcc);
+	const struct v4l2l_format *src_fmt = format_by_fourcc(src->pixelformat);
+	struct v4l2l_conv_layout from, to;
+	struct v4l2_pix_format expected;
+
+	if (!fmt || !src_fmt || fourcc == src->pixelformat ||
+	    v4l2l_conv_layout(src->pixelformat, &from) < 0 ||
+	    v4l2l_conv_layout(fourcc, &to) < 0)
+		return false;
+	if (!src->width || !src->height || src->width % 2 || src->height % 2)
+		return false;
+	/* the source must be laid out the way we expect */
+	pix_format_set_size(&expected, src_fmt, src->width, src->height);
+	if (src->sizeimage < expected.sizeimage ||
+	    src->bytesperline != expected.bytesperline)
+		return false;
+
+	*pix = *src;
+	pix->pixelformat = fourcc;
+	pix_format_set_size(pix, fmt, src->width, src->height);
+	return true;
+}
+
+/* the n-th format (other than its own) that a source's frames can be
+ * converted to; 0 if there is none */
+static u32 v4l2l_conv_enum(const struct v4l2_pix_format *src, u32 n)
+{
+	struct v4l2_pix_format pix;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(v4l2l_fill_formats); i++) {
+		const u32 fourcc = v4l2l_fill_formats[i].fourcc;
+		if (v4l2l_conv_format(src, fourcc, &pix) && !n--)
+			return fourcc;
+	}
+	return 0;
+}
+
+/* get a conversion of the source's frames to @fourcc (shared with the other
+ * readers of that format); must be called with the source's image_mutex
+ * held */
+static struct v4l2l_conversion *
+conversion_get(struct v4l2_loopback_device *src, u32 fourcc)
+{
+	struct v4l2l_conversion *conv;
+	struct v4l2_pix_format pix;
+	u32 i;
+
+	list_for_each_entry(conv, &src->conversions, list) {
+		if (conv->pix.pixelformat == fourcc &&
+		    pix_format_eq(&conv->src_pix, &src->pix_format, 1) &&
+		    conv->buffer_count == src->buffer_count) {
+			conv->users++;
+			return conv;
+		}
+	}
+
+	if (!v4l2l_conv_format(&src->pix_format, fourcc, &pix) ||
+	    (u64)PAGE_ALIGN(pix.sizeimage) * src->buffer_count >
+		    V4L2L_CONV_OFFSET)
+		return ERR_PTR(-EINVAL);
+	conv = kzalloc(sizeof(*conv), GFP_KERNEL);
+	if (!conv)
+		return ERR_PTR(-ENOMEM);
+	conv->src_pix = src->pix_format;
+	conv->pix = pix;
+	v4l2l_conv_layout(conv->src_pix.pixelformat, &conv->from);
+	v4l2l_conv_layout(fourcc, &conv->to);
+	conv->buffer_size = PAGE_ALIGN(pix.sizeimage);
+	conv->buffer_count = src->buffer_count;
+	conv->image = vzalloc((unsigned long)conv->buffer_size *
+			      conv->buffer_count);
+	conv->lines = kmalloc(4 * pix.width, GFP_KERNEL);
+	if (!conv->image || !conv->lines) {
+		vfree(conv->image);
+		kfree(conv->lines);
+		kfree(conv);
+		return ERR_PTR(-ENOMEM);
+	}
+	/* nothing has been converted yet */
+	for (i = 0; i < MAX_BUFFERS; i++)
+		conv->converted[i] = U32_MAX;
+	mutex_init(&conv->lock);
+	conv->users = 1;
+	list_add(&conv->list, &src->conversions);
+	return conv;
+}
+
+/* must be called with the source's image_mutex held */
+static void conversion_put(struct v4l2l_conversion *conv)
+{
+	if (--conv->users)
+		return;
+	list_del(&conv->list);
+	/* the pages stay around for as long as they are mapped */
+	vfree(conv->image);
+	kfree(conv->lines);
+	kfree(conv);
+}
+
+/* the frame in the source's buffer @index, converted (if that has not been
+ * done already) */
+static u8 *conversion_frame(struct v4l2_loopback_device *src,
+			    struct v4l2l_conversion *conv, u32 index)
+{
+	struct v4l2l_buffer *bufd = &src->buffers[index];
+	u8 *frame = conv->image + (unsigned long)index * conv->buffer_size;
+	const u32 generation = READ_ONCE(bufd->generation);
+
+	mutex_lock(&conv->lock);
+	/* (the source's buffers cannot change while we are reading them) */
+	if (conv->converted[index] != generation &&
+	    index < conv->buffer_count &&
+	    pix_format_eq(&conv->src_pix, &src->pix_format, 1)) {
+		v4l2l_convert_frame(conv, src->image + bufd->buffer.m.offset,
+				    frame);
+		conv->converted[index] = generation;
+		v4l2l_stat_inc(src, frames_converted);
+	}
+	mutex_unlock(&conv->lock);
+	return frame;
+}
+
+/* the format a sink's readers get converted frames in; 0 if they get the
+ * source's frames as they are */
+static u32 tee_conv_fourcc(struct v4l2_loopback_device *sink)
+{
+	struct v4l2_pix_format pix;
+
+	if (!sink->tee_source || !sink->conv_fourcc ||
+	    !v4l2l_conv_format(&sink->tee_source->pix_format,
+			       sink->conv_fourcc, &pix))
+		return 0;
+	return sink->conv_fourcc;
+}
+
+/* switch a reader of a linked device to the conversion of the source's
+ * frames to @fourcc (or to no conversion if 0)
+ * may be called with the sink's image_mutex held (see ring_reqbufs) */
+static int tee_set_conversion(struct v4l2_loopback_device *sink,
+			      struct v4l2_loopback_opener *opener, u32 fourcc)
+{
+	struct v4l2_loopback_device *src = sink->tee_source;
+	struct v4l2l_conversion *conv = NULL;
+	int result = 0;
+
+	if (!src || (!opener->conv && !fourcc))
+		return 0;
+	mutex_lock_nested(&src->image_mutex, SINGLE_DEPTH_NESTING);
+	if (fourcc) {
+		conv = conversion_get(src, fourcc);
+		if (IS_ERR(conv)) {
+			result = PTR_ERR(conv);
+			goto exit_unlock;
+		}
+	}
+	if (opener->conv)
+		conversion_put(opener->conv);
+	opener->conv = conv;
+exit_unlock:
+	mutex_unlock(&src->image_mutex);
+	return result;
+}
+
+/* the format of the frames the readers of a device get */
+static void reader_pix_format(struct v4l2_loopback_device *dev,
+			      struct v4l2_pix_format *pix)
+{
+	if (!tee_conv_fourcc(dev) ||
+	    !v4l2l_conv_format(&dev->tee_source->pix_format, dev->conv_fourcc,
+			       pix))
+		*pix = ring_dev(dev)->pix_format;
+}
+
+/* point a reader's buffer at its converted frame */
+static void conversion_buffer(struct v4l2l_conversion *conv,
+			      struct v4l2_buffer *buf)
+{
+	buf->length = conv->buffer_size;
+	buf->m.offset = V4L2L_CONV_OFFSET + buf->index * conv->buffer_size;
+	if (buf->bytesused)
+		buf->bytesused = conv->pix.sizeimage;
+}
+
+/* forward declarations */
+static void client_usage_queue_event(struct video_device *vdev);
+static void frame_lag_queue_event(struct v4l2_loopback_opener *opener,
+				  u32 dropped, u32 lag, u32 sequence);
+static void format_request_queue_event(struct v4l2_loopback_device *dev,
+				       const struct v4l2_pix_format *pix,
+				       const struct v4l2_fract *tpf, bool set);
+static int set_tile(struct v4l2_loopback_device *dev,
+		    struct v4l2_loopback_opener *opener, struct v4l2_rect *rect);
+static int synth_start(struct v4l2_loopback_device *dev, int mode);
+static void synth_stop(struct v4l2_loopback_device *dev);
+static bool any_buffers_mapped(struct v4l2_loopback_device *dev);
+static int allocate_buffers(struct v4l2_loopback_device *dev,
+			    struct v4l2_pix_format *pix_format);
+static int grow_buffers(struct v4l2_loopback_device *dev, size_t size);
+static void init_buffers(struct v4l2_loopback_device *dev, u32 bytes_used,
+			 u32 buffer_size);
+static void free_buffers(struct v4l2_loopback_device *dev);
+static int allocate_timeout_buffer(struct v4l2_loopback_device *dev,
+				   const struct v4l2_pix_format *pix_format);
+static void free_timeout_buffer(struct v4l2_loopback_device *dev);
+static void check_timers(struct v4l2_loopback_device *dev);
+static void arm_timer(struct v4l2_loopback_device *dev, u32 which,
+		      unsigned long expires);
+static void disarm_timer(struct v4l2_loopback_device *dev, u32 which);
+static void cancel_timers(struct v4l2_loopback_device *dev);
+static const struct v4l2_file_operations v4l2_loopback_fops;
+static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops;
+
+/* V4L2 ioctl caps and params calls */
 /* returns device capabilities
  * called on VIDIOC_QUERYCAP
  */
@@ -902,7 +2609,10 @@ static int vidioc_querycap(struct file *file, void *fh,
 	snprintf(cap->bus_info, sizeof(cap->bus_info),
 		 "platform:v4l2loopback-%03d", device_nr);
 
-	if (dev->announce_all_caps) {
+	if (dev->tee_source) {
+		/* a linked device only has readers */
+		capabilities |= V4L2_CAP_VIDEO_CAPTURE;
+	} else if (dev->announce_all_caps) {
 		capabilities |= V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_OUTPUT;
 	} else {
 		if (opener->io_method == V4L2L_IO_TIMEOUT ||
@@ -934,15 +2644,22 @@ static int vidioc_enum_framesizes(struct file *file, void *fh,
 	if (argp->index)
 		return -EINVAL;
 
-	if (dev->keep_format || has_other_owners(opener, dev)) {
+	if (dev->keep_format || has_other_owners(opener, dev) ||
+	    dev->tee_source) {
+		const struct v4l2_pix_format *pix = &ring_dev(dev)->pix_format;
+		struct v4l2_pix_format conv;
+		/* the frames of a linked device can be converted */
+		if (dev->tee_source &&
+		    v4l2l_conv_format(pix, argp->pixel_format, &conv))
+			pix = &conv;
 		/* only current frame size supported */
-		if (argp->pixel_format != dev->pix_format.pixelformat)
+		if (argp->pixel_format != pix->pixelformat)
 			return -EINVAL;
 
 		argp->type = V4L2_FRMSIZE_TYPE_DISCRETE;
 
-		argp->discrete.width = dev->pix_format.width;
-		argp->discrete.height = dev->pix_format.height;
+		argp->discrete.width = pix->width;
+		argp->discrete.height = pix->height;
 	} else {
 		/* return continuous sizes if pixel format is supported */
 		if (NULL == format_by_fourcc(argp->pixel_format))
@@ -980,6 +2697,9 @@ static int check_buffer_capability(struct v4l2_loopback_device *dev,
 	/* short-circuit for (non-compliant) timeout image mode */
 	if (opener->io_method == V4L2L_IO_TIMEOUT)
 		return 0;
+	/* a linked device can only be read from */
+	if (dev->tee_source)
+		return type == V4L2_BUF_TYPE_VIDEO_CAPTURE ? 0 : -EINVAL;
 	if (dev->announce_all_caps)
 		return (type == V4L2_BUF_TYPE_VIDEO_CAPTURE ||
 			type == V4L2_BUF_TYPE_VIDEO_OUTPUT) ?
@@ -1016,15 +2736,21 @@ static int vidioc_enum_frameintervals(struct file *file, void *fh,
 	if (argp->index)
 		return -EINVAL;
 
-	if (dev->keep_format || has_other_owners(opener, dev)) {
+	if (dev->keep_format || has_other_owners(opener, dev) ||
+	    dev->tee_source) {
+		const struct v4l2_loopback_device *ring = ring_dev(dev);
+		struct v4l2_pix_format conv;
 		/* keep_format also locks the frame rate */
-		if (argp->width != dev->pix_format.width ||
-		    argp->height != dev->pix_format.height ||
-		    argp->pixel_format != dev->pix_format.pixelformat)
+		if (argp->width != ring->pix_format.width ||
+		    argp->height != ring->pix_format.height ||
+		    (argp->pixel_format != ring->pix_format.pixelformat &&
+		     !(dev->tee_source &&
+		       v4l2l_conv_format(&ring->pix_format,
+					 argp->pixel_format, &conv))))
 			return -EINVAL;
 
 		argp->type = V4L2_FRMIVAL_TYPE_DISCRETE;
-		argp->discrete = dev->capture_param.timeperframe;
+		argp->discrete = ring->capture_param.timeperframe;
 	} else {
 		if (argp->width < dev->min_width ||
 		    argp->width > dev->max_width ||
@@ -1054,7 +2780,8 @@ static int vidioc_enum_fmt_vid(struct file *file, void *fh,
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
-	int fixed = dev->keep_format || has_other_owners(opener, dev);
+	int fixed = dev->keep_format || has_other_owners(opener, dev) ||
+		    dev->tee_source;
 	const struct v4l2l_format *fmt;
 
 	if (check_buffer_capability(dev, opener, f->type) < 0)
@@ -1063,11 +2790,20 @@ static int vidioc_enum_fmt_vid(struct file *file, void *fh,
 	if (!(f->index < FORMATS))
 		return -EINVAL;
 	/* TODO: Support 6.14 V4L2_FMTDESC_FLAG_ENUM_ALL */
-	if (fixed && f->index)
+	if (dev->tee_source && f->index) {
+		/* the formats the source's frames can be converted to */
+		const u32 fourcc = v4l2l_conv_enum(&dev->tee_source->pix_format,
+						   f->index - 1);
+		if (!fourcc)
+			return -EINVAL;
+		fmt = format_by_fourcc(fourcc);
+	} else if (fixed && f->index) {
 		return -EINVAL;
-
-	fmt = fixed ? format_by_fourcc(dev->pix_format.pixelformat) :
-		      &formats[f->index];
+	} else {
+		fmt = fixed ? format_by_fourcc(
+				      ring_dev(dev)->pix_format.pixelformat) :
+			      &formats[f->index];
+	}
 	if (!fmt)
 		return -EFAULT;
 
@@ -1079,6 +2815,21 @@ static int vidioc_enum_fmt_vid(struct file *file, void *fh,
 	return 0;
 }
 
+/* compressed frames vary in size: their buffers are as large as the producer
+ * asks for (or as CID_COMPRESSED_SIZE says), but no larger than a raw frame
+ * (which is what pix_format_set_size() makes them) */
+static void compressed_sizeimage(struct v4l2_loopback_device *dev,
+				 struct v4l2_pix_format *pix, u32 requested)
+{
+	const struct v4l2l_format *fmt = format_by_fourcc(pix->pixelformat);
+	const u32 size = requested ? requested : dev->compressed_size;
+
+	if (!fmt || !(fmt->flags & FORMAT_FLAGS_COMPRESSED))
+		return;
+	if (size && size < pix->sizeimage)
+		pix->sizeimage = size;
+}
+
 /* Tests (or tries) the format.
  * Returns:
  * -   EINVAL if the buffer type or format is not supported
@@ -1088,12 +2839,25 @@ static int vidioc_try_fmt_vid(struct file *file, void *fh,
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	const u32 sizeimage = f->fmt.pix.sizeimage;
 
 	if (check_buffer_capability(dev, opener, f->type) < 0)
 		return -EINVAL;
+	if (dev->tee_source) {
+		/* the readers of a linked device get the source's format, or
+		 * a conversion of it */
+		struct v4l2_pix_format pix;
+		if (v4l2l_conv_format(&dev->tee_source->pix_format,
+				      f->fmt.pix.pixelformat, &pix))
+			f->fmt.pix = pix;
+		else
+			f->fmt.pix = dev->tee_source->pix_format;
+		return 0;
+	}
 	if (v4l2l_fill_format(f, dev->min_width, dev->max_width,
 			      dev->min_height, dev->max_height) != 0)
 		return -EINVAL;
+	compressed_sizeimage(dev, &f->fmt.pix, sizeimage);
 	if (dev->keep_format || has_other_owners(opener, dev))
 		/* use existing format - including colorspace info */
 		f->fmt.pix = dev->pix_format;
@@ -1132,15 +2896,25 @@ static int vidioc_s_fmt_vid(struct file *file, void *fh, struct v4l2_format *f)
 
 	if (opener->format_token)
 		release_token(dev, opener, format);
+	/* the (fixed) format is compatible with the ring of a parked writer */
+	adopt_parked_token(dev, format, token);
 	if (!(dev->format_tokens & token)) {
 		result = -EBUSY;
 		goto exit_s_fmt_unlock;
 	}
 
-	dprintk("S_FMT[%s] %4s:%ux%u size=%u\n",
-		V4L2_TYPE_IS_CAPTURE(f->type) ? "CAPTURE" : "OUTPUT",
-		fourcc2str(f->fmt.pix.pixelformat, buf), f->fmt.pix.width,
-		f->fmt.pix.height, f->fmt.pix.sizeimage);
+	dprintkdev(dev, "S_FMT[%s] %4s:%ux%u size=%u\n",
+		   V4L2_TYPE_IS_CAPTURE(f->type) ? "CAPTURE" : "OUTPUT",
+		   fourcc2str(f->fmt.pix.pixelformat, buf), f->fmt.pix.width,
+		   f->fmt.pix.height, f->fmt.pix.sizeimage);
+	if (dev->tee_source) {
+		/* the buffers are the source's (or conversions of them) */
+		dev->conv_fourcc = f->fmt.pix.pixelformat;
+		if (dev->conv_fourcc == dev->tee_source->pix_format.pixelformat)
+			dev->conv_fourcc = 0;
+		acquire_token(dev, opener, format, token);
+		goto exit_s_fmt_unlock;
+	}
 	changed = !pix_format_eq(&dev->pix_format, &f->fmt.pix, 0);
 	if (changed || has_no_owners(dev)) {
 		result = allocate_buffers(dev, &f->fmt.pix);
@@ -1149,7 +2923,7 @@ static int vidioc_s_fmt_vid(struct file *file, void *fh, struct v4l2_format *f)
 	}
 	if ((dev->timeout_image && changed) ||
 	    (!dev->timeout_image && need_timeout_buffer(dev, token))) {
-		result = allocate_timeout_buffer(dev);
+		result = allocate_timeout_buffer(dev, &f->fmt.pix);
 		if (result < 0)
 			goto exit_s_fmt_free;
 	}
@@ -1158,9 +2932,13 @@ static int vidioc_s_fmt_vid(struct file *file, void *fh, struct v4l2_format *f)
 		dev->pix_format_has_valid_sizeimage =
 			v4l2l_pix_format_has_valid_sizeimage(f);
 	}
-	acquire_token(dev, opener, format, token);
-	if (opener->io_method == V4L2L_IO_TIMEOUT)
+	if (opener->io_method == V4L2L_IO_TIMEOUT) {
+		result = timeout_image_make_private(dev);
+		if (result < 0)
+			goto exit_s_fmt_unlock;
 		dev->timeout_image_io = 0;
+	}
+	acquire_token(dev, opener, format, token);
 	goto exit_s_fmt_unlock;
 exit_s_fmt_free:
 	free_buffers(dev);
@@ -1185,19 +2963,178 @@ static int vidioc_g_fmt_cap(struct file *file, void *fh, struct v4l2_format *f)
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
 	if (check_buffer_capability(dev, opener, f->type) < 0)
 		return -EINVAL;
-	f->fmt.pix = dev->pix_format;
+	reader_pix_format(dev, &f->fmt.pix);
 	return 0;
 }
 
 static int vidioc_try_fmt_cap(struct file *file, void *fh,
 			      struct v4l2_format *f)
 {
-	return vidioc_try_fmt_vid(file, fh, f);
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	const struct v4l2_pix_format requested = f->fmt.pix;
+	int result = vidioc_try_fmt_vid(file, fh, f);
+
+	if (!result)
+		format_request_queue_event(ring_dev(dev), &requested, NULL,
+					   false);
+	return result;
 }
 
 static int vidioc_s_fmt_cap(struct file *file, void *fh, struct v4l2_format *f)
 {
-	return vidioc_s_fmt_vid(file, fh, f);
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	const struct v4l2_pix_format requested = f->fmt.pix;
+	int result = vidioc_s_fmt_vid(file, fh, f);
+
+	if (!result) {
+		format_request_queue_event(ring_dev(dev), &requested, NULL,
+					   true);
+		/* a new format resets the crop rectangle */
+		memset(&fh_to_opener(fh)->crop, 0, sizeof(struct v4l2_rect));
+	}
+	return result;
+}
+
+/* the horizontal granularity (in pixels) of the crop rectangles of frames of
+ * the given format; 0 if they cannot be cropped line by line */
+static u32 crop_alignment(const struct v4l2_pix_format *pix)
+{
+	const struct v4l2l_format *fmt = format_by_fourcc(pix->pixelformat);
+	int i;
+
+	if (!fmt || fmt->flags & (FORMAT_FLAGS_PLANAR | FORMAT_FLAGS_COMPRESSED) ||
+	    fmt->depth % 8)
+		return 0;
+	/* e.g. the two pixels of a YUYV macropixel */
+	for (i = 0; i < ARRAY_SIZE(v4l2l_fill_formats); i++) {
+		if (v4l2l_fill_formats[i].fourcc == pix->pixelformat)
+			return v4l2l_fill_formats[i].ppu;
+	}
+	return 1;
+}
+
+/* the part of the frames (of format @pix) that an opener read()s
+ * returns false if that is the whole frame */
+static bool opener_crop(struct v4l2_loopback_opener *opener,
+			const struct v4l2_pix_format *pix, struct v4l2_rect *r)
+{
+	*r = opener->crop;
+	/* (the format might have changed since the rectangle was set) */
+	if (r->width && r->height && crop_alignment(pix) &&
+	    r->left + r->width <= pix->width &&
+	    r->top + r->height <= pix->height)
+		return r->width != pix->width || r->height != pix->height;
+	r->left = r->top = 0;
+	r->width = pix->width;
+	r->height = pix->height;
+	return false;
+}
+
+/* get the crop rectangle of a reader, or the tile of a writer (and their
+ * bounds)
+ * called on VIDIOC_G_SELECTION */
+static int vidioc_g_selection(struct file *file, void *fh,
+			      struct v4l2_selection *s)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2_pix_format pix;
+
+	switch (s->type) {
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+		if (check_buffer_capability(dev, opener, s->type) < 0)
+			return -EINVAL;
+		reader_pix_format(dev, &pix);
+		break;
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+		if (!dev->tiled_output)
+			return -EINVAL;
+		pix = dev->pix_format;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (s->target) {
+	case V4L2_SEL_TGT_CROP:
+		if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+			return -EINVAL;
+		opener_crop(opener, &pix, &s->r);
+		return 0;
+	case V4L2_SEL_TGT_COMPOSE:
+		if (s->type != V4L2_BUF_TYPE_VIDEO_OUTPUT)
+			return -EINVAL;
+		if (list_empty(&opener->tile_node))
+			break;
+		s->r = opener->tile;
+		return 0;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+			return -EINVAL;
+		break;
+	case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+	case V4L2_SEL_TGT_COMPOSE_BOUNDS:
+		if (s->type != V4L2_BUF_TYPE_VIDEO_OUTPUT)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	/* the whole frame */
+	s->r.left = s->r.top = 0;
+	s->r.width = pix.width;
+	s->r.height = pix.height;
+	return 0;
+}
+
+/* fit a rectangle into frames of format @pix (see crop_alignment) */
+static void selection_adjust(const struct v4l2_pix_format *pix, u32 align,
+			     const struct v4l2_rect *in, struct v4l2_rect *r)
+{
+	r->left = clamp_t(s32, in->left, 0, pix->width - align);
+	r->left -= r->left % align;
+	r->top = clamp_t(s32, in->top, 0, pix->height - 1);
+	r->width = clamp_t(u32, roundup(in->width, align), align,
+			   rounddown(pix->width - r->left, align));
+	r->height = clamp_t(u32, in->height, 1, pix->height - r->top);
+}
+
+/* crop the frames a reader gets through read() to a rectangle (which is
+ * adjusted to the frame); the other readers are not affected, and mmap()
+ * users find the rectangle within their buffers with VIDIOC_G_SELECTION
+ * only packed formats can be cropped
+ * (for OUTPUT, this sets the tile of a writer, see set_tile)
+ * called on VIDIOC_S_SELECTION */
+static int vidioc_s_selection(struct file *file, void *fh,
+			      struct v4l2_selection *s)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2_pix_format pix;
+	struct v4l2_rect r;
+	u32 align;
+
+	if (s->type == V4L2_BUF_TYPE_VIDEO_OUTPUT &&
+	    s->target == V4L2_SEL_TGT_COMPOSE)
+		return set_tile(dev, opener, &s->r);
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+	    check_buffer_capability(dev, opener, s->type) < 0 ||
+	    s->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+	reader_pix_format(dev, &pix);
+
+	align = crop_alignment(&pix);
+	if (!align || pix.width < align || !pix.height) {
+		memset(&opener->crop, 0, sizeof(opener->crop));
+		opener_crop(opener, &pix, &s->r);
+		return 0;
+	}
+	selection_adjust(&pix, align, &s->r, &r);
+	dprintkdev(dev, "S_SELECTION(crop=%ux%u@%d,%d)\n", r.width, r.height,
+		   r.left, r.top);
+	opener->crop = s->r = r;
+	return 0;
 }
 
 /* ------------------ OUTPUT ----------------------- */
@@ -1275,12 +3212,28 @@ static int vidioc_g_parm(struct file *file, void *fh,
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
 	if (check_buffer_capability(dev, opener, parm->type) < 0)
 		return -EINVAL;
-	parm->parm.capture = dev->capture_param;
+	parm->parm.capture = ring_dev(dev)->capture_param;
+	if (V4L2_TYPE_IS_CAPTURE(parm->type) && opener->timeperframe.denominator)
+		parm->parm.capture.timeperframe = opener->timeperframe;
 	return 0;
 }
 
-/* get some data flow parameters, only capability, fps and readbuffers has
+/* a CAPTURE opener asking for a longer frame interval than the writer's only
+ * gets (and is only woken up for) the frames that match its own cadence;
+ * must be called with dev->lock held */
+static void set_opener_timeperframe(struct v4l2_loopback_device *dev,
+				    struct v4l2_loopback_opener *opener,
+				    const struct v4l2_fract *tpf)
+{
+	opener->timeperframe = *tpf;
+	opener->frame_interval_ns = timeperframe_to_ns(tpf);
+	opener->next_due_ns = 0;
+}
+
+/* set some data flow parameters, only capability, fps and readbuffers has
  * effect on this driver
+ * the frame interval set for CAPTURE is the opener's own; it also becomes the
+ * device's as long as no writer is streaming
  * called on VIDIOC_S_PARM
  */
 static int vidioc_s_parm(struct file *file, void *fh,
@@ -1288,17 +3241,27 @@ static int vidioc_s_parm(struct file *file, void *fh,
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	struct v4l2_fract *tpf;
 
-	dprintk("S_PARM(frame-time=%u/%u)\n",
-		parm->parm.capture.timeperframe.numerator,
-		parm->parm.capture.timeperframe.denominator);
+	dprintkdev(dev, "S_PARM(frame-time=%u/%u)\n",
+		   parm->parm.capture.timeperframe.numerator,
+		   parm->parm.capture.timeperframe.denominator);
 	if (check_buffer_capability(dev, opener, parm->type) < 0)
 		return -EINVAL;
 
 	switch (parm->type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-		set_timeperframe(dev, &parm->parm.capture.timeperframe);
-		break;
+		tpf = &parm->parm.capture.timeperframe;
+		clamp_timeperframe(tpf);
+		format_request_queue_event(ring_dev(dev), NULL, tpf, false);
+		spin_lock_bh(&ring_dev(dev)->lock);
+		set_opener_timeperframe(ring_dev(dev), opener, tpf);
+		spin_unlock_bh(&ring_dev(dev)->lock);
+		if (!has_writer(dev) && !dev->tee_source)
+			set_timeperframe(dev, tpf);
+		parm->parm.capture = ring_dev(dev)->capture_param;
+		parm->parm.capture.timeperframe = *tpf;
+		return 0;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
 		set_timeperframe(dev, &parm->parm.output.timeperframe);
 		break;
@@ -1374,6 +3337,9 @@ static int v4l2loopback_set_ctrl(struct v4l2_loopback_device *dev, u32 id,
 	case CID_SUSTAIN_FRAMERATE:
 		if (val < 0 || val > 1)
 			return -EINVAL;
+		/* the readers of a linked device follow the source's */
+		if (dev->tee_source)
+			return -EBUSY;
 		spin_lock_bh(&dev->lock);
 		dev->sustain_framerate = val;
 		check_timers(dev);
@@ -1382,6 +3348,8 @@ static int v4l2loopback_set_ctrl(struct v4l2_loopback_device *dev, u32 id,
 	case CID_TIMEOUT:
 		if (val < 0 || val > MAX_TIMEOUT)
 			return -EINVAL;
+		if (dev->tee_source)
+			return -EBUSY;
 		if (val > 0) {
 			result = mutex_lock_killable(&dev->image_mutex);
 			if (result < 0)
@@ -1389,7 +3357,8 @@ static int v4l2loopback_set_ctrl(struct v4l2_loopback_device *dev, u32 id,
 			/* on-the-fly allocate if device is owned; else
 			 * allocate occurs on next S_FMT or REQBUFS */
 			if (!has_no_owners(dev))
-				result = allocate_timeout_buffer(dev);
+				result = allocate_timeout_buffer(
+					dev, &dev->pix_format);
 			mutex_unlock(&dev->image_mutex);
 			if (result < 0) {
 				/* disable timeout as buffer not alloc'd */
@@ -1407,6 +3376,70 @@ static int v4l2loopback_set_ctrl(struct v4l2_loopback_device *dev, u32 id,
 	case CID_TIMEOUT_IMAGE_IO:
 		dev->timeout_image_io = 1;
 		break;
+	case CID_TIMEOUT_PATTERN:
+	case CID_TIMEOUT_COLOUR: {
+		u32 *setting = (id == CID_TIMEOUT_PATTERN) ?
+				       &dev->timeout_pattern :
+				       &dev->timeout_colour;
+		u32 old;
+
+		if (val < 0 || (id == CID_TIMEOUT_PATTERN &&
+				val > V4L2L_TIMEOUT_PATTERN_BARS) ||
+		    (id == CID_TIMEOUT_COLOUR && val > 0xffffff))
+			return -EINVAL;
+		result = mutex_lock_killable(&dev->image_mutex);
+		if (result < 0)
+			return result;
+		old = *setting;
+		*setting = val;
+		result = update_timeout_image(dev);
+		if (result < 0)
+			/* keep the old setting */
+			*setting = old;
+		mutex_unlock(&dev->image_mutex);
+		return result;
+	}
+	case CID_WRITER_HANDOVER:
+		if (val < 0 || val > 1)
+			return -EINVAL;
+		result = mutex_lock_killable(&dev->image_mutex);
+		if (result < 0)
+			return result;
+		dev->writer_handover = val;
+		if (!dev->writer_handover) {
+			unpark_writer(dev);
+			if (has_no_owners(dev))
+				dev->used_buffer_count = 0;
+		}
+		mutex_unlock(&dev->image_mutex);
+		break;
+	case CID_COMPRESSED_SIZE:
+		if (val < 0 || val > S32_MAX)
+			return -EINVAL;
+		/* takes effect with the next S_FMT */
+		dev->compressed_size = val;
+		break;
+	case CID_SYNTHETIC_SOURCE:
+		if (val < V4L2L_SYNTH_OFF || val > V4L2L_SYNTH_STAMP)
+			return -EINVAL;
+		if (val == V4L2L_SYNTH_OFF)
+			synth_stop(dev);
+		else
+			result = synth_start(dev, val);
+		return result;
+	case CID_TILED_OUTPUT:
+		if (val < 0 || val > 1)
+			return -EINVAL;
+		result = mutex_lock_killable(&dev->image_mutex);
+		if (result < 0)
+			return result;
+		/* the tile writers have to give up their tiles first */
+		if (!val && dev->tile_count)
+			result = -EBUSY;
+		else
+			dev->tiled_output = val;
+		mutex_unlock(&dev->image_mutex);
+		return result;
 	default:
 		return -EINVAL;
 	}
@@ -1420,6 +3453,31 @@ static int v4l2loopback_s_ctrl(struct v4l2_ctrl *ctrl)
 	return v4l2loopback_set_ctrl(dev, ctrl->id, ctrl->val);
 }
 
+static int v4l2loopback_opener_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct v4l2_loopback_opener *opener = container_of(
+		ctrl->handler, struct v4l2_loopback_opener, ctrl_handler);
+	switch (ctrl->id) {
+	case CID_MAX_BACKLOG:
+		WRITE_ONCE(opener->max_backlog, ctrl->val);
+		break;
+	case CID_MAX_FRAME_AGE:
+		WRITE_ONCE(opener->max_frame_age_ns,
+			   (u64)ctrl->val * NSEC_PER_MSEC);
+		break;
+	case CID_WAKEUP_FRAMES:
+		WRITE_ONCE(opener->wakeup_frames, ctrl->val);
+		break;
+	case CID_WAKEUP_TIMEOUT:
+		WRITE_ONCE(opener->wakeup_timeout_ns,
+			   (u64)ctrl->val * NSEC_PER_MSEC);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
 /* returns set of device outputs, in our case there is only one
  * called on VIDIOC_ENUMOUTPUT
  */
@@ -1512,7 +3570,7 @@ static int vidioc_enum_input(struct file *file, void *fh,
 #endif
 #endif /* V4L2LOOPBACK_WITH_STD */
 
-	if (has_output_token(dev->stream_tokens) && !dev->keep_format)
+	if (!has_writer(dev) && !ring_dev(dev)->keep_format)
 		/* if no outputs attached; pretend device is powered off */
 		inp->status |= V4L2_IN_ST_NO_SIGNAL;
 
@@ -1554,6 +3612,20 @@ static int vidioc_s_input(struct file *file, void *fh, unsigned int index)
 					 V4L2L_TOKEN_TIMEOUT :           \
 					 token_from_type(type)) &&       \
 	 (index) < (opener)->buffer_count)
+/* whether @index refers to the extra buffer that a CAPTURE opener gets for the
+ * timeout image */
+#define is_timeout_slot(opener, index) \
+	((opener)->timeout_slot && (index) == (opener)->buffer_count - 1)
+
+static struct v4l2l_buffer *
+opener_buffer(struct v4l2_loopback_device *dev,
+	      struct v4l2_loopback_opener *opener, u32 index)
+{
+	if (is_timeout_slot(opener, index))
+		return &dev->timeout_buffer;
+	return &dev->buffers[index];
+}
+
 #define BUFFER_DEBUG_FMT_STR                                      \
 	"buffer#%u @ %p type=%u bytesused=%u length=%u flags=%x " \
 	"field=%u timestamp= %lld.%06lldsequence=%u\n"
@@ -1625,6 +3697,44 @@ exit_prepare_queue_unlock:
 /* forward declaration */
 static int vidioc_streamoff(struct file *file, void *fh,
 			    enum v4l2_buf_type type);
+
+/* buffers for openers sharing a ring they do not own (readers of a linked
+ * device, tile writers, the synthetic source): they are allocated if need be,
+ * but never re-allocated
+ * must be called with the ring's image_mutex held; returns the number of
+ * buffers */
+static int ring_reqbufs_locked(struct v4l2_loopback_device *ring, u32 count)
+{
+	int result;
+
+	if (!ring->image) {
+		result = allocate_buffers(ring, &ring->pix_format);
+		if (result < 0)
+			return result;
+		ring->used_buffer_count = 0;
+	}
+	if (!ring->used_buffer_count) {
+		if (count > ring->buffer_count)
+			count = ring->buffer_count;
+		prepare_buffer_queue(ring, count);
+		ring->used_buffer_count = count;
+	}
+	return ring->used_buffer_count;
+}
+
+/* the readers of a linked device call this with the sink's image_mutex held:
+ * lock order is the sink's image_mutex -> the source's image_mutex */
+static int ring_reqbufs(struct v4l2_loopback_device *ring, u32 count)
+{
+	int result = mutex_lock_killable_nested(&ring->image_mutex,
+						SINGLE_DEPTH_NESTING);
+	if (result < 0)
+		return result;
+	result = ring_reqbufs_locked(ring, count);
+	mutex_unlock(&ring->image_mutex);
+	return result;
+}
+
 /* negotiate buffer type
  * only mmap streaming supported
  * called on VIDIOC_REQBUFS
@@ -1640,10 +3750,10 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 	u32 req_count = reqbuf->count;
 	int result = 0;
 
-	dprintk("REQBUFS(memory=%u, req_count=%u) and device-bufs=%u/%u "
-		"[used/max]\n",
-		reqbuf->memory, req_count, dev->used_buffer_count,
-		dev->buffer_count);
+	dprintkdev(dev,
+		   "REQBUFS(memory=%u, req_count=%u) and device-bufs=%u/%u "
+		   "[used/max]\n", reqbuf->memory, req_count,
+		   dev->used_buffer_count, dev->buffer_count);
 
 	switch (reqbuf->memory) {
 	case V4L2_MEMORY_MMAP:
@@ -1662,6 +3772,9 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 		/* different (buffer) type already assigned to descriptor by
 		 * S_FMT or REQBUFS */
 		return -EINVAL;
+	if (dev->tee_source && token != V4L2L_TOKEN_CAPTURE)
+		/* a linked device cannot be written to */
+		return -EBUSY;
 
 	MARK();
 	result = mutex_lock_killable(&dev->image_mutex);
@@ -1671,8 +3784,11 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 	/* CASE queue/dequeue timeout-buffer only: */
 	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
 		opener->buffer_count = req_count;
-		if (req_count == 0)
+		if (req_count == 0) {
+			/* (QBUF might have been called while it was mapped) */
+			timeout_image_share(dev);
 			release_token(dev, opener, format);
+		}
 		goto exit_reqbufs_unlock;
 	}
 
@@ -1684,10 +3800,16 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 			opener->io_method = V4L2L_IO_MMAP;
 		}
 		result = vidioc_streamoff(file, fh, reqbuf->type);
+		tee_set_conversion(dev, opener, 0);
 		opener->buffer_count = 0;
+		opener->timeout_slot = false;
 		/* undocumented requirement - REQBUFS with count zero should
 		 * ALSO release lock on logical stream */
-		if (opener->format_token)
+		if (opener->format_token == V4L2L_TOKEN_OUTPUT &&
+		    dev->parked_stream_token & V4L2L_TOKEN_OUTPUT)
+			/* ...unless the next writer is going to take over */
+			park_token(dev, opener, format);
+		else if (opener->format_token)
 			release_token(dev, opener, format);
 		if (has_no_owners(dev))
 			dev->used_buffer_count = 0;
@@ -1696,6 +3818,7 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 
 	/* CASE count non-zero: allocate buffers and acquire token for them */
 	MARK();
+	adopt_parked_token(dev, format, token);
 	switch (reqbuf->type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
@@ -1710,6 +3833,22 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 	if (result < 0)
 		goto exit_reqbufs_unlock;
 
+	if (dev->tee_source) {
+		result = ring_reqbufs(dev->tee_source, req_count);
+		if (result < 0)
+			goto exit_reqbufs_unlock;
+		req_count = result;
+		result = tee_set_conversion(dev, opener, tee_conv_fourcc(dev));
+		if (result < 0)
+			goto exit_reqbufs_unlock;
+		acquire_token(dev, opener, format, token);
+		opener->io_method = V4L2L_IO_MMAP;
+		opener->buffer_count = req_count;
+		opener->timeout_slot = false;
+		result = 0;
+		goto exit_reqbufs_unlock;
+	}
+
 	if (has_other_owners(opener, dev) && dev->used_buffer_count > 0) {
 		/* allow 'allocation' of existing number of buffers */
 		req_count = dev->used_buffer_count;
@@ -1730,8 +3869,16 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 		if (result < 0)
 			goto exit_reqbufs_unlock;
 	}
-	if (!dev->timeout_image && need_timeout_buffer(dev, token)) {
-		result = allocate_timeout_buffer(dev);
+	/* (readers get a buffer for the timeout image in any case) */
+	if (!dev->timeout_image && (need_timeout_buffer(dev, token) ||
+				    token == V4L2L_TOKEN_CAPTURE)) {
+		result = allocate_timeout_buffer(dev, &dev->pix_format);
+		if (result < 0)
+			goto exit_reqbufs_unlock;
+	}
+	if (token == V4L2L_TOKEN_TIMEOUT) {
+		/* the timeout image is about to be written to */
+		result = timeout_image_make_private(dev);
 		if (result < 0)
 			goto exit_reqbufs_unlock;
 	}
@@ -1747,6 +3894,13 @@ static int vidioc_reqbufs(struct file *file, void *fh,
 		opener->io_method = V4L2L_IO_MMAP;
 		prepare_buffer_queue(dev, req_count);
 		dev->used_buffer_count = opener->buffer_count = req_count;
+		/* let readers dequeue the timeout image directly (instead of
+		 * copying it into the ring); they get the buffer even if there
+		 * are no timeouts (yet), as they might be enabled later */
+		opener->timeout_slot = token == V4L2L_TOKEN_CAPTURE;
+		opener->timed_out = false;
+		if (opener->timeout_slot)
+			opener->buffer_count++;
 	}
 exit_reqbufs_unlock:
 	mutex_unlock(&dev->image_mutex);
@@ -1775,34 +3929,209 @@ static int vidioc_querybuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
 		*buf = dev->timeout_buffer.buffer;
 		buf->index = index;
-	} else
-		*buf = dev->buffers[index].buffer;
+	} else {
+		*buf = opener_buffer(ring_dev(dev), opener, index)->buffer;
+		buf->index = index;
+		if (opener->conv)
+			conversion_buffer(opener->conv, buf);
+	}
+
+	buf->type = type;
+
+	if (!(buf->flags & (V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_QUEUED))) {
+		/* v4l2-compliance requires these to be zero */
+		buf->sequence = 0;
+		buf->timestamp.tv_sec = buf->timestamp.tv_usec = 0;
+	} else if (V4L2_TYPE_IS_CAPTURE(type)) {
+		/* guess flags based on sequence values */
+		if (buf->sequence >= opener->read_position) {
+			set_done(buf->flags);
+		} else if (buf->flags & V4L2_BUF_FLAG_DONE) {
+			set_queued(buf->flags);
+		}
+	}
+	dprintkrw(dev, "QUERYBUF(%s, index=%u) -> " BUFFER_DEBUG_FMT_STR,
+		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index,
+		  BUFFER_DEBUG_FMT_ARGS(buf));
+	return 0;
+}
+
+/* frame-rate decimation (see vidioc_s_parm): the frames written (or repeated)
+ * before this time are of no interest to the opener; 0 if it wants them all.
+ * (the writer is allowed half a frame of jitter)
+ * must be called with dev->lock held */
+static u64 opener_due_ns(struct v4l2_loopback_device *dev,
+			 struct v4l2_loopback_opener *opener)
+{
+	const u64 slack = dev->frame_interval_ns / 2;
+
+	if (opener->frame_interval_ns <= dev->frame_interval_ns)
+		return 0;
+	return opener->next_due_ns > slack ? opener->next_due_ns - slack : 0;
+}
+
+/* the opener got a frame written (or repeated) at time 't';
+ * keep the cadence unless the writer has fallen behind it
+ * must be called with dev->lock held */
+static void opener_frame_due(struct v4l2_loopback_device *dev,
+			     struct v4l2_loopback_opener *opener, u64 t)
+{
+	const u64 interval = opener->frame_interval_ns;
+
+	if (interval <= dev->frame_interval_ns)
+		return;
+	if (t > opener->next_due_ns + dev->frame_interval_ns / 2)
+		opener->next_due_ns = t + interval;
+	else
+		opener->next_due_ns += interval;
+}
+
+/* whether there is something for the opener to read, and enough of it to
+ * wake it up (see CID_WAKEUP_FRAMES and CID_WAKEUP_TIMEOUT);
+ * once woken up, a reader may read all pending frames without waiting again.
+ * if there are frames but not yet enough, the wakeup timer is armed.
+ * must be called with dev->lock held */
+static bool reader_ready(struct v4l2_loopback_device *dev,
+			 struct v4l2_loopback_opener *opener)
+{
+	const s64 pending = dev->write_position - opener->read_position;
+	const u64 due = opener_due_ns(dev, opener);
+	u32 frames = READ_ONCE(opener->wakeup_frames);
+	u64 timeout, deadline, now;
+	int bufpos;
+
+	if (dev->timeout_happened)
+		return true;
+	if (due) {
+		/* only the newest frame can be due, nothing to moderate */
+		if (pending <= 0)
+			return dev->reread_count > opener->reread_count &&
+			       ktime_get_ns() >= due;
+		bufpos = v4l2l_mod64(dev->write_position - 1,
+				     dev->used_buffer_count);
+		return dev->buffers[dev->bufpos2index[bufpos]].written_ns >=
+		       due;
+	}
+	if (dev->reread_count > opener->reread_count)
+		return true;
+	if (pending <= 0)
+		return false;
+	if (frames > dev->used_buffer_count)
+		frames = dev->used_buffer_count;
+	if (opener->draining || pending >= frames)
+		goto ready;
+
+	timeout = READ_ONCE(opener->wakeup_timeout_ns);
+	if (!timeout)
+		return false;
+	bufpos = v4l2l_mod64(opener->read_position, dev->used_buffer_count);
+	deadline = dev->buffers[dev->bufpos2index[bufpos]].written_ns + timeout;
+	now = ktime_get_ns();
+	if (now >= deadline)
+		goto ready;
+	if (!timer_pending(&opener->wakeup_timer))
+		mod_timer(&opener->wakeup_timer,
+			  jiffies + nsecs_to_jiffies(deadline - now) + 1);
+	return false;
+ready:
+	opener->draining = true;
+	return true;
+}
+
+static int can_read(struct v4l2_loopback_device *dev,
+		    struct v4l2_loopback_opener *opener)
+{
+	int ret;
+
+	spin_lock_bh(&dev->lock);
+	check_timers(dev);
+	ret = reader_ready(dev, opener);
+	spin_unlock_bh(&dev->lock);
+	return ret;
+}
+
+static void wake_up_openers_locked(struct v4l2_loopback_device *dev,
+				   struct video_device *vdev)
+{
+	struct v4l2_fh *fh;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vdev->fh_lock, flags);
+	list_for_each_entry(fh, &vdev->fh_list, list) {
+		struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+		if (waitqueue_active(&opener->read_event) &&
+		    reader_ready(dev, opener))
+			wake_up_all(&opener->read_event);
+	}
+	spin_unlock_irqrestore(&vdev->fh_lock, flags);
+}
+
+/* wake up the readers (of the device and of its sinks) that are waiting for
+ * (enough) frames;
+ * must be called with dev->lock held */
+static void wake_up_readers_locked(struct v4l2_loopback_device *dev)
+{
+	struct v4l2_loopback_device *sink;
 
-	buf->type = type;
+	wake_up_openers_locked(dev, dev->vdev);
+	list_for_each_entry(sink, &dev->tee_sinks, tee_node)
+		wake_up_openers_locked(dev, sink->vdev);
+}
 
-	if (!(buf->flags & (V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_QUEUED))) {
-		/* v4l2-compliance requires these to be zero */
-		buf->sequence = 0;
-		buf->timestamp.tv_sec = buf->timestamp.tv_usec = 0;
-	} else if (V4L2_TYPE_IS_CAPTURE(type)) {
-		/* guess flags based on sequence values */
-		if (buf->sequence >= opener->read_position) {
-			set_done(buf->flags);
-		} else if (buf->flags & V4L2_BUF_FLAG_DONE) {
-			set_queued(buf->flags);
-		}
-	}
-	dprintkrw("QUERYBUF(%s, index=%u) -> " BUFFER_DEBUG_FMT_STR,
-		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index,
-		  BUFFER_DEBUG_FMT_ARGS(buf));
-	return 0;
+static void wake_up_readers(struct v4l2_loopback_device *dev)
+{
+	spin_lock_bh(&dev->lock);
+	wake_up_readers_locked(dev);
+	spin_unlock_bh(&dev->lock);
+}
+
+#ifdef HAVE_TIMER_SETUP
+static void wakeup_timer_clb(struct timer_list *t)
+{
+	struct v4l2_loopback_opener *opener =
+		container_of(t, struct v4l2_loopback_opener, wakeup_timer);
+#else
+static void wakeup_timer_clb(unsigned long data)
+{
+	struct v4l2_loopback_opener *opener =
+		(struct v4l2_loopback_opener *)data;
+#endif
+	wake_up_all(&opener->read_event);
+}
+
+/* publish the frame that has just been written on the status page;
+ * must be called with dev->lock held */
+static void status_page_update(struct v4l2_loopback_device *dev,
+			       const struct v4l2l_buffer *buf)
+{
+	struct v4l2_loopback_status *status = dev->status;
+	struct v4l2_loopback_status_slot *slot;
+	const s64 pos = dev->write_position - 1;
+	const u32 seq = status->seq;
+
+	WRITE_ONCE(status->seq, seq + 1);
+	smp_wmb();
+
+	slot = &status->slots[v4l2l_mod64(pos, dev->used_buffer_count)];
+	slot->sequence = pos;
+	slot->timestamp_ns = (u64)buf->buffer.timestamp.tv_sec * NSEC_PER_SEC +
+			     (u64)buf->buffer.timestamp.tv_usec * NSEC_PER_USEC;
+	slot->written_ns = buf->written_ns;
+	slot->index = buf->buffer.index;
+	slot->offset = buf->buffer.m.offset;
+	slot->bytesused = buf->buffer.bytesused;
+	status->used_buffer_count = dev->used_buffer_count;
+	status->buffer_size = dev->buffer_size;
+	status->write_position = dev->write_position;
+
+	smp_wmb();
+	WRITE_ONCE(status->seq, seq + 2);
 }
 
 static void buffer_written(struct v4l2_loopback_device *dev,
 			   struct v4l2l_buffer *buf)
 {
-	timer_delete_sync(&dev->sustain_timer);
-	timer_delete_sync(&dev->timeout_timer);
+	cancel_timers(dev);
 
 	spin_lock_bh(&dev->list_lock);
 	list_move_tail(&buf->list_head, &dev->outbufs_list);
@@ -1814,9 +4143,23 @@ static void buffer_written(struct v4l2_loopback_device *dev,
 		buf->buffer.index;
 	++dev->write_position;
 	dev->reread_count = 0;
+	buf->written_ns = ktime_get_ns();
+	buf->generation++;
+	v4l2l_stat_inc(dev, frames_queued);
+	status_page_update(dev, buf);
+	if (dev->meta)
+		WRITE_ONCE(dev->meta[buf->buffer.index].sequence,
+			   dev->write_position - 1);
+	if (dev->damage_pending)
+		buf->damage = dev->pending_damage;
+	else
+		buf->damage.flags = buf->damage.count = 0;
+	dev->damage_pending = false;
 
 	check_timers(dev);
 	spin_unlock_bh(&dev->lock);
+
+	wake_up_all(&dev->progress_event);
 }
 
 /* put buffer to queue
@@ -1832,30 +4175,38 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 
 	if (!is_allocated(opener, type, index))
 		return -EINVAL;
-	bufd = &dev->buffers[index];
+	bufd = opener_buffer(ring_dev(dev), opener, index);
 
 	switch (buf->memory) {
 	case V4L2_MEMORY_MMAP:
 		if (!(bufd->buffer.flags & V4L2_BUF_FLAG_MAPPED))
-			dprintkrw("QBUF() unmapped buffer [index=%u]\n", index);
+			dprintkrw(dev, "QBUF() unmapped buffer [index=%u]\n",
+				  index);
 		break;
 	default:
 		return -EINVAL;
 	}
 
 	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
+		/* (unless it is still being written to) */
+		mutex_lock(&dev->image_mutex);
+		timeout_image_share(dev);
+		mutex_unlock(&dev->image_mutex);
 		set_queued(buf->flags);
 		return 0;
 	}
 
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-		dprintkrw("QBUF(CAPTURE, index=%u) -> " BUFFER_DEBUG_FMT_STR,
+		dprintkrw(dev,
+			  "QBUF(CAPTURE, index=%u) -> " BUFFER_DEBUG_FMT_STR,
 			  index, BUFFER_DEBUG_FMT_ARGS(buf));
 		set_queued(buf->flags);
+		trace_v4l2loopback_qbuf(dev->vdev->num, buf);
 		break;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-		dprintkrw("QBUF(OUTPUT, index=%u) -> " BUFFER_DEBUG_FMT_STR,
+		dprintkrw(dev,
+			  "QBUF(OUTPUT, index=%u) -> " BUFFER_DEBUG_FMT_STR,
 			  index, BUFFER_DEBUG_FMT_ARGS(buf));
 		if (!(bufd->buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_COPY) &&
 		    (buf->timestamp.tv_sec == 0 &&
@@ -1877,6 +4228,7 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 					&dev->vdev->dev,
 #else
 				dprintkrw(
+					dev,
 #endif
 					"warning queued output buffer bytesused too small %u < %u\n",
 					buf->bytesused,
@@ -1884,143 +4236,849 @@ static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
 				bufd->buffer.bytesused = buf->bytesused;
 			}
 		} else {
-			bufd->buffer.bytesused = buf->bytesused;
+			/* e.g. compressed frames */
+			bufd->buffer.bytesused =
+				min(buf->bytesused, bufd->buffer.length);
 		}
 		bufd->buffer.sequence = dev->write_position;
 		set_queued(bufd->buffer.flags);
 		*buf = bufd->buffer;
+		trace_v4l2loopback_qbuf(dev->vdev->num, &bufd->buffer);
 		buffer_written(dev, bufd);
 		set_done(bufd->buffer.flags);
-		wake_up_all(&dev->read_event);
+		wake_up_readers(dev);
+		break;
+	default:
+		return -EINVAL;
+	}
+	buf->type = type;
+	return 0;
+}
+
+/* sequence number of the next frame an opener is going to capture, skipping
+ * the frames that it is no longer interested in (because they have been
+ * overwritten, violate the opener's latency policy or do not match its frame
+ * interval);
+ * the frames that it asked to be skipped (all but the overwritten ones) are
+ * counted in 'decimated': they are not a gap in the stream.
+ * the newest frame is never skipped.
+ * must be called with dev->lock held, and only if there is a new frame */
+static s64 next_read_position(struct v4l2_loopback_device *dev,
+			      struct v4l2_loopback_opener *opener,
+			      u64 *decimated)
+{
+	const s64 newest = dev->write_position - 1;
+	const u32 max_backlog = READ_ONCE(opener->max_backlog);
+	const u64 max_age = READ_ONCE(opener->max_frame_age_ns);
+	const u64 due = opener_due_ns(dev, opener);
+	s64 pos = opener->read_position;
+
+	*decimated = 0;
+	/* the writer has overtaken us */
+	if (dev->write_position > pos + dev->used_buffer_count) {
+		const s64 oldest = dev->write_position - dev->used_buffer_count;
+		int bufpos = v4l2l_mod64(oldest, dev->used_buffer_count);
+		u32 index = dev->bufpos2index[bufpos];
+		/* unless none of the overwritten frames was due yet */
+		if (!due || dev->buffers[index].written_ns >= due)
+			return newest;
+		*decimated = oldest - pos;
+		pos = oldest;
+	}
+	if (max_backlog && dev->write_position - pos > max_backlog) {
+		*decimated += dev->write_position - max_backlog - pos;
+		pos = dev->write_position - max_backlog;
+	}
+	if (max_age) {
+		const u64 now = ktime_get_ns();
+		for (; pos < newest; pos++, (*decimated)++) {
+			int bufpos = v4l2l_mod64(pos, dev->used_buffer_count);
+			u32 index = dev->bufpos2index[bufpos];
+			if (dev->buffers[index].written_ns + max_age >= now)
+				break;
+		}
+	}
+	for (; due && pos < newest; pos++, (*decimated)++) {
+		int bufpos = v4l2l_mod64(pos, dev->used_buffer_count);
+		u32 index = dev->bufpos2index[bufpos];
+		if (dev->buffers[index].written_ns >= due)
+			break;
+	}
+	return pos;
+}
+
+static int get_capture_buffer(struct file *file)
+{
+	struct v4l2_loopback_device *dev =
+		ring_dev(v4l2loopback_getdevice(file));
+	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
+	int pos, timeout_happened;
+	s64 read_position, write_position;
+	u64 skipped = 0, decimated = 0;
+	bool reread, first;
+	u32 index;
+
+	if ((file->f_flags & O_NONBLOCK) &&
+	    ((dev->write_position <= opener->read_position &&
+	      dev->reread_count <= opener->reread_count &&
+	      !dev->timeout_happened) ||
+	     (opener->frame_interval_ns && !can_read(dev, opener))))
+		return -EAGAIN;
+	if (!can_read(dev, opener)) {
+		u64 start = ktime_get_ns();
+		u64 waited;
+		wait_event_interruptible(opener->read_event,
+					 can_read(dev, opener));
+		waited = ktime_get_ns() - start;
+		v4l2l_stat_add(dev, wait_ns, waited);
+		trace_v4l2loopback_wakeup(dev->vdev->num, dev->write_position,
+					  waited);
+	}
+
+	spin_lock_bh(&dev->lock);
+	reread = (dev->write_position == opener->read_position);
+	if (reread) {
+		if (dev->reread_count > opener->reread_count + 2)
+			opener->reread_count = dev->reread_count - 1;
+		++opener->reread_count;
+		pos = v4l2l_mod64(opener->read_position +
+					  dev->used_buffer_count - 1,
+				  dev->used_buffer_count);
+		opener_frame_due(dev, opener, ktime_get_ns());
+	} else {
+		s64 next = next_read_position(dev, opener, &decimated);
+		opener->reread_count = 0;
+		if (next > opener->read_position) {
+			skipped = next - opener->read_position - decimated;
+			v4l2l_stat_add(dev, frames_skipped, skipped);
+			v4l2l_stat_add(dev, frames_decimated, decimated);
+			opener->frames_skipped += skipped;
+			opener->frames_decimated += decimated;
+			opener->read_position = next;
+		}
+		pos = v4l2l_mod64(opener->read_position,
+				  dev->used_buffer_count);
+		opener_frame_due(dev, opener,
+				 dev->buffers[dev->bufpos2index[pos]].written_ns);
+		++opener->read_position;
+		if (opener->read_position >= dev->write_position)
+			opener->draining = false;
+	}
+	timeout_happened = dev->timeout_happened && (dev->timeout_jiffies > 0);
+	dev->timeout_happened = 0;
+	read_position = opener->read_position;
+	write_position = dev->write_position;
+
+	index = dev->bufpos2index[pos];
+	if (opener->timeout_slot) {
+		/* the timeout image has a buffer of its own, which is
+		 * delivered until the writer comes back */
+		if (!reread)
+			opener->timed_out = false;
+		else if (timeout_happened)
+			opener->timed_out = true;
+		if (opener->timed_out) {
+			index = opener->buffer_count - 1;
+			v4l2l_get_timestamp(&dev->timeout_buffer.buffer);
+		}
+		timeout_happened = opener->timed_out;
+	} else if (timeout_happened) {
+		/* openers without a buffer for the timeout image keep getting
+		 * the last frame: the ring is never written to */
+		dprintkrw(dev, "get_capture_buffer() no timeout buffer, "
+			       "repeating the last frame\n");
+		timeout_happened = false;
+	}
+	if (!timeout_happened)
+		v4l2l_latency_record(dev, opener, &dev->buffers[index], reread);
+	spin_unlock_bh(&dev->lock);
+	v4l2l_stat_inc(dev, frames_captured);
+	first = !opener->frames_captured++;
+
+	/* tell the opener that it is falling behind */
+	if (opener->frame_lag_subscribed && !reread) {
+		const u32 lag = write_position - read_position;
+		if (skipped) {
+			opener->frame_gap = true;
+			opener->frame_lag_warned = false;
+			frame_lag_queue_event(opener, skipped, lag,
+					      read_position - 1);
+		} else if (lag + 1 < dev->used_buffer_count) {
+			opener->frame_lag_warned = false;
+		} else if (!opener->frame_lag_warned) {
+			opener->frame_lag_warned = true;
+			frame_lag_queue_event(opener, 0, lag,
+					      read_position - 1);
+		}
+	}
+
+	if (timeout_happened) {
+		opener->damage[index] = V4L2L_DAMAGE_FULL;
+		opener->damage_reset = true;
+	} else if (reread) {
+		opener->damage[index] = V4L2L_DAMAGE_UNCHANGED;
+	} else if (skipped || decimated || first || opener->damage_reset) {
+		opener->damage[index] = V4L2L_DAMAGE_FULL;
+		opener->damage_reset = false;
+	} else {
+		opener->damage[index] = V4L2L_DAMAGE_WRITTEN;
+	}
+	trace_v4l2loopback_capture_buffer(
+		dev->vdev->num, &opener_buffer(dev, opener, index)->buffer,
+		read_position, write_position, reread, timeout_happened);
+	return (int)index;
+}
+
+/* put buffer to dequeue
+ * called on VIDIOC_DQBUF
+ */
+static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
+{
+	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	u32 type = buf->type;
+	int index;
+	struct v4l2l_buffer *bufd;
+	struct v4l2_loopback_meta *meta;
+
+	if (buf->memory != V4L2_MEMORY_MMAP)
+		return -EINVAL;
+	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
+		*buf = dev->timeout_buffer.buffer;
+		buf->type = type;
+		unset_flags(buf->flags);
+		return 0;
+	}
+	if ((opener->buffer_count == 0) ||
+	    !(opener->format_token & token_from_type(type)))
+		return -EINVAL;
+
+	switch (type) {
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+		index = get_capture_buffer(file);
+		if (index < 0)
+			return index;
+		*buf = opener_buffer(ring_dev(dev), opener, index)->buffer;
+		buf->index = index;
+		unset_flags(buf->flags);
+		if (opener->conv) {
+			conversion_frame(ring_dev(dev), opener->conv, index);
+			conversion_buffer(opener->conv, buf);
+		}
+		/* first buffer after frames were dropped */
+		if (opener->frame_gap) {
+			buf->flags |= V4L2_BUF_FLAG_ERROR;
+			opener->frame_gap = false;
+		}
+		break;
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+		spin_lock_bh(&dev->list_lock);
+
+		bufd = list_first_entry_or_null(&dev->outbufs_list,
+						struct v4l2l_buffer, list_head);
+		if (bufd)
+			list_move_tail(&bufd->list_head, &dev->outbufs_list);
+
+		spin_unlock_bh(&dev->list_lock);
+		if (!bufd)
+			return -EFAULT;
+		/* the producer is going to refill it */
+		meta = READ_ONCE(dev->meta);
+		if (meta)
+			WRITE_ONCE(meta[bufd->buffer.index].sequence,
+				   V4L2L_META_INVALID);
+		unset_flags(bufd->buffer.flags);
+		*buf = bufd->buffer;
 		break;
 	default:
 		return -EINVAL;
 	}
+
 	buf->type = type;
+	trace_v4l2loopback_dqbuf(dev->vdev->num, buf);
+	dprintkrw(dev, "DQBUF(%s, index=%u) -> " BUFFER_DEBUG_FMT_STR,
+		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index,
+		  BUFFER_DEBUG_FMT_ARGS(buf));
+	return 0;
+}
+
+/* ------------- TILED OUTPUT ------------------- */
+
+/* copy a tile of one frame to another */
+static void tile_copy(struct v4l2_loopback_device *dev,
+		      const struct v4l2l_buffer *from, struct v4l2l_buffer *to,
+		      const struct v4l2_rect *r)
+{
+	const struct v4l2_pix_format *pix = &dev->pix_format;
+	const size_t bpp = format_by_fourcc(pix->pixelformat)->depth >> 3;
+	size_t offset;
+	u32 y;
+
+	for (y = r->top; y < r->top + r->height; y++) {
+		offset = (size_t)y * pix->bytesperline + r->left * bpp;
+		memcpy(dev->image + to->buffer.m.offset + offset,
+		       dev->image + from->buffer.m.offset + offset,
+		       r->width * bpp);
+	}
+}
+
+/* publish the frame the tile writers have been assembling; the tiles that
+ * were not written (in time) are those of the previous frame
+ * must be called with image_mutex held */
+static void tiles_publish(struct v4l2_loopback_device *dev)
+{
+	struct v4l2_loopback_opener *opener;
+	struct v4l2l_buffer *bufd, *prev = NULL;
+	struct v4l2_buffer *b;
+
+	if (!dev->tiles_committed || !dev->used_buffer_count)
+		return;
+	bufd = &dev->buffers[v4l2l_mod64(dev->write_position,
+					 dev->used_buffer_count)];
+	if (dev->write_position > 0)
+		prev = &dev->buffers[dev->bufpos2index[v4l2l_mod64(
+			dev->write_position - 1, dev->used_buffer_count)]];
+	list_for_each_entry(opener, &dev->tiles, tile_node) {
+		if (!opener->tile_committed && prev && prev != bufd)
+			tile_copy(dev, prev, bufd, &opener->tile);
+		opener->tile_committed = false;
+	}
+	dev->tiles_committed = 0;
+	/* (the next frame gets a deadline of its own) */
+	spin_lock_bh(&dev->lock);
+	disarm_timer(dev, V4L2L_TIMER_TILES);
+	spin_unlock_bh(&dev->lock);
+
+	b = &bufd->buffer;
+	b->bytesused = dev->pix_format.sizeimage;
+	v4l2l_get_timestamp(b);
+	b->sequence = dev->write_position;
+	set_queued(b->flags);
+	trace_v4l2loopback_write(dev->vdev->num, b);
+	buffer_written(dev, bufd);
+	set_done(b->flags);
+	wake_up_readers(dev);
+}
+
+/* the deadline of the frame being assembled has passed */
+static void tiles_work_fn(struct work_struct *work)
+{
+	struct v4l2_loopback_device *dev =
+		container_of(work, struct v4l2_loopback_device, tiles_work);
+
+	mutex_lock(&dev->image_mutex);
+	/* (unless the frame has been published in the meantime; the deadline
+	 * might be that of the next frame already) */
+	if (dev->tiles_committed) {
+		if (time_after_eq(jiffies, dev->tiles_deadline)) {
+			tiles_publish(dev);
+		} else {
+			spin_lock_bh(&dev->lock);
+			arm_timer(dev, V4L2L_TIMER_TILES, dev->tiles_deadline);
+			spin_unlock_bh(&dev->lock);
+		}
+	}
+	mutex_unlock(&dev->image_mutex);
+}
+
+/* an opener stops writing its tile; must be called with image_mutex held */
+static void tile_remove(struct v4l2_loopback_device *dev,
+			struct v4l2_loopback_opener *opener)
+{
+	if (list_empty(&opener->tile_node))
+		return;
+	list_del_init(&opener->tile_node);
+	dev->tile_count--;
+	if (opener->tile_committed)
+		dev->tiles_committed--;
+	opener->tile_committed = false;
+	memset(&opener->tile, 0, sizeof(opener->tile));
+	/* the frame might be complete now */
+	if (dev->tiles_committed && dev->tiles_committed >= dev->tile_count)
+		tiles_publish(dev);
+	if (dev->tile_count)
+		return;
+	/* the last one gives the OUTPUT tokens back to the device */
+	dev->format_tokens |= dev->tiles_format_token;
+	dev->stream_tokens |= dev->tiles_stream_token;
+	dev->tiles_format_token = dev->tiles_stream_token = 0;
+	if (has_no_owners(dev))
+		dev->used_buffer_count = 0;
+}
+
+/* the first tile writer takes the OUTPUT tokens for the group (so there must
+ * not be an ordinary writer); one that has set the format hands its own
+ * format token over; must be called with image_mutex held */
+static int tiles_acquire_tokens(struct v4l2_loopback_device *dev,
+				struct v4l2_loopback_opener *opener)
+{
+	u32 format_tokens;
+
+	/* a writer that has gone hands over to us */
+	unpark_writer(dev);
+	format_tokens = dev->format_tokens | opener->format_token;
+	if (!has_output_token(format_tokens) ||
+	    !has_output_token(dev->stream_tokens))
+		return -EBUSY;
+	opener->format_token &= ~V4L2L_TOKEN_OUTPUT;
+	dev->format_tokens &= ~V4L2L_TOKEN_OUTPUT;
+	dev->stream_tokens &= ~V4L2L_TOKEN_OUTPUT;
+	dev->tiles_format_token = V4L2L_TOKEN_OUTPUT;
+	dev->tiles_stream_token = V4L2L_TOKEN_OUTPUT;
 	return 0;
 }
 
-static int can_read(struct v4l2_loopback_device *dev,
-		    struct v4l2_loopback_opener *opener)
+/* in tiled output mode (see CID_TILED_OUTPUT), several OUTPUT openers compose
+ * the frames: each of them write()s the lines of its own tile (a rectangle
+ * of the frame), which go straight to the frame being assembled in the ring;
+ * that frame is published once every tile has been written, or one frame
+ * interval after the first one was (with the tiles that are missing taken
+ * from the previous frame)
+ * the format must be set (by an ordinary writer, e.g. the first one) before
+ * tiles are; while there are tiles, they hold the OUTPUT tokens, so there
+ * cannot be an ordinary writer; an empty rectangle gives up the tile
+ * called on VIDIOC_S_SELECTION (OUTPUT, COMPOSE) */
+static int set_tile(struct v4l2_loopback_device *dev,
+		    struct v4l2_loopback_opener *opener, struct v4l2_rect *rect)
+{
+	struct v4l2_rect r;
+	u32 align;
+	int result;
+
+	if (!dev->tiled_output || dev->tee_source ||
+	    has_capture_token(opener->format_token))
+		return -EINVAL;
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+
+	if (!rect->width || !rect->height) {
+		tile_remove(dev, opener);
+		memset(rect, 0, sizeof(*rect));
+		goto exit_set_tile_unlock;
+	}
+	/* only packed formats can be tiled */
+	align = crop_alignment(&dev->pix_format);
+	if (!align || dev->pix_format.width < align ||
+	    !dev->pix_format.height) {
+		result = -EINVAL;
+		goto exit_set_tile_unlock;
+	}
+	if (!dev->tile_count) {
+		result = tiles_acquire_tokens(dev, opener);
+		if (result < 0)
+			goto exit_set_tile_unlock;
+	}
+	selection_adjust(&dev->pix_format, align, rect, &r);
+	dprintkdev(dev, "S_SELECTION(tile=%ux%u@%d,%d)\n", r.width, r.height,
+		   r.left, r.top);
+	opener->tile = *rect = r;
+	if (list_empty(&opener->tile_node)) {
+		list_add_tail(&opener->tile_node, &dev->tiles);
+		dev->tile_count++;
+	}
+exit_set_tile_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
+/* write() of a tile writer: the lines of its tile */
+static ssize_t tile_write(struct v4l2_loopback_device *dev,
+			  struct v4l2_loopback_opener *opener,
+			  const char __user *buf, size_t count)
+{
+	const struct v4l2_pix_format *pix = &dev->pix_format;
+	const struct v4l2_rect *r = &opener->tile;
+	size_t bpp, line, copied = 0, offset, n;
+	struct v4l2l_buffer *bufd;
+	ssize_t result;
+	u32 y;
+
+	/* the ring is shared by the tile writers */
+	result = ring_reqbufs(dev, dev->buffer_count);
+	if (result < 0)
+		return result;
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+	if (list_empty(&opener->tile_node) || !dev->image ||
+	    r->left + r->width > pix->width ||
+	    r->top + r->height > pix->height) {
+		result = -EINVAL;
+		goto exit_tile_write_unlock;
+	}
+	/* writing the same tile twice: the others are late */
+	if (opener->tile_committed)
+		tiles_publish(dev);
+
+	bufd = &dev->buffers[v4l2l_mod64(dev->write_position,
+					 dev->used_buffer_count)];
+	bpp = format_by_fourcc(pix->pixelformat)->depth >> 3;
+	line = r->width * bpp;
+	for (y = r->top; y < r->top + r->height && copied < count; y++) {
+		offset = (size_t)y * pix->bytesperline + r->left * bpp;
+		n = min(line, count - copied);
+		if (copy_from_user(dev->image + bufd->buffer.m.offset + offset,
+				   buf + copied, n)) {
+			printk(KERN_ERR "v4l2-loopback write() failed "
+					"copy_from_user()\n");
+			result = -EFAULT;
+			goto exit_tile_write_unlock;
+		}
+		copied += n;
+	}
+	v4l2l_stat_add(dev, bytes_written, copied);
+
+	opener->tile_committed = true;
+	if (!dev->tiles_committed++) {
+		/* the others have a frame interval to catch up */
+		dev->tiles_deadline = jiffies + max(1UL, dev->frame_jiffies);
+		spin_lock_bh(&dev->lock);
+		arm_timer(dev, V4L2L_TIMER_TILES, dev->tiles_deadline);
+		spin_unlock_bh(&dev->lock);
+	}
+	if (dev->tiles_committed >= dev->tile_count)
+		tiles_publish(dev);
+	result = copied;
+exit_tile_write_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
+/* ------------- SYNTHETIC SOURCE ------------------- */
+
+/* how far the bars move from one frame to the next (in pixels) */
+#define V4L2L_SYNTH_BARS_STEP 8
+
+/* generate the frame at the write position, and publish it
+ * must be called with image_mutex held */
+static void synth_frame(struct v4l2_loopback_device *dev)
+{
+	const struct v4l2_pix_format *pix = &dev->pix_format;
+	struct v4l2l_buffer *bufd = &dev->buffers[v4l2l_mod64(
+		dev->write_position, dev->used_buffer_count)];
+	struct v4l2_buffer *b = &bufd->buffer;
+	const u32 size = min(pix->sizeimage, dev->buffer_size);
+	u8 *data = dev->image + b->m.offset;
+	struct v4l2_loopback_stamp stamp;
+	u32 level;
+
+	switch (dev->synthetic_source) {
+	case V4L2L_SYNTH_BARS:
+		v4l2l_fill_frame(data, size, pix, V4L2L_TIMEOUT_PATTERN_BARS, 0,
+				 v4l2l_mod64(dev->write_position *
+						     V4L2L_SYNTH_BARS_STEP,
+					     max(pix->width, 1U)));
+		break;
+	case V4L2L_SYNTH_COUNTER:
+		level = v4l2l_mod64(dev->write_position, 256);
+		v4l2l_fill_frame(data, size, pix, V4L2L_TIMEOUT_PATTERN_COLOUR,
+				 level * 0x010101, 0);
+		break;
+	}
+	stamp.timestamp_ns = ktime_get_ns();
+	stamp.sequence = dev->write_position;
+	if (size >= sizeof(stamp))
+		memcpy(data, &stamp, sizeof(stamp));
+	v4l2l_stat_add(dev, bytes_written, size);
+
+	b->bytesused = size;
+	v4l2l_get_timestamp(b);
+	b->sequence = dev->write_position;
+	set_queued(b->flags);
+	trace_v4l2loopback_write(dev->vdev->num, b);
+	buffer_written(dev, bufd);
+	set_done(b->flags);
+	wake_up_readers(dev);
+}
+
+/* generate the frames that are due, and arm the deadline of the next one;
+ * when we are late, at most a ring's worth of frames is caught up with */
+static void synth_work_fn(struct work_struct *work)
+{
+	struct v4l2_loopback_device *dev =
+		container_of(work, struct v4l2_loopback_device, synth_work);
+	const u64 now = ktime_get_ns();
+	u32 n = 0;
+
+	mutex_lock(&dev->image_mutex);
+	if (!dev->synthetic_source || !dev->image || !dev->used_buffer_count)
+		goto exit_synth_work_unlock;
+	while (dev->synth_next_ns <= now && n++ < dev->used_buffer_count) {
+		synth_frame(dev);
+		dev->synth_next_ns += dev->frame_interval_ns;
+	}
+	/* (the frames we are too late for are skipped) */
+	if (dev->synth_next_ns <= now)
+		dev->synth_next_ns = now + dev->frame_interval_ns;
+	spin_lock_bh(&dev->lock);
+	arm_timer(dev, V4L2L_TIMER_SYNTH,
+		  jiffies + max(1UL, nsecs_to_jiffies(dev->synth_next_ns - now)));
+	spin_unlock_bh(&dev->lock);
+exit_synth_work_unlock:
+	mutex_unlock(&dev->image_mutex);
+}
+
+/* the synthetic source (see CID_SYNTHETIC_SOURCE) takes the place of a
+ * writer: it holds the OUTPUT tokens (so there must not be a writer), and
+ * writes to the ring at the frame rate of the device, in the current format
+ * called when the control is set; a running source just changes its pattern */
+static int synth_start(struct v4l2_loopback_device *dev, int mode)
+{
+	int result;
+
+	if (dev->tee_source)
+		return -EINVAL;
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+	if (dev->synthetic_source) {
+		dev->synthetic_source = mode;
+		goto exit_synth_start_unlock;
+	}
+	/* a writer that has gone hands over to us */
+	unpark_writer(dev);
+	if (!(dev->format_tokens & V4L2L_TOKEN_OUTPUT) ||
+	    !(dev->stream_tokens & V4L2L_TOKEN_OUTPUT) || dev->tile_count) {
+		result = -EBUSY;
+		goto exit_synth_start_unlock;
+	}
+	/* (the ring is allocated if need be, as for tile writers) */
+	result = ring_reqbufs_locked(dev, dev->buffer_count);
+	if (result < 0)
+		goto exit_synth_start_unlock;
+	result = 0;
+	dev->format_tokens &= ~V4L2L_TOKEN_OUTPUT;
+	dev->stream_tokens &= ~V4L2L_TOKEN_OUTPUT;
+	dev->synth_format_token = V4L2L_TOKEN_OUTPUT;
+	dev->synth_stream_token = V4L2L_TOKEN_OUTPUT;
+	dev->synthetic_source = mode;
+	dev->synth_next_ns = ktime_get_ns();
+	dprintkdev(dev, "synthetic source started (%s)\n",
+		   v4l2loopback_synthetic_sources[mode]);
+	schedule_work(&dev->synth_work);
+exit_synth_start_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
+/* stop the synthetic source (if it is running), and give the OUTPUT tokens
+ * back to the device */
+static void synth_stop(struct v4l2_loopback_device *dev)
 {
-	int ret;
+	int mode;
 
-	spin_lock_bh(&dev->lock);
-	check_timers(dev);
-	ret = dev->write_position > opener->read_position ||
-	      dev->reread_count > opener->reread_count || dev->timeout_happened;
-	spin_unlock_bh(&dev->lock);
-	return ret;
+	mutex_lock(&dev->image_mutex);
+	mode = dev->synthetic_source;
+	dev->synthetic_source = V4L2L_SYNTH_OFF;
+	mutex_unlock(&dev->image_mutex);
+	if (!mode)
+		return;
+	/* (it does not re-arm its deadline once it has been stopped) */
+	cancel_work_sync(&dev->synth_work);
+
+	mutex_lock(&dev->image_mutex);
+	dev->format_tokens |= dev->synth_format_token;
+	dev->stream_tokens |= dev->synth_stream_token;
+	dev->synth_format_token = dev->synth_stream_token = 0;
+	if (has_no_owners(dev))
+		dev->used_buffer_count = 0;
+	mutex_unlock(&dev->image_mutex);
+	dprintkdev(dev, "synthetic source stopped\n");
 }
 
-static int get_capture_buffer(struct file *file)
+/* ------------- SUB-FRAME PROGRESS ------------------- */
+
+/* publish how much of the OUTPUT buffer being filled is complete
+ * called on VIDIOC_V4L2LOOPBACK_S_PROGRESS
+ */
+static long vidioc_s_progress(struct file *file, void *fh,
+			      struct v4l2_loopback_progress *progress)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
-	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
-	int pos, timeout_happened;
-	u32 index;
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	u32 index = progress->index;
 
-	if ((file->f_flags & O_NONBLOCK) &&
-	    (dev->write_position <= opener->read_position &&
-	     dev->reread_count <= opener->reread_count &&
-	     !dev->timeout_happened))
-		return -EAGAIN;
-	wait_event_interruptible(dev->read_event, can_read(dev, opener));
+	if (opener->io_method != V4L2L_IO_MMAP ||
+	    !(opener->stream_token & V4L2L_TOKEN_OUTPUT))
+		return -EBUSY;
+	if (!is_allocated(opener, V4L2_BUF_TYPE_VIDEO_OUTPUT, index))
+		return -EINVAL;
 
 	spin_lock_bh(&dev->lock);
-	if (dev->write_position == opener->read_position) {
-		if (dev->reread_count > opener->reread_count + 2)
-			opener->reread_count = dev->reread_count - 1;
-		++opener->reread_count;
-		pos = v4l2l_mod64(opener->read_position +
-					  dev->used_buffer_count - 1,
-				  dev->used_buffer_count);
+	dev->progress_position = dev->write_position;
+	dev->progress_index = index;
+	dev->progress_bytes = min(progress->bytesused, dev->buffer_size);
+	progress->sequence = dev->progress_position;
+	progress->bytesused = dev->progress_bytes;
+	spin_unlock_bh(&dev->lock);
+	progress->offset = dev->buffers[index].buffer.m.offset;
+	progress->flags = 0;
+
+	wake_up_all(&dev->progress_event);
+	return 0;
+}
+
+/* fills in the progress of frame 'sequence' if (at least) 'bytesused' bytes
+ * of it are complete;
+ * returns 1 if so, 0 if the frame is still to come (or incomplete), and
+ * -EPIPE if it is gone already */
+static int get_progress(struct v4l2_loopback_device *dev,
+			struct v4l2_loopback_progress *progress)
+{
+	s64 pos = (s64)progress->sequence;
+	struct v4l2l_buffer *bufd;
+	int ret = 0;
+
+	spin_lock_bh(&dev->lock);
+	if (pos < dev->write_position) {
+		ret = -EPIPE;
+		if (!dev->used_buffer_count ||
+		    pos < dev->write_position - dev->used_buffer_count)
+			goto unlock;
+		bufd = &dev->buffers[dev->bufpos2index[v4l2l_mod64(
+			pos, dev->used_buffer_count)]];
+		progress->bytesused = bufd->buffer.bytesused;
+		progress->flags = V4L2LOOPBACK_PROGRESS_DONE;
+	} else if (pos == dev->progress_position &&
+		   dev->progress_bytes >= progress->bytesused) {
+		bufd = &dev->buffers[dev->progress_index];
+		progress->bytesused = dev->progress_bytes;
+		progress->flags = 0;
 	} else {
-		opener->reread_count = 0;
-		if (dev->write_position >
-		    opener->read_position + dev->used_buffer_count)
-			opener->read_position = dev->write_position - 1;
-		pos = v4l2l_mod64(opener->read_position,
-				  dev->used_buffer_count);
-		++opener->read_position;
+		goto unlock;
 	}
-	timeout_happened = dev->timeout_happened && (dev->timeout_jiffies > 0);
-	dev->timeout_happened = 0;
+	progress->index = bufd->buffer.index;
+	progress->offset = bufd->buffer.m.offset;
+	ret = 1;
+unlock:
 	spin_unlock_bh(&dev->lock);
+	return ret;
+}
 
-	index = dev->bufpos2index[pos];
-	if (timeout_happened) {
-		if (index >= dev->used_buffer_count) {
-			dprintkrw("get_capture_buffer() read position is at "
-				  "an unallocated buffer [index=%u]\n",
-				  index);
-			return -EFAULT;
-		}
-		/* although allocated on-demand, timeout_image is freed only
-		 * in free_buffers(), so we don't need to worry about it being
-		 * deallocated suddenly */
-		memcpy(dev->image + dev->buffers[index].buffer.m.offset,
-		       dev->timeout_image, dev->buffer_size);
-	}
-	return (int)index;
+/* wait for (part of) a frame
+ * called on VIDIOC_V4L2LOOPBACK_WAIT_PROGRESS
+ */
+static long vidioc_wait_progress(struct file *file, void *fh,
+				 struct v4l2_loopback_progress *progress)
+{
+	struct v4l2_loopback_device *dev =
+		ring_dev(v4l2loopback_getdevice(file));
+	long ret;
+	int err = 0;
+
+	ret = wait_event_interruptible_timeout(
+		dev->progress_event, (err = get_progress(dev, progress)) != 0,
+		msecs_to_jiffies(progress->timeout_ms));
+	if (ret < 0)
+		return ret;
+	if (err < 0)
+		return err;
+	if (!ret)
+		return -EAGAIN;
+	return 0;
 }
 
-/* put buffer to dequeue
- * called on VIDIOC_DQBUF
+/* ------------- DAMAGE ------------------- */
+
+/* set the damage of the next frame
+ * called on VIDIOC_V4L2LOOPBACK_S_DAMAGE
  */
-static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buf)
+static long vidioc_s_damage(struct file *file, void *fh,
+			    struct v4l2_loopback_damage *damage)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
-	u32 type = buf->type;
-	int index;
-	struct v4l2l_buffer *bufd;
+	const s64 width = dev->pix_format.width;
+	const s64 height = dev->pix_format.height;
+	struct v4l2l_damage pending;
+	u32 i;
 
-	if (buf->memory != V4L2_MEMORY_MMAP)
+	if (!has_output_token(opener->format_token))
+		return -EBUSY;
+	if (damage->count > V4L2LOOPBACK_DAMAGE_RECTS)
 		return -EINVAL;
-	if (opener->format_token & V4L2L_TOKEN_TIMEOUT) {
-		*buf = dev->timeout_buffer.buffer;
-		buf->type = type;
-		unset_flags(buf->flags);
-		return 0;
+
+	pending.flags = damage->flags & V4L2LOOPBACK_DAMAGE_UNCHANGED;
+	pending.count = damage->count;
+	for (i = 0; i < damage->count; i++) {
+		const struct v4l2_rect *r = &damage->rects[i];
+		s64 left = clamp_t(s64, r->left, 0, width);
+		s64 top = clamp_t(s64, r->top, 0, height);
+		s64 right = clamp_t(s64, (s64)r->left + r->width, left, width);
+		s64 bottom = clamp_t(s64, (s64)r->top + r->height, top, height);
+
+		pending.rects[i].left = left;
+		pending.rects[i].top = top;
+		pending.rects[i].width = right - left;
+		pending.rects[i].height = bottom - top;
 	}
-	if ((opener->buffer_count == 0) ||
-	    !(opener->format_token & token_from_type(type)))
-		return -EINVAL;
 
-	switch (type) {
-	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-		index = get_capture_buffer(file);
-		if (index < 0)
-			return index;
-		*buf = dev->buffers[index].buffer;
-		unset_flags(buf->flags);
-		break;
-	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-		spin_lock_bh(&dev->list_lock);
+	spin_lock_bh(&dev->lock);
+	dev->pending_damage = pending;
+	dev->damage_pending = true;
+	spin_unlock_bh(&dev->lock);
+	return 0;
+}
 
-		bufd = list_first_entry_or_null(&dev->outbufs_list,
-						struct v4l2l_buffer, list_head);
-		if (bufd)
-			list_move_tail(&bufd->list_head, &dev->outbufs_list);
+/* get the damage of a dequeued frame
+ * called on VIDIOC_V4L2LOOPBACK_G_DAMAGE
+ */
+static long vidioc_g_damage(struct file *file, void *fh,
+			    struct v4l2_loopback_damage *damage)
+{
+	struct v4l2_loopback_device *dev =
+		ring_dev(v4l2loopback_getdevice(file));
+	struct v4l2_loopback_opener *opener = fh_to_opener(fh);
+	const struct v4l2l_buffer *bufd;
+	u32 index = damage->index;
 
-		spin_unlock_bh(&dev->list_lock);
-		if (!bufd)
-			return -EFAULT;
-		unset_flags(bufd->buffer.flags);
-		*buf = bufd->buffer;
-		break;
-	default:
+	if (!is_allocated(opener, V4L2_BUF_TYPE_VIDEO_CAPTURE, index))
 		return -EINVAL;
-	}
+	bufd = opener_buffer(dev, opener, index);
 
-	buf->type = type;
-	dprintkrw("DQBUF(%s, index=%u) -> " BUFFER_DEBUG_FMT_STR,
-		  V4L2_TYPE_IS_CAPTURE(type) ? "CAPTURE" : "OUTPUT", index,
-		  BUFFER_DEBUG_FMT_ARGS(buf));
+	memset(damage, 0, sizeof(*damage));
+	damage->index = index;
+	spin_lock_bh(&dev->lock);
+	damage->sequence = bufd->buffer.sequence;
+	switch (opener->damage[index]) {
+	case V4L2L_DAMAGE_WRITTEN:
+		damage->flags = bufd->damage.flags;
+		damage->count = bufd->damage.count;
+		memcpy(damage->rects, bufd->damage.rects,
+		       damage->count * sizeof(damage->rects[0]));
+		break;
+	case V4L2L_DAMAGE_UNCHANGED:
+		damage->flags = V4L2LOOPBACK_DAMAGE_UNCHANGED;
+		break;
+	}
+	spin_unlock_bh(&dev->lock);
 	return 0;
 }
 
+/* private ioctls */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+static long vidioc_default(struct file *file, void *fh, bool valid_prio,
+			   unsigned int cmd, void *arg)
+#else
+static long vidioc_default(struct file *file, void *fh, bool valid_prio,
+			   int cmd, void *arg)
+#endif
+{
+	switch (cmd) {
+	case VIDIOC_V4L2LOOPBACK_S_PROGRESS:
+		return vidioc_s_progress(file, fh, arg);
+	case VIDIOC_V4L2LOOPBACK_WAIT_PROGRESS:
+		return vidioc_wait_progress(file, fh, arg);
+	case VIDIOC_V4L2LOOPBACK_S_DAMAGE:
+		return vidioc_s_damage(file, fh, arg);
+	case VIDIOC_V4L2LOOPBACK_G_DAMAGE:
+		return vidioc_g_damage(file, fh, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 /* ------------- STREAMING ------------------- */
 
 /* start streaming
@@ -2041,7 +5099,7 @@ static int vidioc_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
 
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-		if (has_output_token(dev->stream_tokens) && !dev->keep_format)
+		if (!has_writer(dev) && !ring_dev(dev)->keep_format)
 			return -EIO;
 		if (dev->stream_tokens & token) {
 			acquire_token(dev, opener, stream, token);
@@ -2049,6 +5107,7 @@ static int vidioc_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
 		}
 		return 0;
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+		adopt_parked_token(dev, stream, token);
 		if (dev->stream_tokens & token)
 			acquire_token(dev, opener, stream, token);
 		return 0;
@@ -2081,11 +5140,21 @@ static int vidioc_streamoff(struct file *file, void *fh,
 
 	switch (type) {
 	case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-		if (opener->stream_token & token)
-			release_token(dev, opener, stream);
+		if (opener->stream_token & token) {
+			if (dev->writer_handover)
+				/* readers keep streaming until the next
+				 * writer comes along */
+				park_token(dev, opener, stream);
+			else
+				release_token(dev, opener, stream);
+		}
 		/* reset output queue */
 		if (dev->used_buffer_count > 0)
 			prepare_buffer_queue(dev, dev->used_buffer_count);
+		spin_lock_bh(&dev->lock);
+		dev->progress_position = -1;
+		dev->damage_pending = false;
+		spin_unlock_bh(&dev->lock);
 		return 0;
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE:
 		if (opener->stream_token & token) {
@@ -2159,6 +5228,123 @@ const struct v4l2_subscribed_event_ops client_usage_ops = {
 	.merge = client_usage_ops_merge,
 };
 
+/* record the request of a consumer, and pass it on to the producer(s) if it
+ * is a new one; @pix and/or @tpf might be NULL */
+static void format_request_queue_event(struct v4l2_loopback_device *dev,
+				       const struct v4l2_pix_format *pix,
+				       const struct v4l2_fract *tpf, bool set)
+{
+	struct v4l2_event_format_request req;
+	struct v4l2_event ev;
+
+	spin_lock_bh(&dev->lock);
+	req = dev->format_request;
+	if (pix) {
+		req.flags |= V4L2LOOPBACK_FORMAT_REQUEST_FMT;
+		if (set)
+			req.flags |= V4L2LOOPBACK_FORMAT_REQUEST_SET;
+		else
+			req.flags &= ~V4L2LOOPBACK_FORMAT_REQUEST_SET;
+		req.pixelformat = pix->pixelformat;
+		req.width = pix->width;
+		req.height = pix->height;
+		req.field = pix->field;
+	}
+	if (tpf) {
+		req.flags |= V4L2LOOPBACK_FORMAT_REQUEST_PARM;
+		req.timeperframe = *tpf;
+	}
+	if (memcmp(&req, &dev->format_request, sizeof(req))) {
+		dev->format_request = req;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = V4L2_EVENT_PRI_FORMAT_REQUEST;
+		memcpy(&ev.u, &req, sizeof(req));
+		v4l2_event_queue(dev->vdev, &ev);
+	}
+	spin_unlock_bh(&dev->lock);
+}
+
+static int format_request_ops_add(struct v4l2_subscribed_event *sev,
+				  unsigned elems)
+{
+	struct v4l2_loopback_device *dev =
+		container_of(sev->fh->vdev->v4l2_dev,
+			     struct v4l2_loopback_device, v4l2_dev);
+	struct v4l2_event ev;
+
+	if (!(sev->flags & V4L2_EVENT_SUB_FL_SEND_INITIAL))
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_PRI_FORMAT_REQUEST;
+	spin_lock_bh(&dev->lock);
+	memcpy(&ev.u, &dev->format_request, sizeof(dev->format_request));
+	spin_unlock_bh(&dev->lock);
+	if (((struct v4l2_event_format_request *)&ev.u)->flags)
+		v4l2_event_queue_fh(sev->fh, &ev);
+	return 0;
+}
+
+const struct v4l2_subscribed_event_ops format_request_ops = {
+	.add = format_request_ops_add,
+};
+
+static void frame_lag_queue_event(struct v4l2_loopback_opener *opener,
+				  u32 dropped, u32 lag, u32 sequence)
+{
+	struct v4l2_event ev;
+	struct v4l2_event_frame_lag *frame_lag =
+		(struct v4l2_event_frame_lag *)&ev.u;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_PRI_FRAME_LAG;
+	frame_lag->dropped = dropped;
+	frame_lag->lag = lag;
+	frame_lag->sequence = sequence;
+	frame_lag->total_dropped = opener->frames_skipped;
+
+	v4l2_event_queue_fh(&opener->fh, &ev);
+}
+
+static int frame_lag_ops_add(struct v4l2_subscribed_event *sev, unsigned elems)
+{
+	fh_to_opener(sev->fh)->frame_lag_subscribed = true;
+	return 0;
+}
+
+static void frame_lag_ops_del(struct v4l2_subscribed_event *sev)
+{
+	fh_to_opener(sev->fh)->frame_lag_subscribed = false;
+}
+
+/* the queued event is overwritten by a newer one: keep all drops */
+static void frame_lag_ops_replace(struct v4l2_event *old,
+				  const struct v4l2_event *new)
+{
+	struct v4l2_event_frame_lag *old_lag =
+		(struct v4l2_event_frame_lag *)&old->u;
+	const u32 dropped = old_lag->dropped;
+
+	*old_lag = *((struct v4l2_event_frame_lag *)&new->u);
+	old_lag->dropped += dropped;
+}
+
+/* the oldest queued event is dropped: fold its drops into the next one */
+static void frame_lag_ops_merge(const struct v4l2_event *old,
+				struct v4l2_event *new)
+{
+	((struct v4l2_event_frame_lag *)&new->u)->dropped +=
+		((struct v4l2_event_frame_lag *)&old->u)->dropped;
+}
+
+const struct v4l2_subscribed_event_ops frame_lag_ops = {
+	.add = frame_lag_ops_add,
+	.del = frame_lag_ops_del,
+	.replace = frame_lag_ops_replace,
+	.merge = frame_lag_ops_merge,
+};
+
 static int vidioc_subscribe_event(struct v4l2_fh *fh,
 				  const struct v4l2_event_subscription *sub)
 {
@@ -2167,6 +5353,10 @@ static int vidioc_subscribe_event(struct v4l2_fh *fh,
 		return v4l2_ctrl_subscribe_event(fh, sub);
 	case V4L2_EVENT_PRI_CLIENT_USAGE:
 		return v4l2_event_subscribe(fh, sub, 0, &client_usage_ops);
+	case V4L2_EVENT_PRI_FRAME_LAG:
+		return v4l2_event_subscribe(fh, sub, 2, &frame_lag_ops);
+	case V4L2_EVENT_PRI_FORMAT_REQUEST:
+		return v4l2_event_subscribe(fh, sub, 1, &format_request_ops);
 	}
 
 	return -EINVAL;
@@ -2198,16 +5388,176 @@ static struct vm_operations_struct vm_ops = {
 	.close = vm_close,
 };
 
+/* a reader accessing its buffer for the timeout image: insert the page of
+ * the current image (see timeout_slot_unmap) */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+static vm_fault_t timeout_slot_fault(struct vm_area_struct *vma,
+				     struct vm_fault *vmf)
+{
+#else
+static vm_fault_t timeout_slot_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+	unsigned long address = (unsigned long)vmf->virtual_address;
+#else
+	unsigned long address = vmf->address;
+#endif
+	struct v4l2_loopback_device *dev = vma->vm_private_data;
+	unsigned long offset = (vmf->pgoff - vma->vm_pgoff) << PAGE_SHIFT;
+	vm_fault_t ret = VM_FAULT_NOPAGE;
+	int result;
+
+	mutex_lock(&dev->image_mutex);
+	/* shared images must not be written to */
+	if (vma->vm_flags & VM_WRITE && timeout_image_make_private(dev) < 0) {
+		ret = VM_FAULT_SIGBUS;
+		goto exit_fault_unlock;
+	}
+	if (!dev->timeout_image || offset >= dev->timeout_buffer_size) {
+		ret = VM_FAULT_SIGBUS;
+		goto exit_fault_unlock;
+	}
+	result = vm_insert_page(vma, address & PAGE_MASK,
+				vmalloc_to_page(dev->timeout_image + offset));
+	if (result == -ENOMEM)
+		ret = VM_FAULT_OOM;
+	else if (result < 0 && result != -EBUSY)
+		ret = VM_FAULT_SIGBUS;
+exit_fault_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return ret;
+}
+
+static struct vm_operations_struct timeout_slot_vm_ops = {
+	.fault = timeout_slot_fault,
+};
+
+static int status_page_mmap(struct v4l2_loopback_device *dev,
+			    struct vm_area_struct *vma)
+{
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+		dprintkdev(dev,
+			   "mmap() status page must be mapped as a single page\n");
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		dprintkdev(dev, "mmap() status page is read-only\n");
+		return -EPERM;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(dev->status));
+}
+
+static int meta_mmap(struct v4l2_loopback_device *dev,
+		     struct v4l2_loopback_opener *opener,
+		     struct vm_area_struct *vma)
+{
+	const unsigned long size = MAX_BUFFERS * sizeof(*dev->meta);
+	struct v4l2_loopback_meta *meta;
+	int result;
+	u32 i;
+
+	if (vma->vm_end - vma->vm_start > size) {
+		dprintkdev(dev,
+			   "mmap() attempt to map beyond all metadata slots\n");
+		return -EINVAL;
+	}
+	/* only the writer fills in the metadata */
+	if (!has_output_token(opener->format_token)) {
+		if (vma->vm_flags & VM_WRITE) {
+			dprintkdev(dev,
+				   "mmap() metadata is read-only for readers\n");
+			return -EPERM;
+		}
+		vm_flags_clear(vma, VM_MAYWRITE);
+	}
+
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+	if (!dev->meta) {
+		meta = vmalloc_user(size);
+		if (!meta) {
+			result = -ENOMEM;
+			goto exit_unlock;
+		}
+		for (i = 0; i < MAX_BUFFERS; i++)
+			meta[i].sequence = V4L2L_META_INVALID;
+		spin_lock_bh(&dev->lock);
+		dev->meta = meta;
+		spin_unlock_bh(&dev->lock);
+	}
+	result = remap_vmalloc_range(vma, dev->meta, 0);
+exit_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
+/* a reader of a linked device mapping one of its converted frames; called
+ * with the source's image_mutex held */
+static int conv_mmap(struct v4l2_loopback_device *dev,
+		     struct v4l2l_conversion *conv, struct vm_area_struct *vma)
+{
+	unsigned long offset =
+		((unsigned long)vma->vm_pgoff << PAGE_SHIFT) - V4L2L_CONV_OFFSET;
+	unsigned long start = vma->vm_start, size = vma->vm_end - vma->vm_start;
+	u32 index;
+	u8 *addr;
+	int result;
+
+	if (!conv) {
+		dprintkdev(dev, "mmap() there are no converted frames\n");
+		return -EINVAL;
+	}
+	if (size > conv->buffer_size || offset % conv->buffer_size != 0 ||
+	    offset / conv->buffer_size >= conv->buffer_count) {
+		dprintkdev(dev,
+			   "mmap() offset does not match any converted frame\n");
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		dprintkdev(dev, "mmap() converted frames are read-only\n");
+		return -EPERM;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	index = offset / conv->buffer_size;
+	addr = conv->image + offset;
+	while (size > 0) {
+		result = vm_insert_page(vma, start, vmalloc_to_page(addr));
+		if (result < 0)
+			return result;
+		start += PAGE_SIZE;
+		addr += PAGE_SIZE;
+		size -= PAGE_SIZE;
+	}
+
+	/* (keeps the source from re-allocating its buffers) */
+	vma->vm_ops = &vm_ops;
+	vma->vm_private_data = &dev->buffers[index];
+	vm_open(vma);
+	return 0;
+}
+
 static int v4l2_loopback_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	u8 *addr;
 	unsigned long start, size, offset;
-	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	/* readers of a linked device map the source's buffers */
+	struct v4l2_loopback_device *dev =
+		ring_dev(v4l2loopback_getdevice(file));
 	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
 	struct v4l2l_buffer *buffer = NULL;
 	int result = 0;
 	MARK();
 
+	if (vma->vm_pgoff == V4L2LOOPBACK_STATUS_PAGE_OFFSET >> PAGE_SHIFT)
+		return status_page_mmap(dev, vma);
+	if (vma->vm_pgoff == V4L2LOOPBACK_META_OFFSET >> PAGE_SHIFT)
+		return meta_mmap(dev, opener, vma);
+
 	offset = (unsigned long)vma->vm_pgoff << PAGE_SHIFT;
 	start = (unsigned long)vma->vm_start;
 	size = (unsigned long)(vma->vm_end - vma->vm_start); /* always != 0 */
@@ -2218,31 +5568,59 @@ static int v4l2_loopback_mmap(struct file *file, struct vm_area_struct *vma)
 	if (result < 0)
 		return result;
 
+	if (offset >= V4L2L_CONV_OFFSET) {
+		result = conv_mmap(dev, opener->conv, vma);
+		goto exit_mmap_unlock;
+	}
 	if (size > dev->buffer_size) {
-		dprintk("mmap() attempt to map %lubytes when %ubytes are "
-			"allocated to buffers\n",
-			size, dev->buffer_size);
+		dprintkdev(dev,
+			   "mmap() attempt to map %lubytes when %ubytes are "
+			   "allocated to buffers\n", size, dev->buffer_size);
 		result = -EINVAL;
 		goto exit_mmap_unlock;
 	}
 	if (offset % dev->buffer_size != 0) {
-		dprintk("mmap() offset does not match start of any buffer\n");
+		dprintkdev(dev,
+			   "mmap() offset does not match start of any buffer\n");
 		result = -EINVAL;
 		goto exit_mmap_unlock;
 	}
 	switch (opener->format_token) {
 	case V4L2L_TOKEN_TIMEOUT:
 		if (offset != (unsigned long)dev->buffer_size * MAX_BUFFERS) {
-			dprintk("mmap() incorrect offset for timeout image\n");
+			dprintkdev(dev,
+				   "mmap() incorrect offset for timeout image\n");
 			result = -EINVAL;
 			goto exit_mmap_unlock;
 		}
+		result = timeout_image_make_private(dev);
+		if (result < 0)
+			goto exit_mmap_unlock;
 		buffer = &dev->timeout_buffer;
 		addr = dev->timeout_image;
 		break;
 	default:
+		if (opener->timeout_slot &&
+		    offset == dev->timeout_buffer.buffer.m.offset) {
+			/* a reader's buffer for the timeout image: its pages
+			 * are inserted on access, so that the image can be
+			 * replaced while the buffer is mapped */
+			if (!(vma->vm_flags & VM_WRITE))
+				vm_flags_clear(vma, VM_MAYWRITE);
+			vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND);
+			vma->vm_ops = &timeout_slot_vm_ops;
+			vma->vm_private_data = dev;
+			if (list_empty(&opener->timeout_slot_node))
+				list_add_tail(&opener->timeout_slot_node,
+					      &dev->timeout_slot_openers);
+			opener->timeout_slot_mapping = file->f_mapping;
+			opener->timeout_slot_offset = offset;
+			opener->timeout_slot_size = size;
+			goto exit_mmap_unlock;
+		}
 		if (offset >= dev->image_size) {
-			dprintk("mmap() attempt to map beyond all buffers\n");
+			dprintkdev(dev,
+				   "mmap() attempt to map beyond all buffers\n");
 			result = -EINVAL;
 			goto exit_mmap_unlock;
 		}
@@ -2283,7 +5661,7 @@ static unsigned int v4l2_loopback_poll(struct file *file,
 
 	/* call poll_wait in first call, regardless, to ensure that the
 	 * wait-queue is not null */
-	poll_wait(file, &dev->read_event, pts);
+	poll_wait(file, &opener->read_event, pts);
 	poll_wait(file, &opener->fh.wait, pts);
 
 	if (req_events & POLLPRI) {
@@ -2303,7 +5681,7 @@ static unsigned int v4l2_loopback_poll(struct file *file,
 	case V4L2L_TOKEN_CAPTURE:
 		if ((opener->io_method == V4L2L_IO_NONE ||
 		     opener->stream_token != 0) &&
-		    can_read(dev, opener))
+		    can_read(ring_dev(dev), opener))
 			ret_mask |= POLLIN | POLLWRNORM;
 		break;
 	case V4L2L_TOKEN_TIMEOUT:
@@ -2341,6 +5719,7 @@ static int v4l2_loopback_open(struct file *file)
 
 	struct v4l2_loopback_device *dev;
 	struct v4l2_loopback_opener *opener;
+	struct v4l2_ctrl_handler *hdl;
 
 	dev = v4l2loopback_getdevice(file);
 	if (dev->open_count.counter >= dev->max_openers)
@@ -2350,32 +5729,103 @@ static int v4l2_loopback_open(struct file *file)
 	if (opener == NULL)
 		return -ENOMEM;
 
+	/* the source's buffers must stay around while we might read them */
+	mutex_lock(&dev->tee_mutex);
 	atomic_inc(&dev->open_count);
+	opener->tee_source = dev->tee_source;
+	if (opener->tee_source)
+		atomic_inc(&opener->tee_source->open_count);
+	mutex_unlock(&dev->tee_mutex);
 	if (dev->timeout_image_io && dev->format_tokens & V4L2L_TOKEN_TIMEOUT)
 		/* will clear timeout_image_io once buffer set acquired */
 		opener->io_method = V4L2L_IO_TIMEOUT;
+	opener->wakeup_frames = 1;
+	init_waitqueue_head(&opener->read_event);
+	INIT_LIST_HEAD(&opener->tile_node);
+	INIT_LIST_HEAD(&opener->timeout_slot_node);
+#ifdef HAVE_TIMER_SETUP
+	timer_setup(&opener->wakeup_timer, wakeup_timer_clb, 0);
+#else
+	setup_timer(&opener->wakeup_timer, wakeup_timer_clb,
+		    (unsigned long)opener);
+#endif
 
 	v4l2_fh_init(&opener->fh, video_devdata(file));
+
+	/* the per-opener controls, plus the device's controls */
+	hdl = &opener->ctrl_handler;
+	v4l2_ctrl_handler_init(hdl, 4);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_maxbacklog, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_maxframeage, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_wakeupframes, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_wakeuptimeout, NULL);
+	v4l2l_ctrl_add_handler(hdl, &dev->ctrl_handler);
+	if (hdl->error) {
+		int err = hdl->error;
+		v4l2_ctrl_handler_free(hdl);
+		v4l2_fh_exit(&opener->fh);
+		mutex_lock(&dev->tee_mutex);
+		if (opener->tee_source)
+			atomic_dec(&opener->tee_source->open_count);
+		atomic_dec(&dev->open_count);
+		mutex_unlock(&dev->tee_mutex);
+		kfree(opener);
+		return err;
+	}
+	opener->fh.ctrl_handler = hdl;
 	file->private_data = &opener->fh;
 
 	v4l2_fh_add(&opener->fh);
-	dprintk("open() -> dev@%p with image@%p\n", dev,
-		dev ? dev->image : NULL);
+	dprintkdev(dev, "open() -> dev@%p with image@%p\n", dev, dev->image);
 	return 0;
 }
 
+/* the last opener is gone: stop the timers and release the buffers */
+static void put_opener(struct v4l2_loopback_device *dev)
+{
+	if (!atomic_dec_and_test(&dev->open_count))
+		return;
+	cancel_timers(dev);
+	mutex_lock(&dev->image_mutex);
+	/* nobody left to hand over to */
+	unpark_writer(dev);
+	if (dev->synthetic_source)
+		/* it keeps writing (for the next readers) */
+		schedule_work(&dev->synth_work);
+	else if (!dev->keep_format)
+		free_buffers(dev);
+	mutex_unlock(&dev->image_mutex);
+}
+
 static int v4l2_loopback_close(struct file *file)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
 	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
 	int result = 0;
-	dprintk("close() -> dev@%p with image@%p\n", dev,
-		dev ? dev->image : NULL);
+	dprintkdev(dev, "close() -> dev@%p with image@%p\n", dev, dev->image);
+
+	if (!list_empty(&opener->tile_node)) {
+		mutex_lock(&dev->image_mutex);
+		tile_remove(dev, opener);
+		mutex_unlock(&dev->image_mutex);
+	}
+	/* (all of its mappings are gone by now) */
+	if (!list_empty(&opener->timeout_slot_node)) {
+		mutex_lock(&dev->image_mutex);
+		list_del_init(&opener->timeout_slot_node);
+		mutex_unlock(&dev->image_mutex);
+	}
 
 	if (opener->format_token) {
 		struct v4l2_requestbuffers reqbuf = {
 			.count = 0, .memory = V4L2_MEMORY_MMAP, .type = 0
 		};
+		/* the damage was meant for a frame that never came */
+		if (has_output_token(opener->format_token)) {
+			spin_lock_bh(&dev->lock);
+			dev->damage_pending = false;
+			spin_unlock_bh(&dev->lock);
+		}
 		switch (opener->format_token) {
 		case V4L2L_TOKEN_CAPTURE:
 			reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -2389,26 +5839,27 @@ static int v4l2_loopback_close(struct file *file)
 			result = vidioc_reqbufs(file, file->private_data,
 						&reqbuf);
 		if (result < 0)
-			dprintk("failed to free buffers REQBUFS(count=0) "
-				" returned %d\n",
-				result);
+			dprintkdev(dev,
+				   "failed to free buffers REQBUFS(count=0) "
+				   " returned %d\n", result);
 		mutex_lock(&dev->image_mutex);
 		release_token(dev, opener, format);
 		mutex_unlock(&dev->image_mutex);
 	}
 
-	if (atomic_dec_and_test(&dev->open_count)) {
-		timer_delete_sync(&dev->sustain_timer);
-		timer_delete_sync(&dev->timeout_timer);
-		if (!dev->keep_format) {
-			mutex_lock(&dev->image_mutex);
-			free_buffers(dev);
-			mutex_unlock(&dev->image_mutex);
-		}
-	}
+	/* (in case REQBUFS was interrupted) */
+	tee_set_conversion(dev, opener, 0);
+	mutex_lock(&dev->tee_mutex);
+	if (opener->tee_source)
+		put_opener(opener->tee_source);
+	put_opener(dev);
+	mutex_unlock(&dev->tee_mutex);
 
 	v4l2_fh_del(&opener->fh);
 	v4l2_fh_exit(&opener->fh);
+	v4l2_ctrl_handler_free(&opener->ctrl_handler);
+	/* no longer on the fh_list, so nobody is going to re-arm it */
+	timer_delete_sync(&opener->wakeup_timer);
 
 	kfree(opener);
 	return 0;
@@ -2433,7 +5884,8 @@ static int start_fileio(struct file *file, void *fh, enum v4l2_buf_type type)
 		return 0;
 
 	/* otherwise attempt to acquire stream token and assign IO method */
-	if (!(dev->stream_tokens & token) || opener->io_method != V4L2L_IO_NONE)
+	if (!((dev->stream_tokens | dev->parked_stream_token) & token) ||
+	    opener->io_method != V4L2L_IO_NONE)
 		return -EBUSY;
 
 	result = vidioc_reqbufs(file, fh, &reqbuf);
@@ -2447,14 +5899,46 @@ static int start_fileio(struct file *file, void *fh, enum v4l2_buf_type type)
 	return 0;
 }
 
+/* copy the rectangle @r of a frame (of format @pix, of which @size bytes are
+ * valid) line by line; returns the number of bytes copied */
+static ssize_t copy_crop_to_user(char __user *buf, size_t count,
+				 const u8 *frame, size_t size,
+				 const struct v4l2_pix_format *pix,
+				 const struct v4l2_rect *r)
+{
+	const size_t bpp = format_by_fourcc(pix->pixelformat)->depth >> 3;
+	const size_t line = r->width * bpp;
+	size_t copied = 0, offset, n;
+	u32 y;
+
+	for (y = r->top; y < r->top + r->height && copied < count; y++) {
+		offset = (size_t)y * pix->bytesperline + r->left * bpp;
+		n = min(line, count - copied);
+		if (offset + n > size)
+			break;
+		if (copy_to_user(buf + copied, frame + offset, n))
+			return -EFAULT;
+		copied += n;
+	}
+	return copied;
+}
+
 static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
 				  size_t count, loff_t *ppos)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
+	struct v4l2l_timeout_image *timeout = NULL;
+	struct v4l2l_buffer *bufd;
 	struct v4l2_buffer *b;
+	const struct v4l2_pix_format *pix;
+	struct v4l2_rect crop;
+	size_t size;
+	ssize_t copied;
+	u8 *data;
 	int index, result;
 
-	dprintkrw("read() %zu bytes\n", count);
+	dprintkrw(dev, "read() %zu bytes\n", count);
 	result = start_fileio(file, file->private_data,
 			      V4L2_BUF_TYPE_VIDEO_CAPTURE);
 	if (result < 0)
@@ -2463,30 +5947,83 @@ static ssize_t v4l2_loopback_read(struct file *file, char __user *buf,
 	index = get_capture_buffer(file);
 	if (index < 0)
 		return index;
-	b = &dev->buffers[index].buffer;
-	if (count > b->bytesused)
-		count = b->bytesused;
-	if (copy_to_user((void *)buf, (void *)(dev->image + b->m.offset),
-			 count)) {
-		printk(KERN_ERR "v4l2-loopback read() failed copy_to_user()\n");
-		return -EFAULT;
+	dev = ring_dev(dev);
+	bufd = opener_buffer(dev, opener, index);
+	b = &bufd->buffer;
+	if (opener->conv) {
+		data = conversion_frame(dev, opener->conv, index);
+		pix = &opener->conv->pix;
+		size = pix->sizeimage;
+	} else if (bufd == &dev->timeout_buffer) {
+		/* (the image might be replaced while we copy it) */
+		timeout = timeout_image_ref(dev);
+		if (!timeout)
+			return -EIO;
+		data = timeout->data;
+		pix = &dev->pix_format;
+		size = min_t(size_t, b->bytesused, timeout->size);
+	} else {
+		data = dev->image + b->m.offset;
+		pix = &dev->pix_format;
+		size = b->bytesused;
 	}
-	return count;
+	if (opener_crop(opener, pix, &crop)) {
+		/* only the lines (or parts of them) asked for */
+		copied = copy_crop_to_user(buf, count, data, size, pix, &crop);
+		if (copied < 0) {
+			printk(KERN_ERR "v4l2-loopback read() failed "
+					"copy_to_user()\n");
+			goto exit_read_put;
+		}
+		count = copied;
+	} else {
+		if (count > size)
+			count = size;
+		if (copy_to_user((void *)buf, (void *)data, count)) {
+			printk(KERN_ERR
+			       "v4l2-loopback read() failed copy_to_user()\n");
+			copied = -EFAULT;
+			goto exit_read_put;
+		}
+	}
+	v4l2l_stat_add(dev, bytes_read, count);
+	trace_v4l2loopback_read(dev->vdev->num, b);
+	copied = count;
+exit_read_put:
+	timeout_image_put(timeout);
+	return copied;
 }
 
 static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
 				   size_t count, loff_t *ppos)
 {
 	struct v4l2_loopback_device *dev = v4l2loopback_getdevice(file);
+	struct v4l2_loopback_opener *opener = fh_to_opener(file->private_data);
 	struct v4l2_buffer *b;
 	int index, result;
 
-	dprintkrw("write() %zu bytes\n", count);
+	dprintkrw(dev, "write() %zu bytes\n", count);
+	if (!list_empty(&opener->tile_node))
+		return tile_write(dev, opener, buf, count);
 	result = start_fileio(file, file->private_data,
 			      V4L2_BUF_TYPE_VIDEO_OUTPUT);
 	if (result < 0)
 		return result;
 
+	/* a compressed frame might not fit (yet); it must not be truncated
+	 * (raw frames are, as they always have been) */
+	if (count > dev->buffer_size) {
+		result = grow_buffers(dev, count);
+		if (result == -EINTR)
+			return result;
+		if (result < 0 && result != -EINVAL) {
+			printk_ratelimited(KERN_WARNING "v4l2-loopback write() "
+					   "frame of %zu bytes does not fit "
+					   "(%u bytes; see compressed_size)\n",
+					   count, dev->buffer_size);
+			return -ENOSPC;
+		}
+	}
 	if (count > dev->buffer_size)
 		count = dev->buffer_size;
 	index = v4l2l_mod64(dev->write_position, dev->used_buffer_count);
@@ -2499,13 +6036,15 @@ static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
 		return -EFAULT;
 	}
 	b->bytesused = count;
+	v4l2l_stat_add(dev, bytes_written, count);
 
 	v4l2l_get_timestamp(b);
 	b->sequence = dev->write_position;
 	set_queued(b->flags);
+	trace_v4l2loopback_write(dev->vdev->num, b);
 	buffer_written(dev, &dev->buffers[index]);
 	set_done(b->flags);
-	wake_up_all(&dev->read_event);
+	wake_up_readers(dev);
 
 	return count;
 }
@@ -2514,7 +6053,7 @@ static ssize_t v4l2_loopback_write(struct file *file, const char __user *buf,
 /* frees buffers, if allocated */
 static void free_buffers(struct v4l2_loopback_device *dev)
 {
-	dprintk("free_buffers() with image@%p\n", dev->image);
+	dprintkdev(dev, "free_buffers() with image@%p\n", dev->image);
 	if (!dev->image)
 		return;
 	if (!has_no_owners(dev) || any_buffers_mapped(dev))
@@ -2531,8 +6070,8 @@ static void free_buffers(struct v4l2_loopback_device *dev)
 
 static void free_timeout_buffer(struct v4l2_loopback_device *dev)
 {
-	dprintk("free_timeout_buffer() with timeout_image@%p\n",
-		dev->timeout_image);
+	dprintkdev(dev, "free_timeout_buffer() with timeout_image@%p\n",
+		   dev->timeout_image);
 	if (!dev->timeout_image)
 		return;
 
@@ -2543,9 +6082,7 @@ static void free_timeout_buffer(struct v4l2_loopback_device *dev)
 		       "of device #%u freed while still mapped to userspace\n",
 		       dev->vdev->num);
 
-	vfree(dev->timeout_image);
-	dev->timeout_image = NULL;
-	dev->timeout_buffer_size = 0;
+	set_timeout_image(dev, NULL);
 }
 /* allocates buffers if no (other) openers are already using them */
 static int allocate_buffers(struct v4l2_loopback_device *dev,
@@ -2563,17 +6100,18 @@ static int allocate_buffers(struct v4l2_loopback_device *dev,
 	if ((__LONG_MAX__ / buffer_size) < dev->buffer_count)
 		return -ENOSPC;
 
-	dprintk("allocate_buffers() size %lubytes = %ubytes x %ubuffers\n",
-		image_size, buffer_size, dev->buffer_count);
+	dprintkdev(dev,
+		   "allocate_buffers() size %lubytes = %ubytes x %ubuffers\n",
+		   image_size, buffer_size, dev->buffer_count);
 	if (dev->image) {
 		/* check that no buffers are expected in user-space */
 		if (!has_no_owners(dev) || any_buffers_mapped(dev))
 			return -EBUSY;
-		dprintk("allocate_buffers() existing size=%lubytes\n",
-			dev->image_size);
+		dprintkdev(dev, "allocate_buffers() existing size=%lubytes\n",
+			   dev->image_size);
 		/* FIXME: prevent double allocation more intelligently! */
 		if (image_size == dev->image_size) {
-			dprintk("allocate_buffers() keep existing\n");
+			dprintkdev(dev, "allocate_buffers() keep existing\n");
 			return 0;
 		}
 		free_buffers(dev);
@@ -2588,32 +6126,106 @@ static int allocate_buffers(struct v4l2_loopback_device *dev,
 	init_buffers(dev, pix_format->sizeimage, buffer_size);
 	dev->buffer_size = buffer_size;
 	dev->image_size = image_size;
-	dprintk("allocate_buffers() -> vmalloc'd %lubytes\n", dev->image_size);
+	dprintkdev(dev, "allocate_buffers() -> vmalloc'd %lubytes\n",
+		   dev->image_size);
 	return 0;
 }
-static int allocate_timeout_buffer(struct v4l2_loopback_device *dev)
+
+/* compressed frames vary in size: write() grows the buffers (up to the size of
+ * a raw frame) for a frame that does not fit, as long as nobody else is using
+ * them; the frames in the ring are kept */
+static int grow_buffers(struct v4l2_loopback_device *dev, size_t size)
+{
+	const struct v4l2l_format *fmt =
+		format_by_fourcc(dev->pix_format.pixelformat);
+	struct v4l2_pix_format raw;
+	unsigned long image_size;
+	u32 buffer_size, i;
+	u8 *image;
+	int result;
+
+	if (!fmt || !(fmt->flags & FORMAT_FLAGS_COMPRESSED))
+		return -EINVAL;
+	/* (at least double them, so this does not happen for every frame) */
+	pix_format_set_size(&raw, fmt, dev->pix_format.width,
+			    dev->pix_format.height);
+	size = max_t(size_t, size, 2 * (size_t)dev->buffer_size);
+	buffer_size = PAGE_ALIGN(min_t(size_t, size, raw.sizeimage));
+	if (buffer_size <= dev->buffer_size)
+		return -ENOSPC;
+
+	result = mutex_lock_killable(&dev->image_mutex);
+	if (result < 0)
+		return result;
+	/* readers (and mappings) expect the buffers to stay where they are;
+	 * and the timeout image has the size of a buffer */
+	if ((~dev->format_tokens &
+	     (V4L2L_TOKEN_CAPTURE | V4L2L_TOKEN_TIMEOUT)) ||
+	    has_tee_readers(dev) || any_buffers_mapped(dev) ||
+	    dev->timeout_image) {
+		result = -EBUSY;
+		goto exit_grow_unlock;
+	}
+	image_size = (unsigned long)buffer_size * dev->buffer_count;
+	image = vmalloc(image_size);
+	if (!image) {
+		result = -ENOMEM;
+		goto exit_grow_unlock;
+	}
+
+	spin_lock_bh(&dev->lock);
+	for (i = 0; i < dev->buffer_count; i++) {
+		struct v4l2_buffer *b = &dev->buffers[i].buffer;
+		memcpy(image + (unsigned long)i * buffer_size,
+		       dev->image + b->m.offset,
+		       min(b->bytesused, dev->buffer_size));
+		b->length = buffer_size;
+		b->m.offset = i * buffer_size;
+	}
+	dev->timeout_buffer.buffer.length = buffer_size;
+	dev->timeout_buffer.buffer.m.offset = MAX_BUFFERS * buffer_size;
+	swap(dev->image, image);
+	dev->image_size = image_size;
+	dev->buffer_size = buffer_size;
+	dev->pix_format.sizeimage = buffer_size;
+	spin_unlock_bh(&dev->lock);
+	vfree(image);
+	dprintkdev(dev, "grow_buffers() -> %ubytes x %ubuffers\n", buffer_size,
+		   dev->buffer_count);
+exit_grow_unlock:
+	mutex_unlock(&dev->image_mutex);
+	return result;
+}
+
+static int allocate_timeout_buffer(struct v4l2_loopback_device *dev,
+				   const struct v4l2_pix_format *pix_format)
 {
+	struct v4l2l_timeout_image *img;
 	/* device's `buffer_size` and `buffers` must be initialised in
 	 * allocate_buffers() */
 
-	dprintk("allocate_timeout_buffer() size %ubytes\n", dev->buffer_size);
+	dprintkdev(dev, "allocate_timeout_buffer() size %ubytes\n",
+		   dev->buffer_size);
 	if (dev->buffer_size == 0)
 		return -EINVAL;
 
 	if (dev->timeout_image) {
 		if (dev->timeout_buffer.buffer.flags & V4L2_BUF_FLAG_MAPPED)
 			return -EBUSY;
-		if (dev->buffer_size == dev->timeout_buffer_size)
+		/* keep images that have been written to, if they still fit */
+		if (dev->buffer_size == dev->timeout_buffer_size &&
+		    (!timeout_image_is_shared(dev->timeout) ||
+		     dev->timeout->pattern == V4L2L_TIMEOUT_PATTERN_USER ||
+		     pix_format_eq(&dev->timeout->format, pix_format, 1)))
 			return 0;
 		free_timeout_buffer(dev);
 	}
 
-	dev->timeout_image = vzalloc(dev->buffer_size);
-	if (!dev->timeout_image) {
-		dev->timeout_buffer_size = 0;
+	img = timeout_image_get(pix_format, dev->buffer_size,
+				dev->timeout_pattern, dev->timeout_colour);
+	if (!img)
 		return -ENOMEM;
-	}
-	dev->timeout_buffer_size = dev->buffer_size;
+	set_timeout_image(dev, img);
 	return 0;
 }
 /* init inner buffers, they are capture mode and flags are set as for capture
@@ -2638,6 +6250,7 @@ static void init_buffers(struct v4l2_loopback_device *dev, u32 bytes_used,
 		b->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 		v4l2l_get_timestamp(b);
+		dev->buffers[i].written_ns = 0;
 	}
 	dev->timeout_buffer = dev->buffers[0];
 	dev->timeout_buffer.buffer.m.offset = MAX_BUFFERS * buffer_size;
@@ -2661,10 +6274,6 @@ static void init_vdev(struct video_device *vdev, int nr)
 			    V4L2_CAP_STREAMING;
 #endif
 
-	if (debug > 1)
-		vdev->dev_debug = V4L2_DEV_DEBUG_IOCTL |
-				  V4L2_DEV_DEBUG_IOCTL_ARG;
-
 	vdev->vfl_dir = VFL_DIR_M2M;
 }
 
@@ -2679,59 +6288,237 @@ static void init_capture_param(struct v4l2_captureparm *capture_param)
 	capture_param->timeperframe.denominator = V4L2LOOPBACK_FPS_DEFAULT;
 }
 
+/* timer engine: instead of timers per device, a single timer services the
+ * sustain, timeout and tile deadlines of all devices.
+ * devices with armed deadlines are kept in a tree sorted by their earliest
+ * deadline, and the timer is always set to expire at the earliest deadline
+ * in the tree; when it fires, all expired devices are serviced in one go.
+ * lock order is dev->lock -> v4l2l_timer_lock.
+ */
+static DEFINE_SPINLOCK(v4l2l_timer_lock);
+static struct rb_root v4l2l_timer_queue = RB_ROOT;
+static struct timer_list v4l2l_timer;
+/* device currently being serviced by the timer callback (if any) */
+static struct v4l2_loopback_device *v4l2l_timer_running;
+
+/* remove a device from the timer queue; call with v4l2l_timer_lock held */
+static void timer_queue_remove(struct v4l2_loopback_device *dev)
+{
+	if (RB_EMPTY_NODE(&dev->timer_node))
+		return;
+	rb_erase(&dev->timer_node, &v4l2l_timer_queue);
+	RB_CLEAR_NODE(&dev->timer_node);
+}
+
+/* (re)insert a device according to its armed deadlines, and make sure the
+ * timer fires in time; call with v4l2l_timer_lock held */
+static void timer_queue_insert(struct v4l2_loopback_device *dev)
+{
+	const struct {
+		u32 which;
+		unsigned long expires;
+	} deadlines[] = {
+		{ V4L2L_TIMER_SUSTAIN, dev->sustain_expires },
+		{ V4L2L_TIMER_TIMEOUT, dev->timeout_expires },
+		{ V4L2L_TIMER_TILES, dev->tiles_expires },
+		{ V4L2L_TIMER_SYNTH, dev->synth_expires },
+	};
+	struct rb_node **link = &v4l2l_timer_queue.rb_node, *parent = NULL;
+	bool leftmost = true, found = false;
+	int i;
+
+	timer_queue_remove(dev);
+	if (!dev->timers_armed)
+		return;
+
+	/* the earliest of the armed deadlines */
+	for (i = 0; i < ARRAY_SIZE(deadlines); i++) {
+		if (!(dev->timers_armed & deadlines[i].which))
+			continue;
+		if (!found ||
+		    time_before(deadlines[i].expires, dev->timer_expires))
+			dev->timer_expires = deadlines[i].expires;
+		found = true;
+	}
+
+	while (*link) {
+		struct v4l2_loopback_device *other = rb_entry(
+			*link, struct v4l2_loopback_device, timer_node);
+		parent = *link;
+		if (time_before(dev->timer_expires, other->timer_expires)) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&dev->timer_node, parent, link);
+	rb_insert_color(&dev->timer_node, &v4l2l_timer_queue);
+
+	/* while the callback is running, it re-arms the timer itself */
+	if (leftmost && !v4l2l_timer_running)
+		mod_timer(&v4l2l_timer, dev->timer_expires);
+}
+
+/* arm a deadline (unless it is already armed); call with dev->lock held */
+static void arm_timer(struct v4l2_loopback_device *dev, u32 which,
+		      unsigned long expires)
+{
+	spin_lock(&v4l2l_timer_lock);
+	if (!(dev->timers_armed & which)) {
+		if (which == V4L2L_TIMER_SUSTAIN)
+			dev->sustain_expires = expires;
+		else if (which == V4L2L_TIMER_TIMEOUT)
+			dev->timeout_expires = expires;
+		else if (which == V4L2L_TIMER_TILES)
+			dev->tiles_expires = expires;
+		else
+			dev->synth_expires = expires;
+		dev->timers_armed |= which;
+		timer_queue_insert(dev);
+	}
+	spin_unlock(&v4l2l_timer_lock);
+}
+
+/* disarm a deadline (if it is armed); call with dev->lock held */
+static void disarm_timer(struct v4l2_loopback_device *dev, u32 which)
+{
+	spin_lock(&v4l2l_timer_lock);
+	if (dev->timers_armed & which) {
+		dev->timers_armed &= ~which;
+		timer_queue_insert(dev);
+	}
+	spin_unlock(&v4l2l_timer_lock);
+}
+
+/* disarm all deadlines of a device, and wait until the timer callback is
+ * done with it; must not be called with dev->lock held */
+static void cancel_timers(struct v4l2_loopback_device *dev)
+{
+	for (;;) {
+		spin_lock_bh(&v4l2l_timer_lock);
+		dev->timers_armed = 0;
+		timer_queue_remove(dev);
+		if (v4l2l_timer_running != dev) {
+			spin_unlock_bh(&v4l2l_timer_lock);
+			return;
+		}
+		spin_unlock_bh(&v4l2l_timer_lock);
+		cpu_relax();
+	}
+}
+
+/* only count time while there is both a writer and a reader (of the device
+ * or of one of its sinks) streaming */
 static void check_timers(struct v4l2_loopback_device *dev)
 {
-	if (has_output_token(dev->stream_tokens))
+	if (has_output_token(dev->stream_tokens) ||
+	    !has_streaming_readers(dev))
 		return;
 
-	if (dev->timeout_jiffies > 0 && !timer_pending(&dev->timeout_timer))
-		mod_timer(&dev->timeout_timer, jiffies + dev->timeout_jiffies);
-	if (dev->sustain_framerate && !timer_pending(&dev->sustain_timer))
-		mod_timer(&dev->sustain_timer,
+	if (dev->timeout_jiffies > 0)
+		arm_timer(dev, V4L2L_TIMER_TIMEOUT,
+			  jiffies + dev->timeout_jiffies);
+	if (dev->sustain_framerate)
+		arm_timer(dev, V4L2L_TIMER_SUSTAIN,
 			  jiffies + dev->frame_jiffies * 3 / 2);
 }
-#ifdef HAVE_TIMER_SETUP
-static void sustain_timer_clb(struct timer_list *t)
-{
-	struct v4l2_loopback_device *dev = from_timer(dev, t, sustain_timer);
-#else
-static void sustain_timer_clb(unsigned long nr)
+
+/* called by the timer engine with dev->lock held */
+static void sustain_timer_clb(struct v4l2_loopback_device *dev)
 {
-	struct v4l2_loopback_device *dev =
-		idr_find(&v4l2loopback_index_idr, nr);
-#endif
-	spin_lock(&dev->lock);
 	if (dev->sustain_framerate) {
 		dev->reread_count++;
-		dprintkrw("sustain_timer_clb() write_pos=%lld reread=%u\n",
+		v4l2l_stat_inc(dev, sustain_rereads);
+		trace_v4l2loopback_sustain(dev->vdev->num, dev->write_position,
+					   dev->reread_count);
+		dprintkrw(dev,
+			  "sustain_timer_clb() write_pos=%lld reread=%u\n",
 			  (long long)dev->write_position, dev->reread_count);
 		if (dev->reread_count == 1)
-			mod_timer(&dev->sustain_timer,
-				  jiffies + max(1UL, dev->frame_jiffies / 2));
+			dev->sustain_expires =
+				jiffies + max(1UL, dev->frame_jiffies / 2);
 		else
-			mod_timer(&dev->sustain_timer,
-				  jiffies + dev->frame_jiffies);
-		wake_up_all(&dev->read_event);
+			dev->sustain_expires = jiffies + dev->frame_jiffies;
+		dev->timers_armed |= V4L2L_TIMER_SUSTAIN;
+		wake_up_readers_locked(dev);
 	}
-	spin_unlock(&dev->lock);
 }
-#ifdef HAVE_TIMER_SETUP
-static void timeout_timer_clb(struct timer_list *t)
-{
-	struct v4l2_loopback_device *dev = from_timer(dev, t, timeout_timer);
-#else
-static void timeout_timer_clb(unsigned long nr)
+/* called by the timer engine with dev->lock held */
+static void timeout_timer_clb(struct v4l2_loopback_device *dev)
 {
-	struct v4l2_loopback_device *dev =
-		idr_find(&v4l2loopback_index_idr, nr);
-#endif
-	spin_lock(&dev->lock);
 	if (dev->timeout_jiffies > 0) {
 		dev->timeout_happened = 1;
-		mod_timer(&dev->timeout_timer, jiffies + dev->timeout_jiffies);
-		wake_up_all(&dev->read_event);
+		v4l2l_stat_inc(dev, timeouts);
+		trace_v4l2loopback_timeout(dev->vdev->num, dev->write_position,
+					   dev->reread_count);
+		dev->timeout_expires = jiffies + dev->timeout_jiffies;
+		dev->timers_armed |= V4L2L_TIMER_TIMEOUT;
+		wake_up_readers_locked(dev);
+	}
+}
+
+#ifdef HAVE_TIMER_SETUP
+static void v4l2l_timer_clb(struct timer_list *t)
+#else
+static void v4l2l_timer_clb(unsigned long data)
+#endif
+{
+	struct v4l2_loopback_device *dev;
+	struct rb_node *node;
+
+	spin_lock(&v4l2l_timer_lock);
+	while ((node = rb_first(&v4l2l_timer_queue))) {
+		const unsigned long now = jiffies;
+		u32 expired = 0;
+
+		dev = rb_entry(node, struct v4l2_loopback_device, timer_node);
+		if (time_before(now, dev->timer_expires))
+			break;
+
+		/* take the device out of the queue while we service it */
+		timer_queue_remove(dev);
+		if ((dev->timers_armed & V4L2L_TIMER_SUSTAIN) &&
+		    time_after_eq(now, dev->sustain_expires))
+			expired |= V4L2L_TIMER_SUSTAIN;
+		if ((dev->timers_armed & V4L2L_TIMER_TIMEOUT) &&
+		    time_after_eq(now, dev->timeout_expires))
+			expired |= V4L2L_TIMER_TIMEOUT;
+		if ((dev->timers_armed & V4L2L_TIMER_TILES) &&
+		    time_after_eq(now, dev->tiles_expires))
+			expired |= V4L2L_TIMER_TILES;
+		if ((dev->timers_armed & V4L2L_TIMER_SYNTH) &&
+		    time_after_eq(now, dev->synth_expires))
+			expired |= V4L2L_TIMER_SYNTH;
+		dev->timers_armed &= ~expired;
+		v4l2l_timer_running = dev;
+		spin_unlock(&v4l2l_timer_lock);
+
+		spin_lock(&dev->lock);
+		/* nobody is waiting for frames anymore: let the deadlines
+		 * lapse, check_timers() re-arms them when needed */
+		if (has_streaming_readers(dev)) {
+			if (expired & V4L2L_TIMER_SUSTAIN)
+				sustain_timer_clb(dev);
+			if (expired & V4L2L_TIMER_TIMEOUT)
+				timeout_timer_clb(dev);
+		}
+		/* (publishing a frame sleeps) */
+		if (expired & V4L2L_TIMER_TILES)
+			schedule_work(&dev->tiles_work);
+		if (expired & V4L2L_TIMER_SYNTH)
+			schedule_work(&dev->synth_work);
+		spin_lock(&v4l2l_timer_lock);
+		timer_queue_insert(dev);
+		v4l2l_timer_running = NULL;
+		spin_unlock(&dev->lock);
 	}
-	spin_unlock(&dev->lock);
+	node = rb_first(&v4l2l_timer_queue);
+	if (node) {
+		dev = rb_entry(node, struct v4l2_loopback_device, timer_node);
+		mod_timer(&v4l2l_timer, dev->timer_expires);
+	}
+	spin_unlock(&v4l2l_timer_lock);
 }
 
 /* init loopback main structure */
@@ -2804,6 +6591,13 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
 		return -ENOMEM;
+	dev->stats = alloc_percpu(struct v4l2l_stats);
+	BUILD_BUG_ON(sizeof(*dev->status) > PAGE_SIZE);
+	dev->status = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!dev->stats || !dev->status) {
+		err = -ENOMEM;
+		goto out_free_dev;
+	}
 
 	/* allocate id, if @id >= 0, we're requesting that specific id */
 	if (nr >= 0) {
@@ -2855,12 +6649,8 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	vdev_priv->device_nr = nr;
 	init_vdev(dev->vdev, nr);
 	dev->vdev->v4l2_dev = &dev->v4l2_dev;
-	dev->vdev->dev_debug =  V4L2_DEV_DEBUG_IOCTL |
-							V4L2_DEV_DEBUG_IOCTL_ARG |
-							V4L2_DEV_DEBUG_FOP |
-							V4L2_DEV_DEBUG_STREAMING |
-							V4L2_DEV_DEBUG_POLL |
-							V4L2_DEV_DEBUG_CTRL;
+	dev->debug = (conf && conf->debug > 0) ? conf->debug : 0;
+	v4l2l_update_dev_debug(dev);
 
 	/* initialise v4l2-loopback specific parameters */
 	MARK();
@@ -2897,6 +6687,8 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	dev->sustain_framerate = 0;
 	dev->timeout_jiffies = 0;
 	dev->timeout_image_io = 0;
+	dev->timeout_pattern = V4L2L_TIMEOUT_PATTERN_ZERO;
+	dev->timeout_colour = 0;
 
 	/* initialise OUTPUT and CAPTURE buffer values */
 	dev->image = NULL;
@@ -2913,38 +6705,50 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 	} while (0);
 	memset(dev->bufpos2index, 0, sizeof(dev->bufpos2index));
 	dev->write_position = 0;
+	dev->tee_source = NULL;
+	INIT_LIST_HEAD(&dev->tee_sinks);
+	INIT_LIST_HEAD(&dev->tee_node);
+	INIT_LIST_HEAD(&dev->conversions);
+	INIT_LIST_HEAD(&dev->tiles);
+	INIT_LIST_HEAD(&dev->timeout_slot_openers);
+	INIT_WORK(&dev->tiles_work, tiles_work_fn);
+	INIT_WORK(&dev->synth_work, synth_work_fn);
+	dev->progress_position = -1;
+	init_waitqueue_head(&dev->progress_event);
 
 	/* initialise synchronisation data */
 	atomic_set(&dev->open_count, 0);
 	mutex_init(&dev->image_mutex);
+	mutex_init(&dev->tee_mutex);
 	spin_lock_init(&dev->lock);
 	spin_lock_init(&dev->list_lock);
-	init_waitqueue_head(&dev->read_event);
 	dev->format_tokens = V4L2L_TOKEN_MASK;
 	dev->stream_tokens = V4L2L_TOKEN_MASK;
 
 	/* initialise sustain frame rate and timeout parameters, and timers */
 	dev->reread_count = 0;
+	dev->timeout = NULL;
 	dev->timeout_image = NULL;
 	dev->timeout_happened = 0;
-#ifdef HAVE_TIMER_SETUP
-	timer_setup(&dev->sustain_timer, sustain_timer_clb, 0);
-	timer_setup(&dev->timeout_timer, timeout_timer_clb, 0);
-#else
-	setup_timer(&dev->sustain_timer, sustain_timer_clb, nr);
-	setup_timer(&dev->timeout_timer, timeout_timer_clb, nr);
-#endif
+	RB_CLEAR_NODE(&dev->timer_node);
+	dev->timers_armed = 0;
 
 	/* initialise the control handler and add controls */
 	MARK();
 	hdl = &dev->ctrl_handler;
-	err = v4l2_ctrl_handler_init(hdl, 4);
+	err = v4l2_ctrl_handler_init(hdl, 10);
 	if (err)
 		goto out_unregister;
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_keepformat, NULL);
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_sustainframerate, NULL);
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_timeout, NULL);
 	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_timeoutimageio, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_timeoutpattern, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_timeoutcolour, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_writerhandover, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_compressedsize, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_tiledoutput, NULL);
+	v4l2_ctrl_new_custom(hdl, &v4l2loopback_ctrl_syntheticsource, NULL);
 	if (hdl->error) {
 		err = hdl->error;
 		goto out_free_handler;
@@ -2963,8 +6767,18 @@ static int v4l2_loopback_add(struct v4l2_loopback_config *conf, int *ret_nr)
 		err = -EFAULT;
 		goto out_free_device;
 	}
+	err = idr_alloc(&v4l2loopback_nr_idr, dev, dev->vdev->num,
+			dev->vdev->num + 1, GFP_KERNEL);
+	if (err < 0) {
+		/* highly unexpected: device number already in use */
+		video_unregister_device(dev->vdev);
+		dev->vdev = NULL;
+		goto out_free_handler;
+	}
 	v4l2loopback_create_sysfs(dev->vdev);
 	/* NOTE: ambivalent if sysfs entries fail */
+	v4l2loopback_create_debugfs(dev);
+	v4l2l_debug_key_update(0, dev->debug);
 
 	if (ret_nr)
 		*ret_nr = dev->vdev->num;
@@ -2975,44 +6789,292 @@ out_free_device:
 out_free_handler:
 	v4l2_ctrl_handler_free(&dev->ctrl_handler);
 out_unregister:
-	video_set_drvdata(dev->vdev, NULL);
+	if (dev->vdev)
+		video_set_drvdata(dev->vdev, NULL);
 	if (vdev_priv != NULL)
 		kfree(vdev_priv);
 	v4l2_device_unregister(&dev->v4l2_dev);
 out_free_idr:
 	idr_remove(&v4l2loopback_index_idr, nr);
 out_free_dev:
+	free_page((unsigned long)dev->status);
+	free_percpu(dev->stats);
 	kfree(dev);
 	return err;
 }
 
+/* must be called with v4l2loopback_ctl_rwsem held for writing and the sink's
+ * tee_mutex held, and only while the sink is not open */
+static void tee_unlink(struct v4l2_loopback_device *sink)
+{
+	struct v4l2_loopback_device *source = sink->tee_source;
+
+	spin_lock_bh(&source->lock);
+	list_del_init(&sink->tee_node);
+	sink->tee_source = NULL;
+	spin_unlock_bh(&source->lock);
+}
+
 static void v4l2_loopback_remove(struct v4l2_loopback_device *dev)
 {
 	int device_nr = v4l2loopback_get_vdev_nr(dev->vdev);
+	struct v4l2_loopback_device *sink, *n;
+
+	/* (the sinks are not open, as the device would be in use otherwise) */
+	mutex_lock(&dev->tee_mutex);
+	if (dev->tee_source)
+		tee_unlink(dev);
+	mutex_unlock(&dev->tee_mutex);
+	list_for_each_entry_safe(sink, n, &dev->tee_sinks, tee_node) {
+		mutex_lock(&sink->tee_mutex);
+		tee_unlink(sink);
+		mutex_unlock(&sink->tee_mutex);
+	}
+	idr_remove(&v4l2loopback_nr_idr, dev->vdev->num);
+	synth_stop(dev);
+	cancel_timers(dev);
+	cancel_work_sync(&dev->tiles_work);
+	cancel_work_sync(&dev->synth_work);
+	v4l2l_debug_key_update(dev->debug, 0);
 	mutex_lock(&dev->image_mutex);
 	free_buffers(dev);
 	free_timeout_buffer(dev);
 	mutex_unlock(&dev->image_mutex);
 	v4l2loopback_remove_sysfs(dev->vdev);
+	debugfs_remove_recursive(dev->debugfs_dir);
 	v4l2_ctrl_handler_free(&dev->ctrl_handler);
 	kfree(video_get_drvdata(dev->vdev));
 	video_unregister_device(dev->vdev);
 	v4l2_device_unregister(&dev->v4l2_dev);
 	idr_remove(&v4l2loopback_index_idr, device_nr);
+	/* the pages stay around for as long as they are mapped */
+	free_page((unsigned long)dev->status);
+	vfree(dev->meta);
+	free_percpu(dev->stats);
 	kfree(dev);
 }
 
+/* fill a v4l2_loopback_config with the actual values of a device */
+static void v4l2loopback_fill_config(struct v4l2_loopback_device *dev,
+				     struct v4l2_loopback_config *conf)
+{
+	snprintf(conf->card_label, sizeof(conf->card_label), "%s",
+		 dev->card_label);
+
+	conf->output_nr = dev->vdev->num;
+#ifdef SPLIT_DEVICES
+	conf->capture_nr = dev->vdev->num;
+#endif
+	conf->min_width = dev->min_width;
+	conf->min_height = dev->min_height;
+	conf->max_width = dev->max_width;
+	conf->max_height = dev->max_height;
+	conf->announce_all_caps = dev->announce_all_caps;
+	conf->max_buffers = dev->buffer_count;
+	conf->max_openers = dev->max_openers;
+	conf->debug = dev->debug;
+}
+
+/* a batch can hold no more devices than there are device nodes */
+#define V4L2LOOPBACK_MAX_BATCH VIDEO_NUM_DEVICES
+
+/* V4L2LOOPBACK_CTL_ADD_MANY
+ * the configs are all copied before any device is created; if a device
+ * cannot be created nonetheless, those created so far are kept, and
+ * list->count is set to their number */
+static int v4l2loopback_add_many(struct v4l2_loopback_config_list *list)
+{
+	struct v4l2_loopback_config __user *uconfs =
+		(void __user *)(uintptr_t)list->configs;
+	struct v4l2_loopback_config *confs = NULL;
+	struct v4l2_loopback_device *dev;
+	const u32 count = list->count;
+	u32 i;
+	int ret = 0;
+
+	list->count = 0;
+	if (!count)
+		return 0;
+	if (count > V4L2LOOPBACK_MAX_BATCH)
+		return -EINVAL;
+	if (uconfs) {
+		confs = kvmalloc_array(count, sizeof(*confs),
+				       GFP_KERNEL | __GFP_NOWARN);
+		if (!confs)
+			return -ENOMEM;
+		if (copy_from_user(confs, uconfs, count * sizeof(*confs))) {
+			ret = -EFAULT;
+			goto exit_add_many_free;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		int device_nr;
+		ret = v4l2_loopback_add(confs ? &confs[i] : NULL, &device_nr);
+		if (ret < 0)
+			break;
+		list->count++;
+		if (!confs)
+			continue;
+		memset(&confs[i], 0, sizeof(confs[i]));
+		if (v4l2loopback_lookup(device_nr, &dev) >= 0)
+			v4l2loopback_fill_config(dev, &confs[i]);
+	}
+	if (confs && list->count &&
+	    copy_to_user(uconfs, confs, list->count * sizeof(*confs)) &&
+	    ret >= 0)
+		ret = -EFAULT;
+	if (ret >= 0)
+		ret = list->count;
+exit_add_many_free:
+	kvfree(confs);
+	return ret;
+}
+
+/* V4L2LOOPBACK_CTL_LIST */
+static int v4l2loopback_list(struct v4l2_loopback_config_list *list)
+{
+	struct v4l2_loopback_config __user *uconfs =
+		(void __user *)(uintptr_t)list->configs;
+	struct v4l2_loopback_device *dev;
+	struct v4l2_loopback_config conf;
+	u32 total = 0;
+	int id;
+
+	idr_for_each_entry(&v4l2loopback_index_idr, dev, id) {
+		if (total < list->count) {
+			if (!uconfs)
+				return -EFAULT;
+			memset(&conf, 0, sizeof(conf));
+			v4l2loopback_fill_config(dev, &conf);
+			if (copy_to_user(uconfs + total, &conf, sizeof(conf)))
+				return -EFAULT;
+		}
+		total++;
+	}
+	list->count = total;
+	return 0;
+}
+
+/* V4L2LOOPBACK_CTL_REMOVE_MANY: all or nothing */
+static int v4l2loopback_remove_many(struct v4l2_loopback_config_list *list)
+{
+	struct v4l2_loopback_config __user *uconfs =
+		(void __user *)(uintptr_t)list->configs;
+	struct v4l2_loopback_device *dev;
+	struct v4l2_loopback_config conf;
+	int *nrs;
+	u32 i;
+	int ret = 0;
+
+	if (!list->count)
+		return 0;
+	if (!uconfs || list->count > V4L2LOOPBACK_MAX_BATCH)
+		return -EINVAL;
+	nrs = kmalloc_array(list->count, sizeof(*nrs), GFP_KERNEL);
+	if (!nrs)
+		return -ENOMEM;
+
+	/* first make sure that we can remove all the devices... */
+	for (i = 0; i < list->count; i++) {
+		if (copy_from_user(&conf, uconfs + i, sizeof(conf))) {
+			ret = -EFAULT;
+			break;
+		}
+		nrs[i] = conf.output_nr;
+		ret = v4l2loopback_lookup(nrs[i], &dev);
+		if (ret < 0)
+			break;
+		ret = 0;
+		if (atomic_read(&dev->open_count) > 0) {
+			ret = -EBUSY;
+			break;
+		}
+	}
+	/* ...then remove them (skipping duplicates) */
+	for (i = 0; !ret && i < list->count; i++) {
+		if (v4l2loopback_lookup(nrs[i], &dev) >= 0)
+			v4l2_loopback_remove(dev);
+	}
+	kfree(nrs);
+	return ret;
+}
+
+/* V4L2LOOPBACK_CTL_LINK */
+static int v4l2loopback_link(const struct v4l2_loopback_link *link)
+{
+	struct v4l2_loopback_device *source, *sink;
+	int ret;
+
+	ret = v4l2loopback_lookup(link->source_nr, &source);
+	if (ret < 0)
+		return ret;
+	ret = v4l2loopback_lookup(link->sink_nr, &sink);
+	if (ret < 0)
+		return ret;
+	/* no chains (and no loops) */
+	if (source == sink || source->tee_source ||
+	    !list_empty(&sink->tee_sinks))
+		return -EINVAL;
+	/* (open() pins the source under the same mutex) */
+	mutex_lock(&sink->tee_mutex);
+	if (sink->tee_source || atomic_read(&sink->open_count) > 0) {
+		mutex_unlock(&sink->tee_mutex);
+		return -EBUSY;
+	}
+	spin_lock_bh(&source->lock);
+	list_add_tail(&sink->tee_node, &source->tee_sinks);
+	sink->tee_source = source;
+	spin_unlock_bh(&source->lock);
+	mutex_unlock(&sink->tee_mutex);
+	dprintkdev(sink, "linked video%d to video%d\n", sink->vdev->num,
+		   source->vdev->num);
+	return 0;
+}
+
+/* V4L2LOOPBACK_CTL_UNLINK */
+static int v4l2loopback_unlink(int sink_nr)
+{
+	struct v4l2_loopback_device *sink;
+	int ret = v4l2loopback_lookup(sink_nr, &sink);
+
+	if (ret < 0)
+		return ret;
+	mutex_lock(&sink->tee_mutex);
+	if (!sink->tee_source)
+		ret = -EINVAL;
+	else if (atomic_read(&sink->open_count) > 0)
+		ret = -EBUSY;
+	else
+		tee_unlink(sink);
+	mutex_unlock(&sink->tee_mutex);
+	return ret;
+}
+
 static long v4l2loopback_control_ioctl(struct file *file, unsigned int cmd,
 				       unsigned long parm)
 {
 	struct v4l2_loopback_device *dev;
 	struct v4l2_loopback_config conf;
 	struct v4l2_loopback_config *confptr = &conf;
+	struct v4l2_loopback_config_list list;
+	struct v4l2_loopback_link link;
 	int device_nr, capture_nr, output_nr;
 	int ret;
 	const __u32 version = V4L2LOOPBACK_VERSION_CODE;
-
-	ret = mutex_lock_killable(&v4l2loopback_ctl_mutex);
+	/* only adding, removing and (un)linking devices needs exclusive
+	 * access */
+	const bool exclusive = (cmd == V4L2LOOPBACK_CTL_ADD ||
+				cmd == V4L2LOOPBACK_CTL_ADD_legacy ||
+				cmd == V4L2LOOPBACK_CTL_ADD_MANY ||
+				cmd == V4L2LOOPBACK_CTL_REMOVE ||
+				cmd == V4L2LOOPBACK_CTL_REMOVE_legacy ||
+				cmd == V4L2LOOPBACK_CTL_REMOVE_MANY ||
+				cmd == V4L2LOOPBACK_CTL_LINK ||
+				cmd == V4L2LOOPBACK_CTL_UNLINK);
+
+	ret = exclusive ? down_write_killable(&v4l2loopback_ctl_rwsem) :
+			  down_read_killable(&v4l2loopback_ctl_rwsem);
 	if (ret)
 		return ret;
 
@@ -3081,21 +7143,7 @@ static long v4l2loopback_control_ioctl(struct file *file, unsigned int cmd,
 			break;
 
 		/* v4l2_loopback_config identified a single device, so fetch the data */
-		snprintf(conf.card_label, sizeof(conf.card_label), "%s",
-			 dev->card_label);
-
-		conf.output_nr = dev->vdev->num;
-#ifdef SPLIT_DEVICES
-		conf.capture_nr = dev->vdev->num;
-#endif
-		conf.min_width = dev->min_width;
-		conf.min_height = dev->min_height;
-		conf.max_width = dev->max_width;
-		conf.max_height = dev->max_height;
-		conf.announce_all_caps = dev->announce_all_caps;
-		conf.max_buffers = dev->buffer_count;
-		conf.max_openers = dev->max_openers;
-		conf.debug = debug;
+		v4l2loopback_fill_config(dev, &conf);
 		MARK();
 		if (copy_to_user((void *)parm, &conf, sizeof(conf))) {
 			ret = -EFAULT;
@@ -3112,9 +7160,48 @@ static long v4l2loopback_control_ioctl(struct file *file, unsigned int cmd,
 		}
 		ret = 0;
 		break;
+		/* batch operations, working on an array of v4l2_loopback_config */
+	case V4L2LOOPBACK_CTL_ADD_MANY:
+	case V4L2LOOPBACK_CTL_LIST:
+	case V4L2LOOPBACK_CTL_REMOVE_MANY:
+		if (!parm)
+			break;
+		if (copy_from_user(&list, (void *)parm, sizeof(list))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (cmd == V4L2LOOPBACK_CTL_ADD_MANY) {
+			ret = v4l2loopback_add_many(&list);
+			/* (how many devices were created, even on errors) */
+			if (copy_to_user((void *)parm, &list, sizeof(list)) &&
+			    ret >= 0)
+				ret = -EFAULT;
+		}
+		else if (cmd == V4L2LOOPBACK_CTL_REMOVE_MANY)
+			ret = v4l2loopback_remove_many(&list);
+		else if (!(ret = v4l2loopback_list(&list)) &&
+			 copy_to_user((void *)parm, &list, sizeof(list)))
+			ret = -EFAULT;
+		break;
+		/* share the frames of one device with another */
+	case V4L2LOOPBACK_CTL_LINK:
+		if (!parm)
+			break;
+		if (copy_from_user(&link, (void *)parm, sizeof(link))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = v4l2loopback_link(&link);
+		break;
+	case V4L2LOOPBACK_CTL_UNLINK:
+		ret = v4l2loopback_unlink((__u32)parm);
+		break;
 	}
 
-	mutex_unlock(&v4l2loopback_ctl_mutex);
+	if (exclusive)
+		up_write(&v4l2loopback_ctl_rwsem);
+	else
+		up_read(&v4l2loopback_ctl_rwsem);
 	MARK();
 	return ret;
 }
@@ -3190,6 +7277,9 @@ static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops = {
 	.vidioc_g_parm			= &vidioc_g_parm,
 	.vidioc_s_parm			= &vidioc_s_parm,
 
+	.vidioc_g_selection		= &vidioc_g_selection,
+	.vidioc_s_selection		= &vidioc_s_selection,
+
 	.vidioc_reqbufs			= &vidioc_reqbufs,
 	.vidioc_querybuf		= &vidioc_querybuf,
 	.vidioc_qbuf			= &vidioc_qbuf,
@@ -3204,6 +7294,8 @@ static const struct v4l2_ioctl_ops v4l2_loopback_ioctl_ops = {
 
 	.vidioc_subscribe_event		= &vidioc_subscribe_event,
 	.vidioc_unsubscribe_event	= &v4l2_event_unsubscribe,
+
+	.vidioc_default			= &vidioc_default,
 	// clang-format on
 };
 
@@ -3217,6 +7309,7 @@ static void free_devices(void)
 {
 	idr_for_each(&v4l2loopback_index_idr, &free_device_cb, NULL);
 	idr_destroy(&v4l2loopback_index_idr);
+	idr_destroy(&v4l2loopback_nr_idr);
 }
 
 static int __init v4l2loopback_init_module(void)
@@ -3229,9 +7322,19 @@ static int __init v4l2loopback_init_module(void)
 	int i;
 	MARK();
 
+#ifdef HAVE_TIMER_SETUP
+	timer_setup(&v4l2l_timer, v4l2l_timer_clb, 0);
+#else
+	setup_timer(&v4l2l_timer, v4l2l_timer_clb, 0);
+#endif
+	/* NOTE: ambivalent if debugfs is not available */
+	v4l2loopback_debugfs_root = debugfs_create_dir("v4l2loopback", NULL);
+
 	err = misc_register(&v4l2loopback_misc);
-	if (err < 0)
+	if (err < 0) {
+		debugfs_remove_recursive(v4l2loopback_debugfs_root);
 		return err;
+	}
 
 	if (devices < 0) {
 		devices = 1;
@@ -3245,13 +7348,11 @@ static int __init v4l2loopback_init_module(void)
 		}
 	}
 
-	if (devices > MAX_DEVICES) {
-		devices = MAX_DEVICES;
+	if (devices > MAX_DEVICES)
 		printk(KERN_INFO
-		       "v4l2-loopback init() number of initial devices is "
-		       "limited to: %d\n",
+		       "v4l2-loopback init() only the first %d devices can be "
+		       "configured individually\n",
 		       MAX_DEVICES);
-	}
 
 	if (max_buffers > MAX_BUFFERS) {
 		max_buffers = MAX_BUFFERS;
@@ -3281,24 +7382,26 @@ static int __init v4l2loopback_init_module(void)
 	}
 
 	for (i = 0; i < devices; i++) {
+		/* devices beyond the parameter arrays get the defaults */
+		const bool configured = (i < MAX_DEVICES);
 		struct v4l2_loopback_config cfg = {
 			// clang-format off
-			.output_nr		= video_nr[i],
+			.output_nr		= configured ? video_nr[i] : -1,
 #ifdef SPLIT_DEVICES
-			.capture_nr		= video_nr[i],
+			.capture_nr		= configured ? video_nr[i] : -1,
 #endif
 			.min_width		= min_width,
 			.min_height		= min_height,
 			.max_width		= max_width,
 			.max_height		= max_height,
-			.announce_all_caps	= (!exclusive_caps[i]),
+			.announce_all_caps	= configured ? !exclusive_caps[i] :
+						  !V4L2LOOPBACK_DEFAULT_EXCLUSIVECAPS,
 			.max_buffers		= max_buffers,
 			.max_openers		= max_openers,
-			.debug			= debug,
 			// clang-format on
 		};
 		cfg.card_label[0] = 0;
-		if (card_label[i])
+		if (configured && card_label[i])
 			snprintf(cfg.card_label, sizeof(cfg.card_label), "%s",
 				 card_label[i]);
 		err = v4l2_loopback_add(&cfg, 0);
@@ -3326,6 +7429,7 @@ static int __init v4l2loopback_init_module(void)
 	return 0;
 error:
 	misc_deregister(&v4l2loopback_misc);
+	debugfs_remove_recursive(v4l2loopback_debugfs_root);
 	return err;
 }
 
@@ -3334,6 +7438,8 @@ static void v4l2loopback_cleanup_module(void)
 	MARK();
 	/* unregister the device -> it deletes /dev/video* */
 	free_devices();
+	timer_delete_sync(&v4l2l_timer);
+	debugfs_remove_recursive(v4l2loopback_debugfs_root);
 	/* and get rid of /dev/v4l2loopback */
 	misc_deregister(&v4l2loopback_misc);
 	dprintk("module removed\n");
@@ -64,6 +64,9 @@ struct v4l2_loopback_config {
 
 	/**
          * set the debugging level for this device
+         * (as with the module-wide 'debug' parameter: >0 for the messages
+         * about the device, >2 for per-frame messages; tracing function
+         * calls (>1) can only be enabled module-wide)
          */
 	__s32 debug;
 
@@ -105,4 +108,297 @@ struct v4l2_loopback_config {
 #define V4L2LOOPBACK_CTL_QUERY \
 	_IOWR(V4L2LOOPBACK_CTL_IOCTLMAGIC, 3, struct v4l2_loopback_config)
 
+/* an array of (struct v4l2_loopback_config), for the batch ioctls below */
+struct v4l2_loopback_config_list {
+	/**
+         * number of elements in the 'configs' array
+         * V4L2LOOPBACK_CTL_LIST:
+         * on return, holds the total number of loopback devices
+         * (which might be larger than the array that was passed in)
+         */
+	__u32 count;
+	__u32 reserved;
+	/**
+         * userspace pointer to an array of (struct v4l2_loopback_config)
+         * (cast to __u64 so the layout is the same for 32 and 64 bit processes)
+         */
+	__u64 configs;
+};
+
+/* a pointer to a (struct v4l2_loopback_config_list)
+ * creates 'count' devices, each according to its config (as with V4L2LOOPBACK_CTL_ADD).
+ * if 'configs' is NULL, 'count' devices are created with default values.
+ * at most 256 devices can be created at once.
+ * if a device cannot be created, the devices created so far are kept (they are
+ * likely to have been opened, e.g. by udev, already): the error is returned,
+ * and 'count' is set to the number of devices that were created.
+ *
+ * each config of a created device is updated with the values of that device
+ * (as with V4L2LOOPBACK_CTL_QUERY); on success, the number of devices is
+ * returned.
+ */
+#define V4L2LOOPBACK_CTL_ADD_MANY \
+	_IOWR(V4L2LOOPBACK_CTL_IOCTLMAGIC, 4, struct v4l2_loopback_config_list)
+
+/* a pointer to a (struct v4l2_loopback_config_list)
+ * fills the 'configs' array with (at most 'count') loopback devices,
+ * and sets 'count' to the total number of loopback devices.
+ * calling with count=0 just queries the number of devices.
+ */
+#define V4L2LOOPBACK_CTL_LIST \
+	_IOWR(V4L2LOOPBACK_CTL_IOCTLMAGIC, 5, struct v4l2_loopback_config_list)
+
+/* a pointer to a (struct v4l2_loopback_config_list)
+ * removes all the devices referred to by the 'configs' array (as with V4L2LOOPBACK_CTL_REMOVE,
+ * only output_nr is used).
+ * if any of the devices does not exist (ENODEV) or is still in use (EBUSY), none is removed.
+ */
+#define V4L2LOOPBACK_CTL_REMOVE_MANY \
+	_IOW(V4L2LOOPBACK_CTL_IOCTLMAGIC, 6, struct v4l2_loopback_config_list)
+
+/* a tee: the readers of the 'sink' device get the frames written to the
+ * 'source' device (without any copy, they read from the source's buffers).
+ * the sink cannot be written to while it is linked; its own settings (e.g.
+ * exclusive_caps, max_openers) still apply to its readers.
+ * the source's sustain_framerate and timeout apply to the sink's readers
+ * (the sink's cannot be set while it is linked), but they keep getting the
+ * last frame rather than the timeout image.
+ */
+struct v4l2_loopback_link {
+	__s32 source_nr; /* device number of the device being written to */
+	__s32 sink_nr; /* device number of the device to mirror it */
+	__u32 reserved[2];
+};
+
+/* a pointer to a (struct v4l2_loopback_link)
+ * links the sink to the source; the source must not be a sink itself, and
+ * the sink must neither be linked already, nor have sinks of its own.
+ * fails with EBUSY if the sink is open.
+ */
+#define V4L2LOOPBACK_CTL_LINK \
+	_IOW(V4L2LOOPBACK_CTL_IOCTLMAGIC, 7, struct v4l2_loopback_link)
+
+/* a device number (of a sink)
+ * unlinks the sink from its source; fails with EBUSY if the sink is open.
+ * (removing either device unlinks it, too)
+ */
+#define V4L2LOOPBACK_CTL_UNLINK _IOW(V4L2LOOPBACK_CTL_IOCTLMAGIC, 8, __u32)
+
+/* the status page
+ *
+ * a read-only page that can be mmap()ed (PROT_READ, one page) from any
+ * file handle of a loopback device at offset V4L2LOOPBACK_STATUS_PAGE_OFFSET.
+ * it is updated whenever the producer has written a frame, so consumers can
+ * learn about new frames without any syscall (by polling the page), and read
+ * them from their existing mmap()ed views of the buffers.
+ *
+ * the page is protected by a sequence counter:
+ *   do {
+ *     seq = status->seq;        (retry while odd; read with acquire semantics)
+ *     ...read the data...
+ *   } while (status->seq != seq);  (after a read barrier)
+ * as frames are not dequeued this way, the producer might overwrite a frame
+ * while it is being read; a consumer that cares should check that the slot
+ * still holds the same 'sequence' after it has copied the frame.
+ */
+#define V4L2LOOPBACK_STATUS_PAGE_OFFSET (1ULL << 40)
+#define V4L2LOOPBACK_STATUS_SLOTS 64
+
+struct v4l2_loopback_status_slot {
+	__u64 sequence; /* write position of the frame held by this slot */
+	__u64 timestamp_ns; /* the frame's timestamp (v4l2_buffer.timestamp) */
+	__u64 written_ns; /* CLOCK_MONOTONIC time the frame was written */
+	__u32 index; /* index of the buffer holding the frame */
+	__u32 offset; /* mmap() offset of that buffer (v4l2_buffer.m.offset) */
+	__u32 bytesused;
+	__u32 reserved;
+};
+
+struct v4l2_loopback_status {
+	__u32 seq; /* sequence counter, odd while an update is in progress */
+	__u32 used_buffer_count; /* number of slots in use */
+	/* number of frames written so far (the newest frame is in slot
+         * (write_position - 1) % used_buffer_count) */
+	__u64 write_position;
+	__u32 buffer_size; /* size of each buffer */
+	__u32 reserved[3];
+	struct v4l2_loopback_status_slot slots[V4L2LOOPBACK_STATUS_SLOTS];
+};
+
+/* per-frame metadata
+ *
+ * each buffer has a metadata slot of its own, which travels with the frame
+ * through the ring (without any extra syscall): the slots can be mmap()ed
+ * from any file handle of a loopback device at offset
+ * V4L2LOOPBACK_META_OFFSET, slot N (for the buffer with index N) being at
+ * N * V4L2LOOPBACK_META_SLOT_SIZE.  only the producer can map them writable.
+ *
+ * a (streaming) producer fills the slot of a dequeued OUTPUT buffer along
+ * with the frame; the driver sets the slot's 'sequence' when the buffer is
+ * queued (and invalidates it when the producer dequeues the buffer again).
+ * a consumer reads the slot of a dequeued CAPTURE buffer; as with the
+ * status page, the producer might overwrite it in the meantime, so a
+ * consumer that cares should check that 'sequence' matches the buffer's
+ * sequence both before and after copying the metadata.
+ * the timeout image has no metadata.
+ */
+#define V4L2LOOPBACK_META_OFFSET (1ULL << 41)
+#define V4L2LOOPBACK_META_SLOT_SIZE 4096
+
+struct v4l2_loopback_meta {
+	/* the frame's write position (v4l2_buffer.sequence holds its lower
+         * 32 bits); set by the driver, all ones while the slot is invalid */
+	__u64 sequence;
+	__u32 type; /* free for producer and consumers to agree on (fourcc) */
+	__u32 size; /* number of bytes used in 'data' */
+	__u8 data[V4L2LOOPBACK_META_SLOT_SIZE - 16];
+};
+
+/* sub-frame progress
+ *
+ * a producer that fills a (dequeued) OUTPUT buffer in place can publish how
+ * much of it is complete before queueing it, so consumers can start working
+ * on the top slices of a frame while the bottom is still being written.
+ * consumers read the partial frame through their own mmap() of the buffer
+ * (at 'offset', as with the status page).
+ * only streaming (MMAP) producers can publish progress.
+ */
+struct v4l2_loopback_progress {
+	__u64 sequence; /* the frame (its write position, see the status page) */
+	__u32 index; /* index of the buffer holding the frame */
+	__u32 offset; /* mmap() offset of that buffer (v4l2_buffer.m.offset) */
+	__u32 bytesused; /* number of bytes (from the start) that are complete */
+	__u32 timeout_ms; /* V4L2LOOPBACK_WAIT_PROGRESS: how long to wait */
+	__u32 flags;
+	__u32 reserved[3];
+};
+
+/* the frame has been queued (all of it is complete) */
+#define V4L2LOOPBACK_PROGRESS_DONE 0x00000001
+
+/* a pointer to a (struct v4l2_loopback_progress)
+ * producer: 'index' is the buffer being filled, 'bytesused' how much of it
+ * is complete; 'sequence' and 'offset' are returned.
+ * fails with EBUSY if the caller is not streaming OUTPUT buffers.
+ */
+#define VIDIOC_V4L2LOOPBACK_S_PROGRESS \
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 0, struct v4l2_loopback_progress)
+
+/* a pointer to a (struct v4l2_loopback_progress)
+ * consumer: waits (at most 'timeout_ms', 0 to just check) until 'bytesused'
+ * bytes of frame 'sequence' are complete, and returns the frame's progress.
+ * waiting for frame (write_position) waits for the frame being written next.
+ * fails with EAGAIN on timeout, and with EPIPE if the frame has been
+ * overwritten already.
+ */
+#define VIDIOC_V4L2LOOPBACK_WAIT_PROGRESS \
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 1, struct v4l2_loopback_progress)
+
+/* damage (dirty regions)
+ *
+ * a producer can tell which regions of a frame differ from the previous
+ * frame, so consumers (e.g. encoders of mostly static screen contents) need
+ * not process all of it.
+ * the damage reported to a consumer is relative to the frame it dequeued
+ * before; if it has missed frames in between (or for its first frame), it
+ * gets the whole frame.  frames repeated to sustain the framerate are
+ * reported as unchanged.
+ */
+#define V4L2LOOPBACK_DAMAGE_RECTS 16
+
+struct v4l2_loopback_damage {
+	__u32 index; /* V4L2LOOPBACK_G_DAMAGE: the (CAPTURE) buffer */
+	__u32 flags;
+	/* number of changed rectangles; if 0, the whole frame has changed
+	 * (unless V4L2LOOPBACK_DAMAGE_UNCHANGED is set) */
+	__u32 count;
+	__u32 sequence; /* V4L2LOOPBACK_G_DAMAGE: v4l2_buffer.sequence */
+	struct v4l2_rect rects[V4L2LOOPBACK_DAMAGE_RECTS];
+	__u32 reserved[4];
+};
+
+/* nothing has changed */
+#define V4L2LOOPBACK_DAMAGE_UNCHANGED 0x00000001
+
+/* a pointer to a (struct v4l2_loopback_damage)
+ * producer: sets the damage of the next frame it writes (by VIDIOC_QBUF or
+ * write()); frames without damage set have changed as a whole.
+ * the rectangles are clipped to the frame size.
+ * fails with EBUSY if the caller is not the producer.
+ */
+#define VIDIOC_V4L2LOOPBACK_S_DAMAGE \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 2, struct v4l2_loopback_damage)
+
+/* a pointer to a (struct v4l2_loopback_damage)
+ * consumer: gets the damage of the frame in the (dequeued) buffer 'index'.
+ * if 'sequence' differs from that of the dequeued buffer, the buffer has
+ * been overwritten in the meantime.
+ */
+#define VIDIOC_V4L2LOOPBACK_G_DAMAGE \
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 3, struct v4l2_loopback_damage)
+
+/* private events of the video devices (see VIDIOC_SUBSCRIBE_EVENT) */
+#define V4L2LOOPBACK_EVENT_BASE (V4L2_EVENT_PRIVATE_START)
+#define V4L2LOOPBACK_EVENT_OFFSET 0x08E00000
+
+/* a consumer (CAPTURE opener) is falling behind the producer
+ * this event is only sent to the opener concerned, when
+ * - frames were dropped because the consumer did not keep up
+ *   (the first buffer dequeued after such a gap has V4L2_BUF_FLAG_ERROR set)
+ * - the consumer lags behind so much that it is about to drop frames
+ *   (sent once, until the consumer has caught up again)
+ * if events are not dequeued in time, the 'dropped' counts accumulate.
+ */
+#define V4L2_EVENT_PRI_FRAME_LAG \
+	(V4L2LOOPBACK_EVENT_BASE + V4L2LOOPBACK_EVENT_OFFSET + 2)
+
+struct v4l2_event_frame_lag {
+	__u32 dropped; /* frames dropped since the last event */
+	__u32 lag; /* frames written but not yet read by this consumer */
+	__u32 sequence; /* sequence number of the frame being read */
+	__u32 total_dropped; /* frames dropped since the device was opened */
+};
+
+/* a consumer asked for a format (VIDIOC_TRY_FMT or VIDIOC_S_FMT on a CAPTURE
+ * buffer type) or a frame interval (VIDIOC_S_PARM) that the producer might
+ * not deliver (yet)
+ * producers that can deliver other formats subscribe to this event, so they
+ * can renegotiate rather than generate pixels that are thrown away.
+ * the event is sent to all subscribers of the device (for a linked device:
+ * of the source), whenever the request differs from the previous one; with
+ * V4L2_EVENT_SUB_FL_SEND_INITIAL, the latest request is sent right away.
+ * as consumers often probe formats with VIDIOC_TRY_FMT before they set one,
+ * V4L2LOOPBACK_FORMAT_REQUEST_SET tells the requests that are meant.
+ */
+#define V4L2_EVENT_PRI_FORMAT_REQUEST \
+	(V4L2LOOPBACK_EVENT_BASE + V4L2LOOPBACK_EVENT_OFFSET + 3)
+
+struct v4l2_event_format_request {
+	__u32 flags; /* V4L2LOOPBACK_FORMAT_REQUEST_* */
+	__u32 pixelformat;
+	__u32 width;
+	__u32 height;
+	__u32 field;
+	struct v4l2_fract timeperframe;
+	__u32 reserved[9];
+};
+
+/* pixelformat, width, height and field are set */
+#define V4L2LOOPBACK_FORMAT_REQUEST_FMT 0x00000001
+/* timeperframe is set */
+#define V4L2LOOPBACK_FORMAT_REQUEST_PARM 0x00000002
+/* the format was set (VIDIOC_S_FMT), not just tried */
+#define V4L2LOOPBACK_FORMAT_REQUEST_SET 0x00000004
+
+/* the stamp at the start of the frames of the synthetic source (see the
+ * 'synthetic_source' control), unless the frames are smaller than it
+ * consumers compare the timestamp with the time they got the frame, and the
+ * sequence with that of the buffer (or of the previous frame) to tell
+ * latency and dropped frames without a producer of their own.
+ */
+struct v4l2_loopback_stamp {
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC, when the frame was generated */
+	__u64 sequence; /* write position of the frame */
+};
+
 #endif /* _V4L2LOOPBACK_H */
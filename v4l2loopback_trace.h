@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * v4l2loopback_trace.h  --  tracepoints for the frame lifecycle
+ *
+ * use them with ftrace, e.g.
+ *   echo 1 > /sys/kernel/tracing/events/v4l2loopback/enable
+ *   cat /sys/kernel/tracing/trace_pipe
+ * or with perf/bpftrace (as 'v4l2loopback:<event>')
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM v4l2loopback
+
+#if !defined(_V4L2LOOPBACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _V4L2LOOPBACK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/videodev2.h>
+
+/* a buffer changing hands
+ * (device_nr is the video device number, e.g. '3' for /dev/video3) */
+DECLARE_EVENT_CLASS(v4l2loopback_buffer,
+	TP_PROTO(int device_nr, const struct v4l2_buffer *buf),
+	TP_ARGS(device_nr, buf),
+	TP_STRUCT__entry(
+		__field(int, device_nr)
+		__field(u32, type)
+		__field(u32, index)
+		__field(u32, sequence)
+		__field(u32, bytesused)
+	),
+	TP_fast_assign(
+		__entry->device_nr = device_nr;
+		__entry->type = buf->type;
+		__entry->index = buf->index;
+		__entry->sequence = buf->sequence;
+		__entry->bytesused = buf->bytesused;
+	),
+	TP_printk("video%d %s index=%u sequence=%u bytesused=%u",
+		  __entry->device_nr,
+		  V4L2_TYPE_IS_OUTPUT(__entry->type) ? "OUTPUT" : "CAPTURE",
+		  __entry->index, __entry->sequence, __entry->bytesused)
+);
+
+/* VIDIOC_QBUF */
+DEFINE_EVENT(v4l2loopback_buffer, v4l2loopback_qbuf,
+	TP_PROTO(int device_nr, const struct v4l2_buffer *buf),
+	TP_ARGS(device_nr, buf)
+);
+/* VIDIOC_DQBUF */
+DEFINE_EVENT(v4l2loopback_buffer, v4l2loopback_dqbuf,
+	TP_PROTO(int device_nr, const struct v4l2_buffer *buf),
+	TP_ARGS(device_nr, buf)
+);
+/* write() */
+DEFINE_EVENT(v4l2loopback_buffer, v4l2loopback_write,
+	TP_PROTO(int device_nr, const struct v4l2_buffer *buf),
+	TP_ARGS(device_nr, buf)
+);
+/* read() */
+DEFINE_EVENT(v4l2loopback_buffer, v4l2loopback_read,
+	TP_PROTO(int device_nr, const struct v4l2_buffer *buf),
+	TP_ARGS(device_nr, buf)
+);
+
+/* a reader got a frame assigned (for VIDIOC_DQBUF or read()) */
+TRACE_EVENT(v4l2loopback_capture_buffer,
+	TP_PROTO(int device_nr, const struct v4l2_buffer *buf,
+		 s64 read_position, s64 write_position, bool reread,
+		 bool timeout),
+	TP_ARGS(device_nr, buf, read_position, write_position, reread,
+		timeout),
+	TP_STRUCT__entry(
+		__field(int, device_nr)
+		__field(u32, index)
+		__field(u32, sequence)
+		__field(u32, bytesused)
+		__field(s64, read_position)
+		__field(s64, write_position)
+		__field(bool, reread)
+		__field(bool, timeout)
+	),
+	TP_fast_assign(
+		__entry->device_nr = device_nr;
+		__entry->index = buf->index;
+		__entry->sequence = buf->sequence;
+		__entry->bytesused = buf->bytesused;
+		__entry->read_position = read_position;
+		__entry->write_position = write_position;
+		__entry->reread = reread;
+		__entry->timeout = timeout;
+	),
+	TP_printk("video%d index=%u sequence=%u bytesused=%u read_pos=%lld write_pos=%lld%s%s",
+		  __entry->device_nr, __entry->index, __entry->sequence,
+		  __entry->bytesused, __entry->read_position,
+		  __entry->write_position, __entry->reread ? " reread" : "",
+		  __entry->timeout ? " timeout" : "")
+);
+
+/* a blocked reader woke up (after waiting for a frame) */
+TRACE_EVENT(v4l2loopback_wakeup,
+	TP_PROTO(int device_nr, s64 write_position, u64 wait_ns),
+	TP_ARGS(device_nr, write_position, wait_ns),
+	TP_STRUCT__entry(
+		__field(int, device_nr)
+		__field(s64, write_position)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->device_nr = device_nr;
+		__entry->write_position = write_position;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("video%d write_pos=%lld waited=%lluns", __entry->device_nr,
+		  __entry->write_position, __entry->wait_ns)
+);
+
+/* the sustain/timeout timers fired */
+DECLARE_EVENT_CLASS(v4l2loopback_timer,
+	TP_PROTO(int device_nr, s64 write_position, unsigned int reread_count),
+	TP_ARGS(device_nr, write_position, reread_count),
+	TP_STRUCT__entry(
+		__field(int, device_nr)
+		__field(s64, write_position)
+		__field(unsigned int, reread_count)
+	),
+	TP_fast_assign(
+		__entry->device_nr = device_nr;
+		__entry->write_position = write_position;
+		__entry->reread_count = reread_count;
+	),
+	TP_printk("video%d write_pos=%lld reread=%u", __entry->device_nr,
+		  __entry->write_position, __entry->reread_count)
+);
+
+DEFINE_EVENT(v4l2loopback_timer, v4l2loopback_sustain,
+	TP_PROTO(int device_nr, s64 write_position, unsigned int reread_count),
+	TP_ARGS(device_nr, write_position, reread_count)
+);
+DEFINE_EVENT(v4l2loopback_timer, v4l2loopback_timeout,
+	TP_PROTO(int device_nr, s64 write_position, unsigned int reread_count),
+	TP_ARGS(device_nr, write_position, reread_count)
+);
+
+#endif /* _V4L2LOOPBACK_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE v4l2loopback_trace
+#include <trace/define_trace.h>